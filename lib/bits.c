@@ -37,10 +37,19 @@ pub void getbits_msfirst(uint8_t byte, uint8_t *bits) {
 // reader
 //
 
+// The reader keeps up to 64 bits in an accumulator, so that a decoder can
+// look at several bits at once with peekn and then take as many as it
+// needs with consumen.
+// In the most-significant-first order the next bit is the highest of the
+// nacc buffered bits, in the least-significant-first order it's bit 0.
+// The accumulator is refilled with as many whole bytes as fit, so the
+// reader may take up to 8 bytes from the input beyond the last bit
+// that was consumed.
 pub typedef {
 	reader.t *in;
-	uint8_t byte; // currently loaded byte
-	uint8_t rem; // how many bits remain of the byte
+	uint64_t acc; // buffered bits
+	int nacc; // how many bits are buffered
+	bool eof; // true if the input has ended
 	bool reverse; // whether bits are reversed in bytes
 } reader_t;
 
@@ -59,50 +68,100 @@ pub void closereader(reader_t *r) {
 	free(r);
 }
 
-// Returns the next bit and returns 1 or 0.
-// Returns -1 if there is no next bit.
-pub int read1(reader_t *s) {
-	if (s->rem == 0) {
-		if (reader.read(s->in, &s->byte, 1) < 0) {
-			return -1;
+// Loads bytes into the accumulator until it has at least n bits
+// or the input ends.
+void fill(reader_t *s, int n) {
+	while (s->nacc < n && !s->eof) {
+		uint8_t buf[8];
+		int r = reader.read(s->in, buf, (size_t) (64 - s->nacc) / 8);
+		if (r <= 0) {
+			s->eof = true;
+			break;
+		}
+		for (int i = 0; i < r; i++) {
+			if (s->reverse) {
+				s->acc |= (uint64_t) buf[i] << s->nacc;
+			} else {
+				s->acc = (s->acc << 8) | buf[i];
+			}
+			s->nacc += 8;
 		}
-		s->rem = 8;
 	}
-	s->rem--;
-	int b = 0;
+}
+
+// Returns the value of the next n bits, up to 32, without consuming them.
+// If the input ends before n bits, the missing bits are zeros.
+// Returns -1 if there are no more bits at all.
+pub int64_t peekn(reader_t *s, int n) {
+	fill(s, n);
+	if (s->nacc == 0) {
+		return -1;
+	}
+	uint64_t mask = ((uint64_t) 1 << n) - 1;
 	if (s->reverse) {
-		b = s->byte & bitvals[s->rem];
+		return (int64_t) (s->acc & mask);
+	}
+	if (s->nacc >= n) {
+		return (int64_t) ((s->acc >> (s->nacc - n)) & mask);
+	}
+	return (int64_t) ((s->acc << (n - s->nacc)) & mask);
+}
+
+// Drops the next n bits, up to 32.
+// Returns false if there were fewer than n bits left.
+pub bool consumen(reader_t *s, int n) {
+	fill(s, n);
+	if (s->nacc < n) {
+		s->acc = 0;
+		s->nacc = 0;
+		return false;
+	}
+	s->nacc -= n;
+	if (s->reverse) {
+		s->acc = s->acc >> n;
 	} else {
-		b = s->byte & bitvals[7-s->rem];
+		s->acc &= ((uint64_t) 1 << s->nacc) - 1;
 	}
-	if (b > 0) b = 1;
-	return b;
+	return true;
+}
+
+// Returns the next bit and returns 1 or 0.
+// Returns -1 if there is no next bit.
+pub int read1(reader_t *s) {
+	int64_t b = peekn(s, 1);
+	if (b < 0) {
+		return -1;
+	}
+	consumen(s, 1);
+	return (int) b;
 }
 
-// Returns value of next n bits.
+// Returns value of next n bits, up to 31.
+// In the most-significant-first order the first bit is the highest bit
+// of the value, in the least-significant-first order it's the lowest.
 // Returns -1 if there is not enough bits in the stream.
 pub int readn(reader_t *s, int n) {
-	int r = 0;
-	for (int i = 0; i < n; i++) {
-		int c = read1(s);
-		if (c < 0) {
-			return -1;
-		}
-		r *= 2;
-		r += c;
+	if (n == 0) {
+		return 0;
+	}
+	int64_t v = peekn(s, n);
+	if (v < 0 || !consumen(s, n)) {
+		return -1;
 	}
-	return r;
+	return (int) v;
 }
 
 //
 // writer
 //
 
+// The writer collects bits in a 64-bit accumulator and writes them out
+// in whole bytes once 32 or more bits are collected.
 pub typedef {
 	bool err; // if the writer has encountered an error
 	writer.t *out; // writer for completed bytes
-	uint8_t buf; // byte being formed
-	uint8_t pos; // how many bits have been defined in the byte
+	uint64_t acc; // collected bits
+	int nacc; // how many bits are collected
 	bool reverse; // whether bits are packed into bytes least-significant first
 } writer_t;
 
@@ -116,22 +175,35 @@ pub writer_t *newwriter(writer.t *out, int bitorder) {
 	return w;
 }
 
+// Writes out all whole bytes from the accumulator.
 void flush(writer_t *w) {
-	uint8_t val = w->buf;
-	if (w->reverse) {
-		val = reversebyte(val);
+	uint8_t buf[8];
+	size_t n = 0;
+	while (w->nacc >= 8) {
+		if (w->reverse) {
+			buf[n++] = w->acc & 0xFF;
+			w->acc = w->acc >> 8;
+		} else {
+			buf[n++] = (w->acc >> (w->nacc - 8)) & 0xFF;
+		}
+		w->nacc -= 8;
+	}
+	if (!w->reverse) {
+		w->acc &= ((uint64_t) 1 << w->nacc) - 1;
 	}
-	if (writer.write(w->out, &val, 1) != 1) {
+	if (n > 0 && writer.write(w->out, buf, n) != (int) n) {
 		w->err = true;
-		return;
 	}
-	w->pos = 0;
-	w->buf = 0;
 }
 
 // Closes the writer and writes out the unfinished byte.
 pub bool closewriter(writer_t *w) {
-	if (w->pos > 0 && !w->err) {
+	if (!w->err) {
+		flush(w);
+	}
+	if (w->nacc > 0 && !w->err) {
+		// Pad the last byte with zeros.
+		writen(w, 0, 8 - w->nacc);
 		flush(w);
 	}
 	bool ok = !w->err;
@@ -139,23 +211,31 @@ pub bool closewriter(writer_t *w) {
 	return ok;
 }
 
-// Writes a bit into w.
+// Writes the n lowest bits of value, up to 32, into w.
+// In the most-significant-first order the highest of the n bits goes
+// first, in the least-significant-first order the lowest one.
 // Returns true on success and false on error.
-pub bool write1(writer_t *w, uint8_t bit) {
+pub bool writen(writer_t *w, uint32_t value, int n) {
 	if (w->err) {
 		return false;
 	}
-	if (bit) {
-		w->buf |= bitvals[w->pos];
+	uint64_t v = value & (((uint64_t) 1 << n) - 1);
+	if (w->reverse) {
+		w->acc |= v << w->nacc;
+	} else {
+		w->acc = (w->acc << n) | v;
 	}
-	w->pos++;
-	if (w->pos == 8) {
+	w->nacc += n;
+	if (w->nacc >= 32) {
 		flush(w);
-		if (w->err) {
-			return false;
-		}
 	}
-	return true;
+	return !w->err;
+}
+
+// Writes a bit into w.
+// Returns true on success and false on error.
+pub bool write1(writer_t *w, uint8_t bit) {
+	return writen(w, bit != 0, 1);
 }
 
 pub bool write(writer_t *w, uint8_t *bits, size_t nbits) {
@@ -164,17 +244,3 @@ pub bool write(writer_t *w, uint8_t *bits, size_t nbits) {
 	}
 	return true;
 }
-
-// Reverses bits in a byte.
-uint8_t reversebyte(uint8_t val) {
-	// 0xAA = 10101010
-	// 0x55 = 01010101
-	// 0xCC = 11001100
-	// 0x33 = 00110011
-	// 0xF0 = 11110000
-	// 0x0F = 00001111
-	val = ((val & 0xAA) >> 1) | ((val & 0x55) << 1);
-	val = ((val & 0xCC) >> 2) | ((val & 0x33) << 2);
-	val = ((val & 0xF0) >> 4) | ((val & 0x0F) << 4);
-	return val;
-}
@@ -11,6 +11,10 @@ int main() {
 	testwr(bits.STRAIGHT, val, nelem(val));
 	testwr(bits.REVERSED, val, nelem(val));
 
+	testwrn(bits.STRAIGHT);
+	testwrn(bits.REVERSED);
+	testorder();
+
 	return test.fails();
 }
 
@@ -62,6 +66,72 @@ void testwr(int order, uint8_t *val, size_t n) {
 	fclose(f);
 }
 
+// Writes fields of different widths and reads them back.
+void testwrn(int order) {
+	FILE *f = tmpfile();
+	writer.t *fw = writer.file(f);
+	bits.writer_t *w = bits.newwriter(fw, order);
+	for (int i = 0; i < 1000; i++) {
+		int n = 1 + i % 31;
+		bits.writen(w, testval(i), n);
+	}
+	test.truth("close", bits.closewriter(w) == true);
+	writer.free(fw);
+
+	fseek(f, 0, SEEK_SET);
+	reader.t *fr = reader.file(f);
+	bits.reader_t *br = bits.newreader(fr, order);
+	bool ok = true;
+	for (int i = 0; i < 1000; i++) {
+		int n = 1 + i % 31;
+		int64_t want = testval(i) & (((uint32_t) 1 << n) - 1);
+		if (bits.peekn(br, n) != want || bits.readn(br, n) != want) {
+			ok = false;
+			break;
+		}
+	}
+	test.truth("readn == writen", ok);
+	bits.closereader(br);
+	reader.free(fr);
+	fclose(f);
+}
+
+// Returns a scrambled value for field i.
+uint32_t testval(int i) {
+	return (uint32_t) i * 2654435761;
+}
+
+// Checks how writen packs bits into bytes in both orders.
+void testorder() {
+	uint8_t buf[2] = {};
+	uint8_t want_straight[] = {0xB4, 0x80};
+	uint8_t want_reversed[] = {0xA5, 0x01};
+
+	for (int k = 0; k < 2; k++) {
+		int order = bits.STRAIGHT;
+		uint8_t *want = want_straight;
+		if (k == 1) {
+			order = bits.REVERSED;
+			want = want_reversed;
+		}
+		FILE *f = tmpfile();
+		writer.t *fw = writer.file(f);
+		bits.writer_t *w = bits.newwriter(fw, order);
+		// 101, 10100, 1
+		bits.writen(w, 5, 3);
+		bits.writen(w, 20, 5);
+		bits.writen(w, 1, 1);
+		test.truth("close", bits.closewriter(w) == true);
+		writer.free(fw);
+
+		fseek(f, 0, SEEK_SET);
+		test.truth("2 bytes", fread(buf, 1, 2, f) == 2);
+		test.truth("byte 0", buf[0] == want[0]);
+		test.truth("byte 1", buf[1] == want[1]);
+		fclose(f);
+	}
+}
+
 void testunpack() {
 	uint8_t bits[8] = {};
 
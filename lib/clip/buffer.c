@@ -97,3 +97,41 @@ pub size_t read(t *b, char *buf, size_t bufsize) {
     }
     return p - buf;
 }
+
+/**
+ * Returns a pointer to the first contiguous block of buffered data and
+ * puts its size into n, or returns NULL if the buffer is empty.
+ * The data stays in the buffer until it's removed with skip, so it can be
+ * passed to a write call directly and only the written part dropped.
+ */
+pub char *peek(t *b, size_t *n) {
+    clip_t *c = b->first;
+    if (!c) {
+        *n = 0;
+        return NULL;
+    }
+    *n = c->size - c->pos;
+    return c->data + c->pos;
+}
+
+/**
+ * Removes up to n bytes from the front of the buffer.
+ */
+pub void skip(t *b, size_t n) {
+    while (n > 0) {
+        clip_t *c = b->first;
+        if (!c) break;
+        size_t avail = c->size - c->pos;
+        if (avail > n) {
+            c->pos += n;
+            return;
+        }
+        n -= avail;
+        b->first = c->next;
+        if (!c->next) {
+            b->last = NULL;
+        }
+        OS.free(c->data);
+        OS.free(c);
+    }
+}
@@ -18,6 +18,17 @@ int main() {
 
     test.streq(tmp, "abcdef");
 
+    // peek and skip across clips.
+    buffer.write(buf, "gh", 2);
+    buffer.write(buf, "ijk", 3);
+    char *p = buffer.peek(buf, &n);
+    test.truth("peek first clip", n == 2 && p[0] == 'g');
+    buffer.skip(buf, 3);
+    p = buffer.peek(buf, &n);
+    test.truth("peek after skip", n == 2 && p[0] == 'j');
+    buffer.skip(buf, 2);
+    test.truth("empty after skip", buffer.peek(buf, &n) == NULL && n == 0);
+
     buffer.free(buf);
     return test.fails();
 }
\ No newline at end of file
@@ -0,0 +1,661 @@
+// DEFLATE compressor (RFC 1951) with an optional zlib wrapper (RFC 1950).
+//
+// Input goes through a 64 KB window where LZ77 matches are found using
+// hash chains over 3-byte prefixes: head has the latest position for
+// every hash, and prev links every position to the previous one with the
+// same hash. Literals and matches are collected into blocks, and every
+// block is written in whichever form is the smallest: with dynamic
+// Huffman codes, with the fixed codes or stored as is.
+
+#import bits
+#import crypt/adler32
+#import writer
+
+#define WSIZE 32768 // the largest match distance the format allows
+#define WMASK 32767
+#define WINDOW 65536 // window size, two halves of WSIZE
+#define HASH_SIZE 32768
+#define HASH_SHIFT 17 // 32 - log2(HASH_SIZE)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_SYMS 16384 // symbols per block
+#define LAZY_LIMIT 32 // matches shorter than this are checked for a better one
+
+// How many hash chain entries to look at when searching for a match,
+// for every compression level.
+int maxchains[] = {0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+
+// Length symbols 257..285: base lengths and numbers of extra bits.
+int lenbase[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+int lenextra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+// Distance symbols 0..29: base distances and numbers of extra bits.
+int distbase[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+int distextra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order in which the code length code lengths are written.
+int clorder[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+pub typedef {
+	bits.writer_t *bw;
+	int maxchain;
+	bool store; // level 0, write stored blocks only
+	bool lazy;
+	bool zlib; // wrap the stream into zlib header and checksum
+	uint32_t adler;
+
+	uint8_t window[WINDOW];
+	size_t wlen; // bytes in the window
+	size_t pos; // first byte not compressed yet
+	size_t inserted; // positions before this one are in the hash chains
+	size_t blockstart; // first byte of the current block
+	int32_t head[HASH_SIZE]; // latest position for each hash, or -1
+	int32_t prev[WSIZE]; // previous position with the same hash, or -1
+
+	// Symbols of the current block: a literal lens[i] if dists[i] is 0,
+	// otherwise a match of lens[i] bytes dists[i] bytes back.
+	uint16_t lens[MAX_SYMS];
+	uint16_t dists[MAX_SYMS];
+	size_t nsyms;
+
+	uint8_t lencode[MAX_MATCH + 1]; // match length -> length symbol - 257
+	uint8_t distcode[512]; // see distsym
+} t;
+
+// Creates a compressor writing a raw deflate stream to out.
+// level is from 0 (no compression) to 9 (best compression).
+pub t *new(writer.t *out, int level) {
+	if (level < 0 || level > 9) {
+		panic("invalid compression level: %d", level);
+	}
+	t *d = calloc!(1, sizeof(t));
+	d->bw = bits.newwriter(out, bits.REVERSED);
+	d->maxchain = maxchains[level];
+	d->store = level == 0;
+	d->lazy = level >= 4;
+	for (size_t i = 0; i < HASH_SIZE; i++) {
+		d->head[i] = -1;
+	}
+	for (int c = 0; c < 29; c++) {
+		int n = 1 << lenextra[c];
+		for (int j = 0; j < n; j++) {
+			int len = lenbase[c] + j;
+			if (len <= MAX_MATCH) {
+				d->lencode[len] = (uint8_t) c;
+			}
+		}
+	}
+	for (int c = 0; c < 30; c++) {
+		int n = 1 << distextra[c];
+		for (int j = 0; j < n; j++) {
+			int dd = distbase[c] + j - 1;
+			if (dd < 256) {
+				d->distcode[dd] = (uint8_t) c;
+			} else {
+				d->distcode[256 + (dd >> 7)] = (uint8_t) c;
+			}
+		}
+	}
+	return d;
+}
+
+// Creates a compressor writing a zlib stream to out.
+pub t *newzlib(writer.t *out, int level) {
+	t *d = new(out, level);
+	d->zlib = true;
+	d->adler = adler32.init();
+	// Deflate with 32 KB window, default level, no dictionary.
+	bits.writen(d->bw, 0x78, 8);
+	bits.writen(d->bw, 0x9C, 8);
+	return d;
+}
+
+// Compresses n bytes from data.
+// Returns false on write error.
+pub bool write(t *d, const uint8_t *data, size_t n) {
+	if (d->zlib) {
+		d->adler = adler32.update(d->adler, data, n);
+	}
+	while (n > 0) {
+		if (d->wlen == WINDOW) {
+			slide(d);
+		}
+		size_t k = WINDOW - d->wlen;
+		if (k > n) k = n;
+		memcpy(d->window + d->wlen, data, k);
+		d->wlen += k;
+		data += k;
+		n -= k;
+		scan(d, false);
+	}
+	return !d->bw->err;
+}
+
+// Compresses the remaining input, finishes the stream and frees the
+// compressor. The underlying writer is left open.
+// Returns false on write error.
+pub bool close(t *d) {
+	scan(d, true);
+	endblock(d, true);
+	if (d->zlib) {
+		align(d->bw);
+		for (int i = 3; i >= 0; i--) {
+			bits.writen(d->bw, (d->adler >> (8 * i)) & 0xFF, 8);
+		}
+	}
+	bool ok = bits.closewriter(d->bw);
+	free(d);
+	return ok;
+}
+
+// Drops the first half of the window to make room for more input.
+void slide(t *d) {
+	// Finish the block while its bytes are still in the window,
+	// in case it's better written as stored.
+	endblock(d, false);
+	memcpy(d->window, d->window + WSIZE, WSIZE);
+	d->wlen -= WSIZE;
+	d->pos -= WSIZE;
+	d->inserted -= WSIZE;
+	d->blockstart = d->pos;
+	for (size_t i = 0; i < HASH_SIZE; i++) {
+		d->head[i] = shiftpos(d->head[i]);
+	}
+	for (size_t i = 0; i < WSIZE; i++) {
+		d->prev[i] = shiftpos(d->prev[i]);
+	}
+}
+
+int32_t shiftpos(int32_t p) {
+	if (p < WSIZE) {
+		return -1;
+	}
+	return p - WSIZE;
+}
+
+// Turns the window contents into symbols. Unless flush is set, leaves
+// the last MAX_MATCH bytes for later, when the matches can be extended
+// with more input.
+void scan(t *d, bool flush) {
+	while (d->pos < d->wlen) {
+		if (!flush && d->wlen - d->pos < MAX_MATCH) {
+			break;
+		}
+		size_t dist = 0;
+		size_t len = longest(d, d->pos, &dist);
+		insertupto(d, d->pos + 1);
+		if (len > 0 && d->lazy && len < LAZY_LIMIT) {
+			// If the next position has a longer match, it's better to
+			// write this byte as a literal and take that match instead.
+			size_t dist2 = 0;
+			if (longest(d, d->pos + 1, &dist2) > len) {
+				len = 0;
+			}
+		}
+		if (len == 0) {
+			d->lens[d->nsyms] = d->window[d->pos];
+			d->dists[d->nsyms] = 0;
+			d->pos++;
+		} else {
+			d->lens[d->nsyms] = (uint16_t) len;
+			d->dists[d->nsyms] = (uint16_t) dist;
+			d->pos += len;
+		}
+		d->nsyms++;
+		insertupto(d, d->pos);
+		if (d->nsyms == MAX_SYMS) {
+			endblock(d, false);
+		}
+	}
+}
+
+size_t hash(const uint8_t *p) {
+	uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+	return (uint32_t) (v * 2654435761) >> HASH_SHIFT;
+}
+
+// Adds positions up to end to the hash chains.
+void insertupto(t *d, size_t end) {
+	while (d->inserted < end) {
+		size_t p = d->inserted++;
+		if (p + MIN_MATCH > d->wlen) {
+			continue;
+		}
+		size_t h = hash(d->window + p);
+		d->prev[p & WMASK] = d->head[h];
+		d->head[h] = (int32_t) p;
+	}
+}
+
+// Finds the longest match for the bytes at position p.
+// Returns the match length and puts the distance into dist,
+// or returns 0 if there is no match.
+size_t longest(t *d, size_t p, size_t *dist) {
+	if (d->maxchain == 0) {
+		return 0;
+	}
+	size_t avail = d->wlen - p;
+	if (avail > MAX_MATCH) avail = MAX_MATCH;
+	if (avail < MIN_MATCH) {
+		return 0;
+	}
+	const uint8_t *s = d->window + p;
+	size_t best = MIN_MATCH - 1;
+	int chain = d->maxchain;
+	int32_t c = d->head[hash(s)];
+	while (c >= 0 && chain > 0) {
+		size_t cp = (size_t) c;
+		if (cp >= p || p - cp >= WSIZE) {
+			break;
+		}
+		chain--;
+		const uint8_t *m = d->window + cp;
+		// Check the byte that would make the match longer first,
+		// it rules out most candidates.
+		if (m[best] == s[best] && m[0] == s[0] && m[1] == s[1]) {
+			size_t n = 2;
+			while (n < avail && m[n] == s[n]) {
+				n++;
+			}
+			if (n > best) {
+				best = n;
+				*dist = p - cp;
+				if (n == avail) break;
+			}
+		}
+		c = d->prev[cp & WMASK];
+	}
+	if (best < MIN_MATCH) {
+		return 0;
+	}
+	return best;
+}
+
+int distsym(t *d, size_t dist) {
+	if (dist <= 256) {
+		return d->distcode[dist - 1];
+	}
+	return d->distcode[256 + ((dist - 1) >> 7)];
+}
+
+// Writes out the current block.
+void endblock(t *d, bool last) {
+	if (!last && d->pos == d->blockstart) {
+		return;
+	}
+	if (d->store) {
+		writestored(d, last);
+		startblock(d);
+		return;
+	}
+
+	uint32_t lfreq[286] = {};
+	uint32_t dfreq[30] = {};
+	for (size_t i = 0; i < d->nsyms; i++) {
+		if (d->dists[i] == 0) {
+			lfreq[d->lens[i]]++;
+		} else {
+			lfreq[257 + d->lencode[d->lens[i]]]++;
+			dfreq[distsym(d, d->dists[i])]++;
+		}
+	}
+	lfreq[256] = 1;
+	// Codes with fewer than two symbols can't be complete.
+	addpair(lfreq, 286);
+	addpair(dfreq, 30);
+
+	uint8_t llen[286];
+	uint8_t dlen[30];
+	buildlengths(lfreq, 286, 15, llen);
+	buildlengths(dfreq, 30, 15, dlen);
+
+	// The header: literal/length and distance code lengths, run-length
+	// coded and then Huffman coded with the code length code.
+	size_t hlit = 286;
+	while (hlit > 257 && llen[hlit - 1] == 0) hlit--;
+	size_t hdist = 30;
+	while (hdist > 1 && dlen[hdist - 1] == 0) hdist--;
+	uint8_t all[316];
+	memcpy(all, llen, hlit);
+	memcpy(all + hlit, dlen, hdist);
+	uint8_t rle[316];
+	uint8_t rlextra[316];
+	size_t nrle = rlelengths(all, hlit + hdist, rle, rlextra);
+	uint32_t clfreq[19] = {};
+	for (size_t i = 0; i < nrle; i++) {
+		clfreq[rle[i]]++;
+	}
+	uint8_t cllen[19];
+	buildlengths(clfreq, 19, 7, cllen);
+	size_t hclen = 19;
+	while (hclen > 4 && cllen[clorder[hclen - 1]] == 0) hclen--;
+
+	size_t dynbits = 3 + 5 + 5 + 4 + 3 * hclen;
+	for (size_t i = 0; i < nrle; i++) {
+		dynbits += (size_t) cllen[rle[i]] + (size_t) extrabits(rle[i]);
+	}
+	dynbits += databits(lfreq, dfreq, llen, dlen);
+
+	uint8_t fllen[286];
+	uint8_t fdlen[30];
+	fixedlengths(fllen, fdlen);
+	size_t fixbits = 3 + databits(lfreq, dfreq, fllen, fdlen);
+
+	size_t raw = d->pos - d->blockstart;
+	size_t storedbits = (raw + 5 * (raw / 65535 + 1)) * 8;
+
+	bits.writer_t *w = d->bw;
+	if (storedbits < dynbits && storedbits < fixbits) {
+		writestored(d, last);
+	} else if (fixbits <= dynbits) {
+		bits.writen(w, last, 1);
+		bits.writen(w, 1, 2);
+		writesyms(d, fllen, fdlen);
+	} else {
+		bits.writen(w, last, 1);
+		bits.writen(w, 2, 2);
+		bits.writen(w, hlit - 257, 5);
+		bits.writen(w, hdist - 1, 5);
+		bits.writen(w, hclen - 4, 4);
+		for (size_t i = 0; i < hclen; i++) {
+			bits.writen(w, cllen[clorder[i]], 3);
+		}
+		uint16_t clcodes[19];
+		makecodes(cllen, 19, clcodes);
+		for (size_t i = 0; i < nrle; i++) {
+			uint8_t s = rle[i];
+			bits.writen(w, clcodes[s], cllen[s]);
+			if (s >= 16) {
+				bits.writen(w, rlextra[i], extrabits(s));
+			}
+		}
+		writesyms(d, llen, dlen);
+	}
+	startblock(d);
+}
+
+void startblock(t *d) {
+	d->nsyms = 0;
+	d->blockstart = d->pos;
+}
+
+// Makes sure that at least two symbols have nonzero frequencies.
+void addpair(uint32_t *freq, size_t n) {
+	int used = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (freq[i] > 0) used++;
+	}
+	for (size_t i = 0; i < n && used < 2; i++) {
+		if (freq[i] == 0) {
+			freq[i] = 1;
+			used++;
+		}
+	}
+}
+
+void fixedlengths(uint8_t *llen, uint8_t *dlen) {
+	for (size_t i = 0; i < 286; i++) {
+		if (i < 144) {
+			llen[i] = 8;
+		} else if (i < 256) {
+			llen[i] = 9;
+		} else if (i < 280) {
+			llen[i] = 7;
+		} else {
+			llen[i] = 8;
+		}
+	}
+	for (size_t i = 0; i < 30; i++) {
+		dlen[i] = 5;
+	}
+}
+
+// Returns the size of the block's symbols in bits with the given codes.
+size_t databits(uint32_t *lfreq, uint32_t *dfreq, uint8_t *llen, uint8_t *dlen) {
+	size_t n = 0;
+	for (size_t i = 0; i < 286; i++) {
+		size_t b = llen[i];
+		if (i >= 257) {
+			b += (size_t) lenextra[i - 257];
+		}
+		n += lfreq[i] * b;
+	}
+	for (size_t i = 0; i < 30; i++) {
+		n += dfreq[i] * ((size_t) dlen[i] + (size_t) distextra[i]);
+	}
+	return n;
+}
+
+// Writes the block's symbols and the end of block code.
+void writesyms(t *d, uint8_t *llen, uint8_t *dlen) {
+	uint16_t lcodes[286];
+	uint16_t dcodes[30];
+	makecodes(llen, 286, lcodes);
+	makecodes(dlen, 30, dcodes);
+	bits.writer_t *w = d->bw;
+	for (size_t i = 0; i < d->nsyms; i++) {
+		size_t len = d->lens[i];
+		size_t dist = d->dists[i];
+		if (dist == 0) {
+			bits.writen(w, lcodes[len], llen[len]);
+			continue;
+		}
+		int lc = d->lencode[len];
+		bits.writen(w, lcodes[257 + lc], llen[257 + lc]);
+		if (lenextra[lc] > 0) {
+			bits.writen(w, len - (size_t) lenbase[lc], lenextra[lc]);
+		}
+		int dc = distsym(d, dist);
+		bits.writen(w, dcodes[dc], dlen[dc]);
+		if (distextra[dc] > 0) {
+			bits.writen(w, dist - (size_t) distbase[dc], distextra[dc]);
+		}
+	}
+	bits.writen(w, lcodes[256], llen[256]);
+}
+
+// Writes the block's bytes as stored blocks, up to 65535 bytes each.
+void writestored(t *d, bool last) {
+	bits.writer_t *w = d->bw;
+	size_t start = d->blockstart;
+	size_t n = d->pos - start;
+	while (true) {
+		size_t k = n;
+		if (k > 65535) k = 65535;
+		bits.writen(w, last && k == n, 1);
+		bits.writen(w, 0, 2);
+		align(w);
+		bits.writen(w, k, 16);
+		bits.writen(w, ~k & 0xFFFF, 16);
+		for (size_t i = 0; i < k; i++) {
+			bits.writen(w, d->window[start + i], 8);
+		}
+		start += k;
+		n -= k;
+		if (n == 0) break;
+	}
+}
+
+// Pads the output with zero bits to a byte boundary.
+void align(bits.writer_t *w) {
+	int pad = (8 - w->nacc % 8) % 8;
+	if (pad > 0) {
+		bits.writen(w, 0, pad);
+	}
+}
+
+// Returns the number of extra bits after a code length code symbol.
+int extrabits(int sym) {
+	switch (sym) {
+		case 16: { return 2; }
+		case 17: { return 3; }
+		case 18: { return 7; }
+	}
+	return 0;
+}
+
+// Run-length codes the code lengths for the dynamic block header.
+// Puts the symbols into syms and the values of their extra bits into
+// extra, returns the number of symbols.
+size_t rlelengths(const uint8_t *lens, size_t n, uint8_t *syms, uint8_t *extra) {
+	size_t k = 0;
+	size_t i = 0;
+	while (i < n) {
+		uint8_t l = lens[i];
+		size_t run = 1;
+		while (i + run < n && lens[i + run] == l) {
+			run++;
+		}
+		if (l == 0 && run >= 3) {
+			// 17: 3..10 zeros, 18: 11..138 zeros.
+			if (run > 138) run = 138;
+			if (run <= 10) {
+				syms[k] = 17;
+				extra[k++] = run - 3;
+			} else {
+				syms[k] = 18;
+				extra[k++] = run - 11;
+			}
+			i += run;
+			continue;
+		}
+		if (l != 0 && run >= 4) {
+			// The length, then 16: repeat it 3..6 times.
+			size_t r = run - 1;
+			if (r > 6) r = 6;
+			syms[k] = l;
+			extra[k++] = 0;
+			syms[k] = 16;
+			extra[k++] = r - 3;
+			i += 1 + r;
+			continue;
+		}
+		syms[k] = l;
+		extra[k++] = 0;
+		i++;
+	}
+	return k;
+}
+
+// Assigns canonical codes for the code lengths lens. The codes are
+// bit-reversed, because Huffman codes are packed starting from the
+// most significant bit, while everything else is packed starting from
+// the least significant one.
+void makecodes(const uint8_t *lens, size_t n, uint16_t *codes) {
+	int count[16] = {};
+	for (size_t i = 0; i < n; i++) {
+		count[lens[i]]++;
+	}
+	count[0] = 0;
+	int next[16] = {};
+	int code = 0;
+	for (int b = 1; b < 16; b++) {
+		code = (code + count[b - 1]) << 1;
+		next[b] = code;
+	}
+	for (size_t i = 0; i < n; i++) {
+		int len = lens[i];
+		if (len == 0) {
+			codes[i] = 0;
+			continue;
+		}
+		int c = next[len]++;
+		int r = 0;
+		for (int j = 0; j < len; j++) {
+			r = (r << 1) | (c & 1);
+			c = c >> 1;
+		}
+		codes[i] = (uint16_t) r;
+	}
+}
+
+// Computes Huffman code lengths for n symbols with frequencies freq,
+// none of them longer than maxlen. Unused symbols get zero lengths.
+void buildlengths(const uint32_t *freq, size_t n, int maxlen, uint8_t *lens) {
+	uint32_t f[286];
+	memcpy(f, freq, n * sizeof(uint32_t));
+	// Flattening the frequencies makes the tree shallower.
+	while (huffmanlengths(f, n, lens) > maxlen) {
+		for (size_t i = 0; i < n; i++) {
+			if (f[i] > 0) {
+				f[i] = (f[i] + 1) / 2;
+			}
+		}
+	}
+}
+
+// Computes optimal code lengths for frequencies f.
+// Returns the largest length.
+int huffmanlengths(const uint32_t *f, size_t n, uint8_t *lens) {
+	size_t leaves[286];
+	size_t nl = 0;
+	for (size_t i = 0; i < n; i++) {
+		lens[i] = 0;
+		if (f[i] > 0) {
+			leaves[nl++] = i;
+		}
+	}
+	if (nl == 0) {
+		return 0;
+	}
+	if (nl == 1) {
+		lens[leaves[0]] = 1;
+		return 1;
+	}
+	// Sort the leaves by frequency.
+	for (size_t i = 1; i < nl; i++) {
+		size_t x = leaves[i];
+		size_t j = i;
+		while (j > 0 && f[leaves[j - 1]] > f[x]) {
+			leaves[j] = leaves[j - 1];
+			j--;
+		}
+		leaves[j] = x;
+	}
+	// Nodes [0, nl) are the leaves, the following ones are internal.
+	// Internal nodes are created in nondecreasing weight order, so the
+	// two lightest nodes are always at the fronts of the two queues.
+	uint32_t w[572];
+	size_t parent[572];
+	for (size_t i = 0; i < nl; i++) {
+		w[i] = f[leaves[i]];
+	}
+	size_t li = 0;
+	size_t ii = nl;
+	size_t next = nl;
+	size_t root = 2 * nl - 2;
+	while (next <= root) {
+		size_t a = lightest(w, &li, nl, &ii, next);
+		size_t b = lightest(w, &li, nl, &ii, next);
+		w[next] = w[a] + w[b];
+		parent[a] = next;
+		parent[b] = next;
+		next++;
+	}
+	// Parents come after their children, so depths can be computed
+	// going down from the root.
+	int depth[572];
+	depth[root] = 0;
+	for (size_t i = root; i > 0; i--) {
+		depth[i - 1] = depth[parent[i - 1]] + 1;
+	}
+	int max = 0;
+	for (size_t i = 0; i < nl; i++) {
+		lens[leaves[i]] = (uint8_t) depth[i];
+		if (depth[i] > max) max = depth[i];
+	}
+	return max;
+}
+
+// Takes the lightest node from the fronts of the leaves and the
+// internal nodes queues.
+size_t lightest(uint32_t *w, size_t *li, size_t nl, size_t *ii, size_t next) {
+	size_t r = *ii;
+	if (*li < nl && (*ii >= next || w[*li] <= w[*ii])) {
+		r = *li;
+		*li = r + 1;
+	} else {
+		*ii = r + 1;
+	}
+	return r;
+}
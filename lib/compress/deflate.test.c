@@ -0,0 +1,43 @@
+#import compress/deflate
+#import test
+#import writer
+
+int main() {
+	// An empty zlib stream is the header, an empty fixed block and the
+	// checksum of nothing.
+	uint8_t empty[] = {0x78, 0x9C, 0x03, 0x00, 0x00, 0x00, 0x00, 0x01};
+	uint8_t buf[100] = {};
+	size_t n = compress(NULL, 0, 6, buf, sizeof(buf));
+	test.truth("empty size", n == sizeof(empty));
+	test.truth("empty bytes", memcmp(buf, empty, sizeof(empty)) == 0);
+
+	// Repetitive input shrinks a lot, more with higher levels.
+	size_t len = 200000;
+	uint8_t *text = calloc!(len, 1);
+	const char *s = "the quick brown fox jumps over the lazy dog ";
+	for (size_t i = 0; i < len; i++) {
+		text[i] = (uint8_t) s[(i + i / 1000) % strlen(s)];
+	}
+	uint8_t *out = calloc!(len + 1000, 1);
+	size_t n0 = compress(text, len, 0, out, len + 1000);
+	size_t n1 = compress(text, len, 1, out, len + 1000);
+	size_t n9 = compress(text, len, 9, out, len + 1000);
+	test.truth("level 0 stores", n0 > len);
+	test.truth("level 1 compresses", n1 < len / 50);
+	test.truth("level 9 <= level 1", n9 <= n1);
+	free(text);
+	free(out);
+	return test.fails();
+}
+
+// Compresses data into a zlib stream in out.
+// Returns the stream size.
+size_t compress(uint8_t *data, size_t n, int level, uint8_t *out, size_t outsize) {
+	writer.t *w = writer.static_buffer(out, outsize);
+	deflate.t *d = deflate.newzlib(w, level);
+	deflate.write(d, data, n);
+	test.truth("close", deflate.close(d));
+	size_t size = w->nwritten;
+	writer.free(w);
+	return size;
+}
@@ -0,0 +1,247 @@
+// gzip file format (RFC 1952): deflate data between a header and a
+// trailer with the CRC-32 and the size of the uncompressed data.
+// A file may have several such members one after another, and their
+// data is concatenated.
+
+#import bits
+#import compress/deflate
+#import compress/inflate
+#import compress/parallel
+#import crypt/crc32
+#import reader
+#import writer
+
+// Header flags. FTEXT (1) is only a hint and is ignored.
+enum {
+	FHCRC = 2,
+	FEXTRA = 4,
+	FNAME = 8,
+	FCOMMENT = 16
+}
+
+typedef {
+	bits.reader_t *br;
+	inflate.t *z; // decoder for the current member, or NULL between members
+	uint32_t crc; // checksum of the member's data so far
+	uint32_t size; // size of the member's data so far, mod 2^32
+	bool ended;
+	char err[100];
+} state_t;
+
+// Returns a reader with the data decompressed from the gzip stream in.
+// Corrupt data ends the stream early, check it with error.
+pub reader.t *reader(reader.t *in) {
+	state_t *s = calloc!(1, sizeof(state_t));
+	s->br = bits.newreader(in, bits.REVERSED);
+	return reader.new(s, readfunc, freefunc);
+}
+
+// Returns the error message if the stream read by r, which must have
+// been created by gzip.reader, turned out to be corrupt, or NULL.
+pub const char *error(reader.t *r) {
+	state_t *s = r->data;
+	if (s->err[0] == '\0') {
+		return NULL;
+	}
+	return s->err;
+}
+
+void freefunc(void *ctx) {
+	state_t *s = ctx;
+	if (s->z) {
+		inflate.free(s->z);
+	}
+	bits.closereader(s->br);
+	free(s);
+}
+
+int readfunc(void *ctx, uint8_t *buf, size_t n) {
+	state_t *s = ctx;
+	while (!s->ended) {
+		if (!s->z) {
+			startmember(s);
+			continue;
+		}
+		int r = inflate.read(s->z, buf, n);
+		if (r > 0) {
+			s->crc = crc32.update(s->crc, buf, (size_t) r);
+			s->size += (uint32_t) r;
+			return r;
+		}
+		const char *err = inflate.error(s->z);
+		if (err) {
+			fail(s, err);
+			break;
+		}
+		endmember(s);
+	}
+	return EOF;
+}
+
+void fail(state_t *s, const char *msg) {
+	snprintf(s->err, sizeof(s->err), "%s", msg);
+	s->ended = true;
+}
+
+// Reads the header of the next member, or ends the stream if there
+// are no more members.
+void startmember(state_t *s) {
+	int id1 = readbyte(s);
+	if (id1 < 0) {
+		s->ended = true;
+		return;
+	}
+	int id2 = readbyte(s);
+	int cm = readbyte(s);
+	int flags = readbyte(s);
+	if (id1 != 0x1F || id2 != 0x8B) {
+		fail(s, "not a gzip stream");
+		return;
+	}
+	if (cm != 8) {
+		fail(s, "unknown compression method");
+		return;
+	}
+	// Modification time, extra flags and OS.
+	for (int i = 0; i < 6; i++) {
+		readbyte(s);
+	}
+	if (flags & FEXTRA) {
+		int len = readbyte(s);
+		len |= readbyte(s) << 8;
+		for (int i = 0; i < len; i++) {
+			readbyte(s);
+		}
+	}
+	if (flags & FNAME) {
+		skipstring(s);
+	}
+	if (flags & FCOMMENT) {
+		skipstring(s);
+	}
+	if (flags & FHCRC) {
+		readbyte(s);
+		readbyte(s);
+	}
+	if (s->br->eof && s->br->nacc == 0) {
+		fail(s, "unexpected end of header");
+		return;
+	}
+	s->z = inflate.new(s->br);
+	s->crc = 0;
+	s->size = 0;
+}
+
+// Checks the trailer of the current member.
+void endmember(state_t *s) {
+	inflate.free(s->z);
+	s->z = NULL;
+	// The trailer starts at a byte boundary.
+	int n = s->br->nacc % 8;
+	if (n > 0) {
+		bits.consumen(s->br, n);
+	}
+	int crc = bits.readn(s->br, 16);
+	int crchi = bits.readn(s->br, 16);
+	int size = bits.readn(s->br, 16);
+	int sizehi = bits.readn(s->br, 16);
+	if (crc < 0 || crchi < 0 || size < 0 || sizehi < 0) {
+		fail(s, "unexpected end of data");
+		return;
+	}
+	if (((uint32_t) crchi << 16 | (uint32_t) crc) != s->crc) {
+		fail(s, "crc mismatch");
+		return;
+	}
+	if (((uint32_t) sizehi << 16 | (uint32_t) size) != s->size) {
+		fail(s, "size mismatch");
+	}
+}
+
+int readbyte(state_t *s) {
+	return bits.readn(s->br, 8);
+}
+
+void skipstring(state_t *s) {
+	while (true) {
+		int c = readbyte(s);
+		if (c <= 0) break;
+	}
+}
+
+//
+// Writer
+//
+
+pub typedef {
+	writer.t *out;
+	deflate.t *d;
+	uint32_t crc;
+	uint32_t size;
+	bool err;
+} writer_t;
+
+// Creates a writer that compresses data into a gzip member in out.
+// level is from 0 to 9, as in deflate.
+pub writer_t *newwriter(writer.t *out, int level) {
+	writer_t *w = calloc!(1, sizeof(writer_t));
+	w->out = out;
+	// No flags, no modification time, unknown OS.
+	uint8_t head[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 255};
+	if (writer.write(out, head, 10) != 10) {
+		w->err = true;
+	}
+	w->d = deflate.new(out, level);
+	return w;
+}
+
+// Compresses n bytes from data.
+// Returns false on write error.
+pub bool write(writer_t *w, const uint8_t *data, size_t n) {
+	w->crc = crc32.update(w->crc, data, n);
+	w->size += (uint32_t) n;
+	if (!deflate.write(w->d, data, n)) {
+		w->err = true;
+	}
+	return !w->err;
+}
+
+// Finishes the member and frees the writer.
+// The underlying writer is left open.
+// Returns false on write error.
+pub bool close(writer_t *w) {
+	bool ok = deflate.close(w->d) && !w->err;
+	uint8_t tail[8] = {};
+	for (int i = 0; i < 4; i++) {
+		tail[i] = (w->crc >> (8 * i)) & 0xFF;
+		tail[4 + i] = (w->size >> (8 * i)) & 0xFF;
+	}
+	if (writer.write(w->out, tail, 8) != 8) {
+		ok = false;
+	}
+	free(w);
+	return ok;
+}
+
+// Compression levels to pass as the compression function argument.
+int levels[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+// Returns a parallel compressor that writes a gzip file into out.
+// The input is cut into blocks of blocksize bytes, and every block
+// becomes a separate member, compressed on one of nthreads threads.
+// Any gzip reader joins the members back. The compression is slightly
+// worse than with a single member, because matches can't reach into
+// previous blocks.
+pub parallel.t *newparallel(writer.t *out, int level, size_t blocksize, nthreads) {
+	if (level < 0 || level > 9) {
+		panic("invalid compression level: %d", level);
+	}
+	return parallel.new(out, compressblock, &levels[level], blocksize, nthreads);
+}
+
+void compressblock(void *arg, const uint8_t *data, size_t n, writer.t *out) {
+	int *level = arg;
+	writer_t *w = newwriter(out, *level);
+	write(w, data, n);
+	close(w);
+}
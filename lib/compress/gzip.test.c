@@ -0,0 +1,51 @@
+#import compress/gzip
+#import reader
+#import test
+
+// "hello, hello, hello\n" compressed with gzip.
+uint8_t hello[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xcb, 0x48,
+	0xcd, 0xc9, 0xc9, 0xd7, 0x51, 0xc8, 0x40, 0xa2, 0xb8, 0x00, 0xe7, 0x42,
+	0x6e, 0x52, 0x14, 0x00, 0x00, 0x00
+};
+
+int main() {
+	char buf[100] = {};
+	test.truth("read", readall(hello, sizeof(hello), buf, sizeof(buf)));
+	test.streq("hello, hello, hello\n", buf);
+
+	// Two members make one stream.
+	uint8_t two[60] = {};
+	memcpy(two, hello, 30);
+	memcpy(two + 30, hello, 30);
+	test.truth("read two", readall(two, sizeof(two), buf, sizeof(buf)));
+	test.streq("hello, hello, hello\nhello, hello, hello\n", buf);
+
+	// A damaged checksum is an error.
+	uint8_t bad[30] = {};
+	memcpy(bad, hello, 30);
+	bad[23] ^= 1;
+	test.truth("bad crc", !readall(bad, sizeof(bad), buf, sizeof(buf)));
+
+	// So is a cut stream.
+	test.truth("cut", !readall(hello, 20, buf, sizeof(buf)));
+	return test.fails();
+}
+
+// Decompresses n bytes of data into buf as a string.
+// Returns false if the data is corrupt.
+bool readall(uint8_t *data, size_t n, char *buf, size_t bufsize) {
+	memset(buf, 0, bufsize);
+	reader.t *in = reader.static_buffer(data, n);
+	reader.t *r = gzip.reader(in);
+	size_t len = 0;
+	while (len < bufsize - 1) {
+		int q = reader.read(r, (uint8_t *) buf + len, bufsize - 1 - len);
+		if (q <= 0) break;
+		len += (size_t) q;
+	}
+	bool ok = gzip.error(r) == NULL;
+	reader.free(r);
+	reader.free(in);
+	return ok;
+}
@@ -8,12 +8,28 @@ pub typedef {
 	node_t *left, *right;
 } node_t;
 
+// Decoding table entry for a FASTBITS-bit prefix of the input.
+pub typedef {
+	int val; // the decoded value
+	int len; // code length, or 0 if the code is longer than FASTBITS
+	node_t *next; // for long codes, the node reached after FASTBITS bits
+} entry_t;
+
 pub typedef {
 	node_t *root; // the tree root.
 	node_t *pool; // malloc root, for the free call.
 	size_t poolpos;
+
+	// Decoding table, built when the first reader is created.
+	entry_t *table;
+	bool tablerev; // true if the table is for the reversed bit order
 } tree_t;
 
+// The decoder looks at this many bits at once. Codes up to this length,
+// which are almost all codes in practice, are decoded with one table
+// lookup, longer ones continue bit by bit down the tree.
+#define FASTBITS 9
+
 tree_t *newtree() {
 	tree_t *t = calloc!(1, sizeof(tree_t));
 	t->pool = calloc!(512, sizeof(node_t));
@@ -29,6 +45,7 @@ node_t *newnode(tree_t *t) {
 }
 
 pub void freetree(tree_t *t) {
+	free(t->table);
 	free(t->pool);
 	free(t);
 }
@@ -142,44 +159,130 @@ int cmp(const void *a, *b) {
 pub typedef {
 	bits.reader_t *br;
 	node_t *root;
-	node_t *curr;
+	entry_t *table;
 } reader_t;
 
 // Returns a new reader to read from br.
 pub reader_t *newreader(tree_t *tree, bits.reader_t *br) {
+	prepare(tree, br->reverse);
 	reader_t *r = calloc!(1, sizeof(reader_t));
 	r->br = br;
 	r->root = tree->root;
-	r->curr = tree->root;
+	r->table = tree->table;
 	return r;
 }
 
+// Builds the decoding table of the tree for the given bit order in
+// advance. Readers build it when needed, but that's not safe when readers
+// for the same tree are created on several threads.
+pub void prepare(tree_t *tree, bool reversed) {
+	if (tree->table && (int) tree->tablerev == (int) reversed) {
+		return;
+	}
+	buildtable(tree, reversed);
+}
+
 // Closes and frees reader r.
 pub void closereader(reader_t *r) {
 	free(r);
 }
 
 // Reads next character from reader r.
+// Returns EOF at the end of input, also if it ends in the middle of a code.
 pub int read(reader_t *r) {
-	while (true) {
+	int64_t peek = bits.peekn(r->br, FASTBITS);
+	if (peek < 0) {
+		return EOF;
+	}
+	entry_t *e = &r->table[peek];
+	if (e->len > 0) {
+		if (!bits.consumen(r->br, e->len)) {
+			return EOF;
+		}
+		return e->val;
+	}
+	if (!e->next) {
+		panic("invalid code");
+	}
+	if (!bits.consumen(r->br, FASTBITS)) {
+		return EOF;
+	}
+	node_t *n = e->next;
+	while (n->left) {
 		int bit = bits.read1(r->br);
 		if (bit == EOF) {
-			if (r->curr != r->root) {
-				panic("unexpected end of input");
-			}
 			return EOF;
 		}
 		if (bit == 1) {
-			r->curr = r->curr->right;
+			n = n->right;
 		} else {
-			r->curr = r->curr->left;
+			n = n->left;
 		}
-		if (!r->curr->left) {
-			int b = r->curr->val;
-			r->curr = r->root;
-			return b;
+		if (!n) {
+			panic("invalid code");
 		}
 	}
+	return n->val;
+}
+
+// Builds the decoding table for tree t. With reversed bit order the
+// first bit of a code is the lowest bit of the table index, otherwise
+// it's the highest.
+void buildtable(tree_t *t, bool reversed) {
+	if (!t->table) {
+		t->table = calloc!(1 << FASTBITS, sizeof(entry_t));
+	} else {
+		memset(t->table, 0, (1 << FASTBITS) * sizeof(entry_t));
+	}
+	t->tablerev = reversed;
+	if (isleaf(t->root)) {
+		// A tree of one value codes it as a single 0 bit.
+		addentries(t, t->root, 0, 1);
+		return;
+	}
+	addentries(t, t->root, 0, 0);
+}
+
+bool isleaf(node_t *n) {
+	return n && !n->left && !n->right;
+}
+
+// Fills the table entries for the subtree n reached with the given code.
+void addentries(tree_t *t, node_t *n, uint32_t code, int len) {
+	if (!n) {
+		// Incomplete tree, the entries stay invalid.
+		return;
+	}
+	if (n->left || n->right) {
+		if (len == FASTBITS) {
+			entry_t *e = &t->table[index(t, code, len)];
+			e->next = n;
+			return;
+		}
+		addentries(t, n->left, code << 1, len + 1);
+		addentries(t, n->right, (code << 1) | 1, len + 1);
+		return;
+	}
+	// A value node: every index that starts with the code decodes to it.
+	uint32_t nfill = 1 << (FASTBITS - len);
+	for (uint32_t i = 0; i < nfill; i++) {
+		entry_t *e = &t->table[index(t, (code << (FASTBITS - len)) | i, FASTBITS)];
+		e->val = n->val;
+		e->len = len;
+	}
+}
+
+// Returns the table index for the FASTBITS-bit sequence x given
+// with its first bit highest.
+uint32_t index(tree_t *t, uint32_t x, int len) {
+	if (!t->tablerev) {
+		return x;
+	}
+	uint32_t r = 0;
+	for (int i = 0; i < len; i++) {
+		r = (r << 1) | ((x >> i) & 1);
+	}
+	return r;
 }
 
 pub typedef {
@@ -197,12 +300,21 @@ pub typedef {
 pub writer_t *newwriter(tree_t *t, writer.t *out) {
 	writer_t *w = calloc!(1, sizeof(writer_t));
 	w->tree = t;
-	inittable(w->table, t->root, NULL, 0);
+	if (isleaf(t->root)) {
+		// A single 0 bit, as the decoding table has it.
+		w->table[t->root->val].len = 1;
+	} else {
+		inittable(w->table, t->root, NULL, 0);
+	}
 	w->w = bits.newwriter(out, bits.STRAIGHT);
 	return w;
 }
 
 void inittable(bitslice_t *table, node_t *n, uint8_t *pref, uint8_t len) {
+	if (!n) {
+		// Incomplete tree, that code is never written.
+		return;
+	}
 	if (n->left) {
 		uint8_t code[16] = {};
 		for (uint8_t i = 0; i < len; i++) {
@@ -7,6 +7,8 @@
 pub int main() {
 	testreadwrite();
 	testcanonical();
+	testlongcodes();
+	testonesymbol();
 	return test.fails();
 }
 
@@ -59,6 +61,50 @@ void testcanonical() {
 	test.streq(msg, out);
 }
 
+void testlongcodes() {
+	// Code lengths 1 to 12, so that some codes are longer than
+	// the decoder's lookup table.
+	const char *characters = "ABCDEFGHIJKLM";
+	uint8_t lencounts[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2};
+	huffman.tree_t *t = huffman.treefrom(lencounts, nelem(lencounts), (uint8_t *) characters);
+
+	const char *msg = "MALKAJIBMMHA";
+	FILE *f = tmpfile();
+	writemsg(f, t, msg);
+	rewind(f);
+	char out[13] = {};
+	readmsg(f, t, out, 12);
+	fclose(f);
+	test.streq(msg, out);
+	huffman.freetree(t);
+}
+
+void testonesymbol() {
+	// A text of one repeated character makes a tree that is just a leaf.
+	const char *s = "aaaa";
+	huffman.tree_t *t = huffman.buildtree(s);
+	FILE *f = tmpfile();
+	writemsg(f, t, s);
+	rewind(f);
+	char out[5] = {};
+	readmsg(f, t, out, 4);
+	fclose(f);
+	test.streq(s, out);
+	huffman.freetree(t);
+
+	// A canonical code with one symbol, as in some JPEG DC tables.
+	uint8_t lencounts[] = {1};
+	t = huffman.treefrom(lencounts, nelem(lencounts), (uint8_t *) "Z");
+	f = tmpfile();
+	writemsg(f, t, "ZZZ");
+	rewind(f);
+	char out2[4] = {};
+	readmsg(f, t, out2, 3);
+	fclose(f);
+	test.streq("ZZZ", out2);
+	huffman.freetree(t);
+}
+
 void writemsg(FILE *f, huffman.tree_t *t, const char *s) {
 	writer.t *fw = writer.file(f);
 	huffman.writer_t *w = huffman.newwriter(t, fw);
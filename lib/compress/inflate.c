@@ -0,0 +1,485 @@
+// DEFLATE decompressor (RFC 1951).
+//
+// The output goes through a 64 KB ring that also serves as the history
+// for matches, so the decoder works in constant memory and can be read
+// in pieces of any size. Huffman codes are decoded with a lookup table
+// indexed by the next maxbits input bits, one lookup per symbol.
+
+#import bits
+#import reader
+
+#define RING 65536
+#define RMASK 65535
+#define HISTORY 32768 // the largest match distance
+#define MAXBITS 15 // the longest code
+
+// Length symbols 257..285: base lengths and numbers of extra bits.
+int lenbase[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+int lenextra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+// Distance symbols 0..29: base distances and numbers of extra bits.
+int distbase[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+int distextra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order in which the code length code lengths are stored.
+int clorder[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Decoder states.
+enum {
+	ST_HEADER, // at a block header
+	ST_STORED, // in a stored block
+	ST_CODES, // in a Huffman coded block
+	ST_DONE, // after the last block
+	ST_ERROR
+}
+
+// Decoding table: entry i is the symbol whose code is a prefix of i
+// taken as the next bits of the input, first bit lowest, packed as
+// symbol << 4 | code length. Zero means no code matches.
+pub typedef {
+	uint16_t entries[32768];
+	int bits; // how many bits index the table
+} table_t;
+
+pub typedef {
+	bits.reader_t *br;
+	bool ownbr; // whether br was created by the decoder
+	int state;
+	bool last; // whether the current block is the last one
+	size_t stored; // bytes left in the stored block
+
+	table_t lit; // literal/length code
+	table_t dist; // distance code
+
+	uint8_t ring[RING];
+	size_t written; // bytes put into the ring
+	size_t delivered; // bytes read out from the ring
+
+	char err[100]; // what went wrong in the error state
+} t;
+
+// Creates a decoder reading deflate data from br.
+// The decoder stops right after the end of the last block,
+// so whatever follows the data can be read from br.
+pub t *new(bits.reader_t *br) {
+	t *z = calloc!(1, sizeof(t));
+	z->br = br;
+	return z;
+}
+
+pub void free(t *z) {
+	if (z->ownbr) {
+		bits.closereader(z->br);
+	}
+	OS.free(z);
+}
+
+// Returns a reader with the data decompressed from the raw deflate
+// stream in.
+pub reader.t *reader(reader.t *in) {
+	t *z = new(bits.newreader(in, bits.REVERSED));
+	z->ownbr = true;
+	return reader.new(z, readfunc, freefunc);
+}
+
+int readfunc(void *ctx, uint8_t *buf, size_t n) {
+	return read(ctx, buf, n);
+}
+
+void freefunc(void *ctx) {
+	free(ctx);
+}
+
+// Returns true if the decoder has reached the end of the data.
+pub bool done(t *z) {
+	return z->state == ST_DONE && z->written == z->delivered;
+}
+
+// Returns the error message if the data is corrupt, or NULL.
+pub const char *error(t *z) {
+	if (z->state != ST_ERROR) {
+		return NULL;
+	}
+	return z->err;
+}
+
+// Reads up to n decompressed bytes into buf.
+// Returns the number of bytes read or EOF at the end of the data or
+// on error.
+pub int read(t *z, uint8_t *buf, size_t n) {
+	size_t r = 0;
+	while (r < n) {
+		size_t avail = z->written - z->delivered;
+		if (avail > 0) {
+			if (avail > n - r) avail = n - r;
+			size_t from = z->delivered & RMASK;
+			size_t k = avail;
+			if (from + k > RING) k = RING - from;
+			memcpy(buf + r, z->ring + from, k);
+			memcpy(buf + r + k, z->ring, avail - k);
+			z->delivered += avail;
+			r += avail;
+			continue;
+		}
+		if (z->state == ST_DONE || z->state == ST_ERROR) {
+			break;
+		}
+		decode(z);
+	}
+	if (r == 0) {
+		return EOF;
+	}
+	return (int) r;
+}
+
+// Decodes a portion of the data into the ring, up to the history size,
+// so that the ring never overwrites bytes that haven't been read.
+void decode(t *z) {
+	size_t limit = z->written + HISTORY;
+	while (z->written < limit) {
+		switch (z->state) {
+			case ST_HEADER: {
+				if (z->last) {
+					z->state = ST_DONE;
+					return;
+				}
+				header(z);
+			}
+			case ST_STORED: {
+				copystored(z, limit);
+			}
+			case ST_CODES: {
+				if (!codes(z, limit)) return;
+			}
+			default: {
+				return;
+			}
+		}
+	}
+}
+
+void fail(t *z, const char *msg) {
+	snprintf(z->err, sizeof(z->err), "%s", msg);
+	z->state = ST_ERROR;
+}
+
+// Reads a block header and sets up the block.
+void header(t *z) {
+	int last = bits.readn(z->br, 1);
+	int type = bits.readn(z->br, 2);
+	if (last < 0 || type < 0) {
+		fail(z, "unexpected end of data");
+		return;
+	}
+	z->last = last == 1;
+	switch (type) {
+		case 0: {
+			// Stored: the length and its complement at a byte boundary.
+			align(z->br);
+			int len = bits.readn(z->br, 16);
+			int nlen = bits.readn(z->br, 16);
+			if (len < 0 || nlen < 0) {
+				fail(z, "unexpected end of data");
+				return;
+			}
+			if (len != (~nlen & 0xFFFF)) {
+				fail(z, "stored block length mismatch");
+				return;
+			}
+			z->stored = (size_t) len;
+			z->state = ST_STORED;
+		}
+		case 1: {
+			fixedtables(z);
+			z->state = ST_CODES;
+		}
+		case 2: {
+			if (dynamictables(z)) {
+				z->state = ST_CODES;
+			}
+		}
+		default: {
+			fail(z, "invalid block type");
+		}
+	}
+}
+
+// Skips the bits up to the next byte boundary.
+void align(bits.reader_t *br) {
+	int n = br->nacc % 8;
+	if (n > 0) {
+		bits.consumen(br, n);
+	}
+}
+
+void copystored(t *z, size_t limit) {
+	while (z->stored > 0 && z->written < limit) {
+		int c = bits.readn(z->br, 8);
+		if (c < 0) {
+			fail(z, "unexpected end of data");
+			return;
+		}
+		z->ring[z->written & RMASK] = (uint8_t) c;
+		z->written++;
+		z->stored--;
+	}
+	if (z->stored == 0) {
+		z->state = ST_HEADER;
+	}
+}
+
+// Decodes the symbols of a Huffman coded block until the end of the
+// block or the limit. Returns false on error.
+bool codes(t *z, size_t limit) {
+	while (z->written < limit) {
+		int sym = decodesym(z, &z->lit);
+		if (sym < 0) {
+			return false;
+		}
+		if (sym < 256) {
+			z->ring[z->written & RMASK] = (uint8_t) sym;
+			z->written++;
+			continue;
+		}
+		if (sym == 256) {
+			z->state = ST_HEADER;
+			return true;
+		}
+		sym -= 257;
+		if (sym >= 29) {
+			fail(z, "invalid length symbol");
+			return false;
+		}
+		int len = lenbase[sym];
+		if (lenextra[sym] > 0) {
+			int extra = bits.readn(z->br, lenextra[sym]);
+			if (extra < 0) {
+				fail(z, "unexpected end of data");
+				return false;
+			}
+			len += extra;
+		}
+		int dsym = decodesym(z, &z->dist);
+		if (dsym < 0) {
+			return false;
+		}
+		if (dsym >= 30) {
+			fail(z, "invalid distance symbol");
+			return false;
+		}
+		int dist = distbase[dsym];
+		if (distextra[dsym] > 0) {
+			int extra = bits.readn(z->br, distextra[dsym]);
+			if (extra < 0) {
+				fail(z, "unexpected end of data");
+				return false;
+			}
+			dist += extra;
+		}
+		if ((size_t) dist > z->written) {
+			fail(z, "distance too far back");
+			return false;
+		}
+		copymatch(z, (size_t) len, (size_t) dist);
+	}
+	return true;
+}
+
+// Appends len bytes starting dist bytes back to the ring.
+void copymatch(t *z, size_t len, size_t dist) {
+	size_t to = z->written & RMASK;
+	size_t from = (z->written - dist) & RMASK;
+	z->written += len;
+	// Copy whole when the ranges don't wrap around and don't overlap.
+	if (dist >= len && to + len <= RING && from + len <= RING) {
+		memcpy(z->ring + to, z->ring + from, len);
+		return;
+	}
+	// Overlapping ranges repeat the last dist bytes, which has to go
+	// byte by byte.
+	for (size_t i = 0; i < len; i++) {
+		z->ring[to] = z->ring[from];
+		to = (to + 1) & RMASK;
+		from = (from + 1) & RMASK;
+	}
+}
+
+// Decodes the next symbol with table tab.
+// Returns the symbol or -1 on error.
+int decodesym(t *z, table_t *tab) {
+	if (tab->bits == 0) {
+		fail(z, "use of an empty code");
+		return -1;
+	}
+	// At the end of the data the missing bits are zeros, and the code
+	// is accepted only if it fits in the remaining bits.
+	int64_t v = bits.peekn(z->br, tab->bits);
+	if (v < 0) {
+		fail(z, "unexpected end of data");
+		return -1;
+	}
+	uint16_t e = tab->entries[v];
+	int len = e & 15;
+	if (len == 0) {
+		fail(z, "invalid code");
+		return -1;
+	}
+	if (!bits.consumen(z->br, len)) {
+		fail(z, "unexpected end of data");
+		return -1;
+	}
+	return e >> 4;
+}
+
+// Fills the decoding table for a code with the given code lengths.
+// Returns false if the lengths don't make a valid code.
+bool buildtable(table_t *tab, const uint8_t *lens, size_t n) {
+	int count[MAXBITS + 1] = {};
+	int maxlen = 0;
+	for (size_t i = 0; i < n; i++) {
+		int len = lens[i];
+		count[len]++;
+		if (len > maxlen) maxlen = len;
+	}
+	count[0] = 0;
+	// Check that the code isn't oversubscribed. Incomplete codes are
+	// allowed, the missing codes are detected when decoding.
+	int left = 1;
+	for (int b = 1; b <= MAXBITS; b++) {
+		left = left * 2 - count[b];
+		if (left < 0) {
+			return false;
+		}
+	}
+	tab->bits = maxlen;
+	size_t size = (size_t) 1 << maxlen;
+	memset(tab->entries, 0, size * sizeof(uint16_t));
+	int next[MAXBITS + 1] = {};
+	int code = 0;
+	for (int b = 1; b <= MAXBITS; b++) {
+		code = (code + count[b - 1]) << 1;
+		next[b] = code;
+	}
+	for (size_t sym = 0; sym < n; sym++) {
+		int len = lens[sym];
+		if (len == 0) continue;
+		// Codes are stored starting from the most significant bit,
+		// the table is indexed starting from the least significant.
+		int c = next[len]++;
+		size_t r = 0;
+		for (int j = 0; j < len; j++) {
+			r = (r << 1) | (size_t) (c & 1);
+			c = c >> 1;
+		}
+		uint16_t e = (uint16_t) ((sym << 4) | (size_t) len);
+		for (size_t i = r; i < size; i += (size_t) 1 << len) {
+			tab->entries[i] = e;
+		}
+	}
+	return true;
+}
+
+void fixedtables(t *z) {
+	uint8_t lens[288];
+	for (size_t i = 0; i < 288; i++) {
+		if (i < 144) {
+			lens[i] = 8;
+		} else if (i < 256) {
+			lens[i] = 9;
+		} else if (i < 280) {
+			lens[i] = 7;
+		} else {
+			lens[i] = 8;
+		}
+	}
+	buildtable(&z->lit, lens, 288);
+	for (size_t i = 0; i < 30; i++) {
+		lens[i] = 5;
+	}
+	buildtable(&z->dist, lens, 30);
+}
+
+// Reads the code lengths of a dynamic block and builds the tables.
+// Returns false on error.
+bool dynamictables(t *z) {
+	int hlit = bits.readn(z->br, 5);
+	int hdist = bits.readn(z->br, 5);
+	int hclen = bits.readn(z->br, 4);
+	if (hlit < 0 || hdist < 0 || hclen < 0) {
+		fail(z, "unexpected end of data");
+		return false;
+	}
+	hlit += 257;
+	hdist += 1;
+	hclen += 4;
+	if (hlit > 286 || hdist > 30) {
+		fail(z, "too many length or distance symbols");
+		return false;
+	}
+
+	uint8_t cllens[19] = {};
+	for (int i = 0; i < hclen; i++) {
+		int l = bits.readn(z->br, 3);
+		if (l < 0) {
+			fail(z, "unexpected end of data");
+			return false;
+		}
+		cllens[clorder[i]] = (uint8_t) l;
+	}
+	// The code length code is decoded with the distance table,
+	// which is built for real afterwards.
+	if (!buildtable(&z->dist, cllens, 19)) {
+		fail(z, "invalid code lengths code");
+		return false;
+	}
+
+	uint8_t lens[316] = {};
+	int n = hlit + hdist;
+	int i = 0;
+	while (i < n) {
+		int sym = decodesym(z, &z->dist);
+		if (sym < 0) {
+			return false;
+		}
+		if (sym < 16) {
+			lens[i++] = (uint8_t) sym;
+			continue;
+		}
+		// 16: repeat the previous length 3..6 times,
+		// 17: 3..10 zeros, 18: 11..138 zeros.
+		uint8_t val = 0;
+		int rep = 0;
+		if (sym == 16) {
+			if (i == 0) {
+				fail(z, "repeat with no previous length");
+				return false;
+			}
+			val = lens[i - 1];
+			rep = 3 + bits.readn(z->br, 2);
+		} else if (sym == 17) {
+			rep = 3 + bits.readn(z->br, 3);
+		} else {
+			rep = 11 + bits.readn(z->br, 7);
+		}
+		if (i + rep > n) {
+			fail(z, "code lengths overflow");
+			return false;
+		}
+		for (int j = 0; j < rep; j++) {
+			lens[i++] = val;
+		}
+	}
+	if (lens[256] == 0) {
+		fail(z, "no end of block code");
+		return false;
+	}
+	if (!buildtable(&z->lit, lens, (size_t) hlit)) {
+		fail(z, "invalid literal/length code");
+		return false;
+	}
+	if (!buildtable(&z->dist, lens + hlit, (size_t) hdist)) {
+		fail(z, "invalid distance code");
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,71 @@
+#import compress/deflate
+#import compress/inflate
+#import reader
+#import rnd
+#import test
+#import writer
+
+int main() {
+	size_t n = 300000;
+	uint8_t *data = calloc!(n, 1);
+
+	// Text-like data with long and short repeats.
+	const char *words[] = {"alpha ", "beta ", "gamma ", "delta\n", "a", "bb"};
+	rnd.seed(3);
+	size_t pos = 0;
+	while (pos < n) {
+		const char *w = words[rnd.intn(nelem(words))];
+		for (size_t i = 0; w[i] != '\0' && pos < n; i++) {
+			data[pos++] = (uint8_t) w[i];
+		}
+	}
+	for (int level = 0; level <= 9; level += 3) {
+		roundtrip(data, n, level);
+	}
+
+	// Incompressible data ends up in stored blocks.
+	for (size_t i = 0; i < n; i++) {
+		data[i] = (uint8_t) rnd.intn(256);
+	}
+	roundtrip(data, n, 6);
+
+	// Runs of one byte are matches overlapping themselves.
+	memset(data, 'x', n);
+	roundtrip(data, n, 6);
+
+	roundtrip(data, 0, 6);
+	free(data);
+	return test.fails();
+}
+
+// Compresses data and reads it back in pieces of different sizes.
+void roundtrip(uint8_t *data, size_t n, int level) {
+	size_t bufsize = n + n / 100 + 1000;
+	uint8_t *buf = calloc!(bufsize, 1);
+	writer.t *w = writer.static_buffer(buf, bufsize);
+	deflate.t *d = deflate.new(w, level);
+	deflate.write(d, data, n);
+	deflate.close(d);
+	size_t size = w->nwritten;
+	writer.free(w);
+
+	uint8_t *back = calloc!(n + 1, 1);
+	reader.t *in = reader.static_buffer(buf, size);
+	reader.t *r = inflate.reader(in);
+	size_t got = 0;
+	size_t piece = 1;
+	while (true) {
+		size_t k = piece;
+		if (k > n + 1 - got) k = n + 1 - got;
+		int q = reader.read(r, back + got, k);
+		if (q <= 0) break;
+		got += (size_t) q;
+		piece = piece * 2 + 1;
+	}
+	test.truth("size", got == n);
+	test.truth("data", memcmp(data, back, n) == 0);
+	reader.free(r);
+	reader.free(in);
+	free(back);
+	free(buf);
+}
@@ -86,15 +86,35 @@ uint8_t codewidth(size_t dictsize) {
 // Compressor
 //
 
+// The compressor doesn't need the words themselves: every word in the
+// dictionary is a shorter word plus one byte, so the dictionary is kept
+// as a hash table mapping (prefix code, next byte) to the word's code.
+// Extending the current match by one input byte is then a single lookup.
+
+#define DICT_HASH_SIZE 8192 // power of two, at least twice MAX_DICT_LENGTH
+
 typedef {
-	dict_t dict; // the code dictionary
+	uint32_t key; // prefix code << 8 | byte, plus one so that zero means empty
+	uint16_t code;
+} slot_t;
+
+typedef {
+	size_t init_size; // dictionary size after reset
+	size_t size; // current dictionary size
+	uint16_t resetcode; // code value for RESET
+	uint16_t endcode; // code value for END
+	slot_t table[DICT_HASH_SIZE];
 	bits.writer_t *bw; // bits output writer
 } enc_t;
 
 // Creates a new instance of the compressor.
 enc_t *init(size_t alphabet_size, writer.t *out) {
 	enc_t *enc = calloc!(1, sizeof(enc_t));
-	enc->dict = newdict(alphabet_size);
+	// Codes [0..n) are the single bytes, followed by RESET and END.
+	enc->resetcode = alphabet_size;
+	enc->endcode = alphabet_size + 1;
+	enc->init_size = alphabet_size + 2;
+	enc->size = enc->init_size;
 	enc->bw = bits.newwriter(out, bits.REVERSED);
 	return enc;
 }
@@ -102,120 +122,72 @@ enc_t *init(size_t alphabet_size, writer.t *out) {
 pub void compress(reader.t *r, size_t alphabet_size, writer.t *out) {
 	enc_t *enc = init(alphabet_size, out);
 
-	peeker_t *p = calloc!(1, sizeof(peeker_t));
-	p->reader = r;
-
+	uint8_t buf[4096];
+	int cur = -1; // code of the word matched so far
 	while (true) {
-		// Max. possible word length is 4096 - alphabet_size,
-		// so prefetching 4096 guarantees we have more than any word.
-		// 4096 is also a nice chunk size for input-output.
-		size_t q = peek(p, 4096);
-		if (q == 0) {
-			break;
-		}
-
-		size_t mi = match(enc, p->buf, q);
-		size_t mlen = enc->dict.entries[mi].len;
-		comp_emit(enc, mi);
-
-		// If we have matched the peek fully, then the peek has reached EOF.
-		if (mlen == q) {
+		int n = reader.read(r, buf, sizeof(buf));
+		if (n <= 0) {
 			break;
 		}
-		if (enc->dict.size == MAX_DICT_LENGTH) {
-			// Write the reset code before resetting the dictionary
-			// to stay at the current code width.
-			comp_emit(enc, enc->dict.resetcode);
-			resetdict(&enc->dict);
-		}
-		if (enc->dict.size < MAX_DICT_LENGTH) {
-			addentry(&enc->dict, p->buf, mlen + 1);
+		for (int i = 0; i < n; i++) {
+			uint8_t c = buf[i];
+			if (c >= alphabet_size) {
+				panic("byte %u is outside of the alphabet", c);
+			}
+			if (cur < 0) {
+				cur = c;
+				continue;
+			}
+			// Extend the match if the dictionary has it.
+			uint32_t key = (((uint32_t) cur << 8) | c) + 1;
+			slot_t *s = find(enc, key);
+			if (s->key == key) {
+				cur = s->code;
+				continue;
+			}
+			comp_emit(enc, cur);
+			if (enc->size == MAX_DICT_LENGTH) {
+				// Write the reset code before resetting the dictionary
+				// to stay at the current code width.
+				comp_emit(enc, enc->resetcode);
+				memset(enc->table, 0, sizeof(enc->table));
+				enc->size = enc->init_size;
+				// The decoder still adds the word after the reset. Its
+				// prefix is gone from the dictionary, so the word can't
+				// be matched, but its code is taken.
+				enc->size++;
+			} else {
+				s->key = key;
+				s->code = enc->size++;
+			}
+			cur = c;
 		}
-		shift(p, mlen);
+	}
+	if (cur >= 0) {
+		comp_emit(enc, cur);
 	}
 
 	// Finalizes the compressed stream and frees the compressor.
-	free(p);
-	comp_emit(enc, enc->dict.endcode);
+	comp_emit(enc, enc->endcode);
 	bits.closewriter(enc->bw);
-	freedict(enc->dict);
 	free(enc);
 }
 
-// Finds the best word match for the input.
-size_t match(enc_t *enc, uint8_t *input, size_t inputlen) {
-	size_t mi = 0;
-	size_t mlen = 0;
-	bool ok = false;
-	for (size_t i = 0; i < enc->dict.size; i++) {
-		word_t *e = &enc->dict.entries[i];
-		if (e->len <= mlen || e->len > inputlen) {
-			continue;
-		}
-		if (memcmp(e->word, input, e->len) == 0) {
-			mi = i;
-			mlen = e->len;
-			ok = true;
-		}
+// Returns the table slot for key: either the one holding the key
+// or the empty one where the key would go.
+slot_t *find(enc_t *enc, uint32_t key) {
+	uint32_t i = (uint32_t) (key * 2654435761) >> 19;
+	while (enc->table[i].key != 0 && enc->table[i].key != key) {
+		i = (i + 1) & (DICT_HASH_SIZE - 1);
 	}
-	if (!ok) {
-		panic("failed to match");
-	}
-	return mi;
+	return &enc->table[i];
 }
 
 void comp_emit(enc_t *enc, uint16_t code) {
-	uint8_t w = codewidth(enc->dict.size);
+	uint8_t w = codewidth(enc->size);
 	writebits(enc->bw, code, w);
 }
 
-typedef {
-	uint8_t *buf;
-	size_t bufsize;
-	size_t datalen;
-	reader.t *reader;
-} peeker_t;
-
-// Reads from the underlying reader enough bytes so that there is
-// n bytes present in the buffer.
-// If the input doesn't have enough bytes, reads what's left.
-// Returns the size of the buffer.
-size_t peek(peeker_t *p, size_t n) {
-	// Ensure the buffer is big enough.
-	if (p->bufsize < n) {
-		if (!p->bufsize) {
-			p->bufsize = 1;
-		}
-		while (p->bufsize < n) {
-			p->bufsize *= 2;
-		}
-		p->buf = realloc(p->buf, p->bufsize);
-		if (!p->buf) {
-			panic("realloc failed");
-		}
-	}
-
-	// Ensure the buffer has n, unless EOF.
-	if (p->datalen < n) {
-		int q = reader.read(p->reader, &p->buf[p->datalen], n - p->datalen);
-		if (q != EOF) {
-			p->datalen += (size_t) q;
-		}
-	}
-
-	return p->datalen;
-}
-
-// Removes n bytes from the buffer, shifting the remaining bytes
-// to the start of the buffer.
-void shift(peeker_t *p, size_t n) {
-	if (n == 0 || n > p->datalen) {
-		panic("shift: invalid n (=%zu)", n);
-	}
-	memmove(p->buf, &p->buf[n], p->datalen - n);
-	p->datalen -= n;
-}
-
 
 //
 // Decompressor
@@ -259,43 +231,13 @@ pub void decodeinto(dec_t *dec, writer.t *out) {
 }
 
 void writebits(bits.writer_t *w, uint16_t code, uint8_t n) {
-	// for (uint8_t i = 0; i < n; i++) {
-	// 	int s = n - i - 1;
-	// 	int m = 1 << s;
-	// 	uint8_t bit = (code & m) >> s;
-	// 	bits.write1(w, bit);
-	// }
-
-
-	for (uint8_t i = 0; i < n; i++) {
-		uint8_t bit = code % 2;
-		code /= 2;
-		bits.write1(w, bit);
-	}
+	bits.writen(w, code, n);
 }
 
 uint16_t readbits(bits.reader_t *r, uint8_t n) {
-	// uint16_t val = 0;
-	// for (uint8_t i = 0; i < n; i++) {
-	// 	int c = bits.read1(r);
-	// 	if (c < 0) panic("read failed");
-	// 	val *= 2;
-	// 	val += c;
-	// }
-
-
-	uint16_t val = 0;
-	uint16_t amp = 1;
-	for (uint8_t i = 0; i < n; i++) {
-		int c = bits.read1(r);
-		if (c < 0) panic("read failed");
-		val += amp * c;
-		amp *= 2;
-	}
-
-
-	// printf("--- %u bits val: %u\n", n, val);
-	return val;
+	int val = bits.readn(r, n);
+	if (val < 0) panic("read failed");
+	return (uint16_t) val;
 }
 
 // Reads next code from the input stream and puts the decoded
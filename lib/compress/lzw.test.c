@@ -19,6 +19,12 @@ int main() {
 	testrw(text, n, 256);
 	free(text);
 
+	// Repetitive text with long matches and many dictionary resets.
+	size_t m = 1000000;
+	uint8_t *corpus = gencorpus(m);
+	testrw(corpus, m, 256);
+	free(corpus);
+
 	return test.fails();
 }
 
@@ -59,3 +65,18 @@ void readmsg(FILE *f, uint8_t *buf, size_t bufsize, size_t alphabet_size) {
 	reader.free(in);
 	writer.free(out);
 }
+
+// Returns n bytes of words picked from a small vocabulary.
+uint8_t *gencorpus(size_t n) {
+	const char *words[] = {"the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ", "and ", "a "};
+	uint8_t *buf = calloc!(n, 1);
+	rnd.seed(2);
+	size_t pos = 0;
+	while (pos < n) {
+		const char *w = words[rnd.intn(nelem(words))];
+		for (size_t i = 0; w[i] != '\0' && pos < n; i++) {
+			buf[pos++] = (uint8_t) w[i];
+		}
+	}
+	return buf;
+}
@@ -0,0 +1,198 @@
+// Parallel block compression: the input is cut into blocks that are
+// compressed independently on a pool of threads, and the results are
+// written out in the input order. Every block is compressed on its own,
+// so the compression function has to produce output that can simply be
+// concatenated, such as gzip members.
+//
+// Blocks go through a ring of slots, twice as many as the threads, so
+// that the workers always have queued blocks while the output is being
+// written. A slot is filled by the caller, queued, compressed by one of
+// the workers and written out, in that order.
+
+#import mem
+#import os/threads
+#import writer
+
+// Function that compresses n bytes of data into out.
+pub typedef void compressfunc_t(void *, const uint8_t *, size_t, writer.t *); // arg, data, n, out
+
+// Slot states.
+enum {
+	SLOT_FREE, // can be filled
+	SLOT_QUEUED, // waiting for a worker
+	SLOT_WORKING, // being compressed
+	SLOT_DONE // compressed, waiting to be written out
+}
+
+pub typedef {
+	int state;
+	uint8_t *data;
+	size_t len;
+	mem.mem_t *out;
+} slot_t;
+
+pub typedef {
+	writer.t *out;
+	compressfunc_t *f;
+	void *arg;
+	size_t blocksize;
+
+	threads.mtx_t *lock;
+	threads.cnd_t *changed; // signalled whenever a slot changes state
+	threads.thr_t **workers;
+	size_t nworkers;
+	bool quit;
+
+	slot_t *slots;
+	size_t nslots;
+	size_t next; // number of the block being filled
+	size_t written; // number of the next block to write out
+	bool err;
+} t;
+
+// Creates a compressor that writes to out, compressing blocks of
+// blocksize bytes with f on nthreads threads.
+pub t *new(writer.t *out, compressfunc_t *f, void *arg, size_t blocksize, size_t nthreads) {
+	if (nthreads == 0) nthreads = 1;
+	if (blocksize == 0) {
+		panic("block size must not be zero");
+	}
+	t *p = calloc!(1, sizeof(t));
+	p->out = out;
+	p->f = f;
+	p->arg = arg;
+	p->blocksize = blocksize;
+	p->lock = threads.mtx_new();
+	p->changed = threads.cnd_new();
+	p->nslots = 2 * nthreads;
+	p->slots = calloc!(p->nslots, sizeof(slot_t));
+	for (size_t i = 0; i < p->nslots; i++) {
+		p->slots[i].data = calloc!(blocksize, 1);
+		p->slots[i].out = mem.memopen();
+	}
+	p->nworkers = nthreads;
+	p->workers = calloc!(nthreads, sizeof(threads.thr_t *));
+	for (size_t i = 0; i < nthreads; i++) {
+		p->workers[i] = threads.start(&worker, p);
+	}
+	return p;
+}
+
+// Adds n bytes from data to the input.
+// Returns false on write error.
+pub bool write(t *p, const uint8_t *data, size_t n) {
+	while (n > 0) {
+		slot_t *s = &p->slots[p->next % p->nslots];
+		size_t k = p->blocksize - s->len;
+		if (k > n) k = n;
+		memcpy(s->data + s->len, data, k);
+		s->len += k;
+		data += k;
+		n -= k;
+		if (s->len == p->blocksize) {
+			submit(p);
+		}
+	}
+	return !p->err;
+}
+
+// Compresses the remaining input, writes out all blocks and frees the
+// compressor. The underlying writer is left open.
+// Returns false on write error.
+pub bool close(t *p) {
+	slot_t *s = &p->slots[p->next % p->nslots];
+	// Empty input still makes one empty block, so that the output is
+	// a valid stream.
+	if (s->len > 0 || p->next == 0) {
+		submit(p);
+	}
+	threads.lock(p->lock);
+	while (p->written < p->next) {
+		writeout(p);
+	}
+	p->quit = true;
+	threads.wake_all(p->changed);
+	threads.unlock(p->lock);
+	for (size_t i = 0; i < p->nworkers; i++) {
+		threads.wait(p->workers[i], NULL);
+	}
+
+	bool ok = !p->err;
+	for (size_t i = 0; i < p->nslots; i++) {
+		free(p->slots[i].data);
+		mem.memclose(p->slots[i].out);
+	}
+	free(p->slots);
+	free(p->workers);
+	threads.cnd_free(p->changed);
+	threads.mtx_free(p->lock);
+	free(p);
+	return ok;
+}
+
+// Queues the block being filled and waits until the next slot is free,
+// writing out finished blocks meanwhile.
+void submit(t *p) {
+	threads.lock(p->lock);
+	p->slots[p->next % p->nslots].state = SLOT_QUEUED;
+	p->next++;
+	threads.wake_all(p->changed);
+	while (p->slots[p->next % p->nslots].state != SLOT_FREE) {
+		writeout(p);
+	}
+	threads.unlock(p->lock);
+}
+
+// Waits for the oldest block to be compressed and writes it out.
+// Must be called with the lock held.
+void writeout(t *p) {
+	slot_t *s = &p->slots[p->written % p->nslots];
+	while (s->state != SLOT_DONE) {
+		threads.unlock_wait_lock(p->lock, p->changed);
+	}
+	// The slot belongs to this thread until it's marked free,
+	// so the lock isn't needed for writing.
+	threads.unlock(p->lock);
+	size_t n = s->out->datalen;
+	if (n > 0 && writer.write(p->out, (uint8_t *) s->out->data, n) != (int) n) {
+		p->err = true;
+	}
+	threads.lock(p->lock);
+	s->len = 0;
+	s->state = SLOT_FREE;
+	p->written++;
+}
+
+void *worker(void *arg) {
+	t *p = arg;
+	threads.lock(p->lock);
+	while (true) {
+		slot_t *s = NULL;
+		// The oldest queued block first, it will be written out first.
+		for (size_t i = p->written; i < p->next; i++) {
+			slot_t *c = &p->slots[i % p->nslots];
+			if (c->state == SLOT_QUEUED) {
+				s = c;
+				break;
+			}
+		}
+		if (!s) {
+			if (p->quit) break;
+			threads.unlock_wait_lock(p->lock, p->changed);
+			continue;
+		}
+		s->state = SLOT_WORKING;
+		threads.unlock(p->lock);
+
+		mem.reset(s->out);
+		writer.t *w = mem.newwriter(s->out);
+		p->f(p->arg, s->data, s->len, w);
+		writer.free(w);
+
+		threads.lock(p->lock);
+		s->state = SLOT_DONE;
+		threads.wake_all(p->changed);
+	}
+	threads.unlock(p->lock);
+	return NULL;
+}
@@ -0,0 +1,71 @@
+#import compress/gzip
+#import compress/parallel
+#import mem
+#import reader
+#import rnd
+#import test
+#import writer
+
+int main() {
+	size_t n = 3000000;
+	uint8_t *data = calloc!(n, 1);
+	const char *words[] = {"GET ", "POST ", "/index.html ", "/api/v1/items ", "200 ", "404 ", "\n"};
+	rnd.seed(4);
+	size_t pos = 0;
+	while (pos < n) {
+		const char *w = words[rnd.intn(nelem(words))];
+		for (size_t i = 0; w[i] != '\0' && pos < n; i++) {
+			data[pos++] = (uint8_t) w[i];
+		}
+	}
+
+	// The blocks don't divide the input evenly, and the writes cut
+	// across the blocks.
+	mem.mem_t *m = mem.memopen();
+	writer.t *w = mem.newwriter(m);
+	parallel.t *p = gzip.newparallel(w, 6, 256 * 1024, 4);
+	size_t step = 1000;
+	size_t i = 0;
+	while (i < n) {
+		size_t k = step;
+		if (i + k > n) k = n - i;
+		parallel.write(p, data + i, k);
+		i += k;
+		step = step * 2 + 1;
+	}
+	test.truth("close", parallel.close(p));
+	writer.free(w);
+
+	// Read back as one gzip stream.
+	reader.t *in = reader.static_buffer((uint8_t *) m->data, m->datalen);
+	reader.t *r = gzip.reader(in);
+	uint8_t *back = calloc!(n + 1, 1);
+	size_t got = 0;
+	while (got <= n) {
+		int q = reader.read(r, back + got, n + 1 - got);
+		if (q <= 0) break;
+		got += (size_t) q;
+	}
+	test.truth("no error", gzip.error(r) == NULL);
+	test.truth("size", got == n);
+	test.truth("data", memcmp(data, back, n) == 0);
+	reader.free(r);
+	reader.free(in);
+	mem.memclose(m);
+
+	// Empty input makes a valid empty file.
+	mem.mem_t *m2 = mem.memopen();
+	writer.t *w2 = mem.newwriter(m2);
+	test.truth("close empty", parallel.close(gzip.newparallel(w2, 6, 1024, 2)));
+	writer.free(w2);
+	reader.t *in2 = reader.static_buffer((uint8_t *) m2->data, m2->datalen);
+	reader.t *r2 = gzip.reader(in2);
+	test.truth("empty", reader.read(r2, back, 10) == EOF && gzip.error(r2) == NULL);
+	reader.free(r2);
+	reader.free(in2);
+	mem.memclose(m2);
+
+	free(back);
+	free(data);
+	return test.fails();
+}
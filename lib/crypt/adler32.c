@@ -0,0 +1,46 @@
+// Adler-32 checksum, used by zlib streams.
+// https://www.rfc-editor.org/rfc/rfc1950
+
+#define BASE 65521
+
+// The largest n such that 255n(n+1)/2 + (n+1)(BASE-1) fits into 32 bits:
+// the sums can go that many bytes without a modulo.
+#define NMAX 5552
+
+// Returns the checksum for empty input, to start with.
+pub uint32_t init() {
+	return 1;
+}
+
+// Returns the checksum adler updated with n bytes from buf.
+pub uint32_t update(uint32_t adler, const uint8_t *buf, size_t n) {
+	uint32_t s1 = adler & 0xFFFF;
+	uint32_t s2 = adler >> 16;
+	while (n > 0) {
+		size_t k = n;
+		if (k > NMAX) k = NMAX;
+		n -= k;
+		// Eight bytes per iteration, so the loop overhead is paid once
+		// for all of them.
+		while (k >= 8) {
+			s1 += buf[0]; s2 += s1;
+			s1 += buf[1]; s2 += s1;
+			s1 += buf[2]; s2 += s1;
+			s1 += buf[3]; s2 += s1;
+			s1 += buf[4]; s2 += s1;
+			s1 += buf[5]; s2 += s1;
+			s1 += buf[6]; s2 += s1;
+			s1 += buf[7]; s2 += s1;
+			buf += 8;
+			k -= 8;
+		}
+		while (k > 0) {
+			s1 += *buf++;
+			s2 += s1;
+			k--;
+		}
+		s1 %= BASE;
+		s2 %= BASE;
+	}
+	return (s2 << 16) | s1;
+}
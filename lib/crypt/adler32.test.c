@@ -0,0 +1,34 @@
+#import crypt/adler32
+#import test
+
+int main() {
+	const char *s = "Wikipedia";
+	uint32_t a = adler32.update(adler32.init(), (uint8_t *) s, strlen(s));
+	test.truth("Wikipedia", a == 0x11E60398);
+
+	// Long input crosses the NMAX boundary, split or not.
+	size_t n = 100000;
+	uint8_t *buf = calloc!(n, 1);
+	for (size_t i = 0; i < n; i++) {
+		buf[i] = (uint8_t) (i * 7 + 3);
+	}
+	uint32_t whole = adler32.update(adler32.init(), buf, n);
+	uint32_t parts = adler32.init();
+	parts = adler32.update(parts, buf, 1);
+	parts = adler32.update(parts, buf + 1, 6000);
+	parts = adler32.update(parts, buf + 6001, n - 6001);
+	test.truth("split", whole == parts);
+	test.truth("naive", whole == naive(buf, n));
+	free(buf);
+	return test.fails();
+}
+
+uint32_t naive(uint8_t *buf, size_t n) {
+	uint32_t s1 = 1;
+	uint32_t s2 = 0;
+	for (size_t i = 0; i < n; i++) {
+		s1 = (s1 + buf[i]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+	return (s2 << 16) | s1;
+}
@@ -0,0 +1,36 @@
+#import crypt/crc32
+#import test
+
+int main() {
+	const char *s = "123456789";
+	test.truth("check value", crc32.update(0, (uint8_t *) s, 9) == 0xCBF43926);
+	uint32_t c = crc32.update(0, (uint8_t *) s, 4);
+	c = crc32.update(c, (uint8_t *) s + 4, 5);
+	test.truth("in parts", c == 0xCBF43926);
+	test.truth("empty", crc32.update(0, NULL, 0) == 0);
+
+	// Long input, checked against byte-at-a-time updates, which don't
+	// use the eight-byte loop.
+	size_t n = 10000;
+	uint8_t *buf = calloc!(n, 1);
+	for (size_t i = 0; i < n; i++) {
+		buf[i] = (uint8_t) (i * 31 + i / 7);
+	}
+	uint32_t whole = crc32.update(0, buf, n);
+	uint32_t bytes = 0;
+	for (size_t i = 0; i < n; i++) {
+		bytes = crc32.update(bytes, buf + i, 1);
+	}
+	test.truth("long", whole == bytes);
+
+	// Combining the checksums of two parts gives the checksum of both.
+	size_t cuts[] = {0, 1, 7, 1000, 9999, 10000};
+	for (size_t i = 0; i < nelem(cuts); i++) {
+		size_t k = cuts[i];
+		uint32_t a = crc32.update(0, buf, k);
+		uint32_t b = crc32.update(0, buf + k, n - k);
+		test.truth("combine", crc32.combine(a, b, n - k) == whole);
+	}
+	free(buf);
+	return test.fails();
+}
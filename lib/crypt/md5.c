@@ -1,4 +1,4 @@
-#import mem
+#import reader
 
 /*
  * The internal "machinery" processes a stream of 64-byte blocks.
@@ -14,168 +14,142 @@
  * 'length' is an 64-bit encoding of length of the message.
  * The number of zeros 'z' is such that end of stream happens to be at
  * a length mark that is a multiple of 512 bits (64 bytes).
+ *
+ * The message is fed incrementally: whole blocks are processed in place
+ * from the caller's buffer, and only an incomplete block is kept in the
+ * context until more data comes.
  */
-typedef {
-	mem.mem_t *stream; // data stream
+pub typedef {
+	uint32_t sum[4];
+	uint8_t block[64]; // incomplete block
+	size_t blocklen; // bytes in block
+	uint64_t length; // current message length in bytes
+} ctx_t;
+
+/*
+ * Initializes the context for a new message.
+ */
+pub void init(ctx_t *c)
+{
+	memset(c, 0, sizeof(ctx_t));
+	md5_init(c->sum);
+}
 
-	uint64_t length; // current message length in bits
-	bool more_data; // set to false after the end of data
-	int zeros; // how many zeros left to put out
+/*
+ * Adds n bytes from buf to the message.
+ */
+pub void update(ctx_t *c, const uint8_t *buf, size_t n)
+{
+	c->length += n;
+
+	// Complete the pending block first.
+	if (c->blocklen > 0) {
+		size_t k = 64 - c->blocklen;
+		if (k > n) k = n;
+		memcpy(c->block + c->blocklen, buf, k);
+		c->blocklen += k;
+		buf += k;
+		n -= k;
+		if (c->blocklen < 64) {
+			return;
+		}
+		feed_bytes(c->sum, c->block);
+		c->blocklen = 0;
+	}
 
-	uint8_t lenbuf[8]; // buffer with the message length representation
-	size_t lenpos; // current position in lenbuf
+	while (n >= 64) {
+		feed_bytes(c->sum, buf);
+		buf += 64;
+		n -= 64;
+	}
 
-	bool more;
-} src_t;
+	memcpy(c->block, buf, n);
+	c->blocklen = n;
+}
 
 /*
- * Process the stream and put the digest in 'digest'.
+ * Completes the message and puts the digest into md.
  */
-void md5(mem.mem_t *stream, uint32_t digest[4])
+pub void end(ctx_t *c, uint32_t md[4])
 {
-	src_t s = {
-		.stream = stream,
-		.length = 0,
-		.more_data = true,
-		.more = true
-	};
+	uint64_t bits = c->length * 8;
 
-	md5_init(digest);
+	/*
+	 * The spec says to add bit '1' to the end of the actual data and
+	 * then put zeros until a specific position is reached. We can just
+	 * add the whole byte with first bit set to '1' because we will not
+	 * reach that special position for at least 7 more bits. And this
+	 * byte is actually value 128 (because bytes are treated as big-endian).
+	 */
+	uint8_t pad[72] = {128};
 
 	/*
-	 * Process the stream in 16-word blocks.
+	 * To get the number of zero bytes we have to solve the following:
+	 * (length + 1 + zeros + 8) % 64 == 0
+	 * where '1' is for the 'eof' byte and '8' is for the length marker.
 	 */
-	uint32_t block[16] = {0};
-	while (s.more)
-	{
-		for (int i = 0; i < 16; i++) {
-			block[i] = next_word(&s);
-		}
-		//print_block(block);
-		md5_feed(digest, block);
-	}
-}
+	size_t zeros = (64 + 64 - 9 - c->blocklen) % 64;
 
-/*
-void print_block(uint32_t b[16])
-{
-	for(int i = 0; i < 16; i++) {
-		printf("%08x (%u)", b[i], b[i]);
-		if((i+1) % 4 == 0) putchar('\n');
-		else putchar(' ');
+	/*
+	 * The length mark is a sequence of two words, low word first,
+	 * each word least-significant byte first.
+	 */
+	uint8_t *lenbuf = pad + 1 + zeros;
+	for (int i = 0; i < 8; i++) {
+		lenbuf[i] = (bits >> (i * 8)) & 0xFF;
+	}
+	update(c, pad, 1 + zeros + 8);
+	for (int i = 0; i < 4; i++) {
+		md[i] = c->sum[i];
 	}
 }
-*/
+
 /*
+ * Feeds a 64-byte block from the buffer p.
+ *
  * Regardless of the machine, the "md5" byte is big-endian (the highest
  * bit comes first), but a "word", which is 4 bytes, is little-endian
  * (the lowest byte comes first):
  *   |->|->|->|->|->|->|->|->|
  *   |<----------|<----------|
  */
-uint32_t next_word(src_t *s)
+void feed_bytes(uint32_t sum[4], const uint8_t *p)
 {
-	uint32_t word = 0;
-	int pos = 0;
-	/*
-	 * Compose a word from bytes, least-significant byte first.
-	 */
-	for(int i = 0; i < 4; i++) {
-		uint8_t b = next_byte(s);
-		word += (b << pos);
-		pos += 8;
+	uint32_t block[16];
+	for (int i = 0; i < 16; i++) {
+		const uint8_t *w = p + 4*i;
+		block[i] = (uint32_t) w[0] | (uint32_t) w[1] << 8 | (uint32_t) w[2] << 16 | (uint32_t) w[3] << 24;
 	}
-	return word;
+	md5_feed(sum, block);
 }
 
-uint8_t next_byte(src_t *s)
-{
-	if(s->more_data) {
-		int c = mem.memgetc(s->stream);
-		if(c != EOF) {
-			s->length += 8;
-			return (uint8_t) c;
-		}
-		s->more_data = false;
-
-		/*
-		 * Calculate padding parameters now that we know the
-		 * actual message length.
-		 */
-		init_padding(s);
-
-		/*
-		 * The spec says to add bit '1' to the end of the actual
-		 * data and then put zeros until a specific position is
-		 * reached. We can just add the whole byte with first bit
-		 * set to '1' because we will not reach that special
-		 * position for at least 7 more bits. And this byte is
-		 * actually value 128 (because bytes are treated as big-endian).
-		 */
-		return 128;
-	}
-
-	if(s->zeros > 0) {
-		s->zeros--;
-		return 0;
-	}
-
-	assert(s->lenpos < sizeof(s->lenbuf));
-	uint8_t b = s->lenbuf[s->lenpos++];
+typedef {
+	reader.t *in;
+	ctx_t *ctx;
+} hashreader_t;
 
-	// Put a flag after the stream is finished.
-	if (s->lenpos == sizeof(s->lenbuf)) {
-		s->more = false;
-	}
-	return b;
+/*
+ * Returns a reader that reads from in and adds everything it reads
+ * to the message in ctx. Freeing the reader doesn't free in.
+ */
+pub reader.t *newreader(reader.t *in, ctx_t *ctx)
+{
+	hashreader_t *r = calloc!(1, sizeof(hashreader_t));
+	r->in = in;
+	r->ctx = ctx;
+	return reader.new(r, hashread, OS.free);
 }
 
-void init_padding(src_t *s)
+int hashread(void *p, uint8_t *buf, size_t n)
 {
-	/*
-	 * Now we know 'b' (data length in bits), so we can create the
-	 * length mark and calculate how many zero bytes need to be added.
-	 */
-
-	/*
-	 * The length mark is a sequence of two words, low word first.
-	 */
-	int i = 0;
-	uint8_t b = 0;
-	uint32_t w = 0;
-	uint8_t *pos = (uint8_t *) &(s->lenbuf);
-
-	// low word
-	w = s->length & 0xFFFFFFFF;
-	for(i = 0; i < 4; i++) {
-		b = (w >> i*8) & 0xFF;
-		*pos = b;
-		pos++;
+	hashreader_t *r = p;
+	int c = reader.read(r->in, buf, n);
+	if (c > 0) {
+		update(r->ctx, buf, (size_t) c);
 	}
-	// high word
-	w = (s->length >> 32) & 0xFFFFFFFF;
-	for(int i = 0; i < 4; i++) {
-		b = (w >> i*8) & 0xFF;
-		*pos = b;
-		pos++;
-	}
-
-	s->lenpos = 0;
-
-	/*
-	 * To get the number of zero bytes we have to solve the following:
-	 * (length + 1 + zeros + 8) % 64 == 0
-	 * where '1' is for the 'eof' byte and '8' is for the length marker.
-	 */
-	int l = s->length/8;
-	int n = (9 + l) / 64;
-	if((9 + l) % 64 != 0) {
-		n++;
-	}
-	s->zeros = 64 * n - 9 - l;
+	return c;
 }
 
-
 /*
  * Data type for the MD5 message digest.
  */
@@ -195,12 +169,10 @@ pub bool md5_str(const char *s, uint32_t md[4])
  */
 pub bool md5_buf(const char *buf, size_t len, uint32_t md[4])
 {
-	mem.mem_t *z = mem.memopen();
-	int n = mem.memwrite(z, buf, len);
-	mem.rewind(z);
-	assert((size_t) n == len);
-	md5(z, md);
-	mem.memclose(z);
+	ctx_t c = {};
+	init(&c);
+	update(&c, (uint8_t *) buf, len);
+	end(&c, md);
 	return true;
 }
 
@@ -1,4 +1,5 @@
 #import crypt/md5
+#import reader
 #import test
 
 md5.md5str_t buf = "";
@@ -20,5 +21,39 @@ int main() {
 		hash("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"));
 	test.streq("57edf4a22be3c955ac49da2e2107b67a",
 		hash("12345678901234567890" "123456789012345678901234567890123456789012345678901234567890"));
+
+	// Streaming in uneven parts gives the same digest.
+	const char *msg = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	md5.ctx_t c = {};
+	md5.init(&c);
+	size_t n = strlen(msg);
+	size_t pos = 0;
+	size_t step = 1;
+	while (pos < n) {
+		size_t k = step;
+		if (pos + k > n) k = n - pos;
+		md5.update(&c, (uint8_t *) msg + pos, k);
+		pos += k;
+		step = step * 2 + 1;
+	}
+	md5.md5sum_t md = {0};
+	md5.end(&c, md);
+	md5.md5str_t streamed = "";
+	md5.md5_sprint(md, streamed);
+	test.streq(hash(msg), streamed);
+
+	// The same through a reader.
+	md5.init(&c);
+	reader.t *in = reader.string(msg);
+	reader.t *r = md5.newreader(in, &c);
+	uint8_t tmp[10];
+	while (reader.read(r, tmp, sizeof(tmp)) > 0) {}
+	reader.free(r);
+	reader.free(in);
+	md5.end(&c, md);
+	md5.md5str_t viareader = "";
+	md5.md5_sprint(md, viareader);
+	test.streq(hash(msg), viareader);
 	return test.fails();
 }
@@ -59,16 +59,7 @@ pub void as_bytes(digest_t *hash, uint8_t *buf) {
 pub bool add(digest_t *hash, char byte) {
 	// Make sure add is not called after the end.
 	if (hash->finished) return false;
-
-	// On the first add set the initial sum.
-	if (!hash->init) {
-		hash->init = true;
-		hash->sum[0] = 0x67452301;
-		hash->sum[1] = 0xefcdab89;
-		hash->sum[2] = 0x98badcfe;
-		hash->sum[3] = 0x10325476;
-		hash->sum[4] = 0xc3d2e1f0;
-	}
+	start(hash);
 
 	hash->pos++;
 	hash->length += 8;
@@ -76,6 +67,53 @@ pub bool add(digest_t *hash, char byte) {
 	return true;
 }
 
+/*
+ * Adds n bytes from buf to the hash.
+ * Whole 64-byte blocks are fed to the compression function directly
+ * from the buffer, only the unaligned head and tail go byte by byte.
+ */
+pub bool update(digest_t *hash, const uint8_t *buf, size_t n) {
+	if (hash->finished) return false;
+	start(hash);
+
+	hash->pos += n;
+	hash->length += (uint64_t) n * 8;
+
+	// Complete a partially collected block.
+	while (n > 0 && (hash->_bytes > 0 || hash->_words > 0)) {
+		push_byte(hash, *buf++);
+		n--;
+	}
+
+	uint32_t block[16];
+	while (n >= 64) {
+		for (int i = 0; i < 16; i++) {
+			const uint8_t *p = buf + 4*i;
+			block[i] = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+		}
+		sha1_feed(block, hash->sum);
+		buf += 64;
+		n -= 64;
+	}
+
+	while (n > 0) {
+		push_byte(hash, *buf++);
+		n--;
+	}
+	return true;
+}
+
+// On the first add sets the initial sum.
+void start(digest_t *hash) {
+	if (hash->init) return;
+	hash->init = true;
+	hash->sum[0] = 0x67452301;
+	hash->sum[1] = 0xefcdab89;
+	hash->sum[2] = 0x98badcfe;
+	hash->sum[3] = 0x10325476;
+	hash->sum[4] = 0xc3d2e1f0;
+}
+
 pub bool end(digest_t *hash) {
 	if (hash->finished) return false;
 	hash->finished = true;
@@ -151,8 +189,34 @@ void sha1_feed(uint32_t block[16], uint32_t sum[5]) {
 	uint32_t d = sum[3];
 	uint32_t e = sum[4];
 	uint32_t T = 0;
-	for (int t = 0; t < 80; t++) {
-		T = ROTL(5, a) + f(t, b, c, d) + e + K(t) + W[t];
+	// The same as T = ROTL(5, a) + f(t, b, c, d) + e + K(t) + W[t]
+	// for t = 0..79, with f and K fixed in each group of 20 rounds.
+	for (int t = 0; t < 20; t++) {
+		T = ROTL(5, a) + ((b & c) | ((~b) & d)) + e + 0x5a827999 + W[t];
+		e = d;
+		d = c;
+		c = ROTL(30, b);
+		b = a;
+		a = T;
+	}
+	for (int t = 20; t < 40; t++) {
+		T = ROTL(5, a) + (b ^ c ^ d) + e + 0x6ed9eba1 + W[t];
+		e = d;
+		d = c;
+		c = ROTL(30, b);
+		b = a;
+		a = T;
+	}
+	for (int t = 40; t < 60; t++) {
+		T = ROTL(5, a) + ((b & c) ^ (b & d) ^ (c & d)) + e + 0x8f1bbcdc + W[t];
+		e = d;
+		d = c;
+		c = ROTL(30, b);
+		b = a;
+		a = T;
+	}
+	for (int t = 60; t < 80; t++) {
+		T = ROTL(5, a) + (b ^ c ^ d) + e + 0xca62c1d6 + W[t];
 		e = d;
 		d = c;
 		c = ROTL(30, b);
@@ -169,26 +233,6 @@ void sha1_feed(uint32_t block[16], uint32_t sum[5]) {
 	sum[4] += e;
 }
 
-/*
- * Logical functions f[t]: f0, f1, ..., f79
- */
-uint32_t f(int t, uint32_t x, y, z) {
-	if (t < 20) return (x & y) | ((~x) & z);
-	if (t < 40) return x ^ y ^ z;
-	if (t < 60) return (x & y) ^ (x & z) ^ (y & z);
-	return x ^ y ^ z;
-}
-
-/*
- * Constants K[i]: K0, K1, ..., K79
- */
-uint32_t K(int t) {
-	if (t < 20) return 0x5a827999;
-	if (t < 40) return 0x6ed9eba1;
-	if (t < 60) return 0x8f1bbcdc;
-	return 0xca62c1d6;
-}
-
 /*
  * Rotate-left.
  */
@@ -10,5 +10,26 @@ int main() {
 	char hex[41] = {};
 	test.truth("format", sha1.format(&hash, hex, sizeof(hex)));
 	test.streq("34aa973cd4c4daa4f61eeb2bdbad27316534016f", hex);
+
+	// The same with update in uneven portions, so that blocks are split
+	// between calls.
+	uint8_t *buf = calloc!(1000000, 1);
+	memset(buf, 'a', 1000000);
+	sha1.digest_t hash2 = {};
+	size_t pos = 0;
+	size_t step = 1;
+	while (pos < 1000000) {
+		size_t n = step;
+		if (pos + n > 1000000) n = 1000000 - pos;
+		sha1.update(&hash2, buf + pos, n);
+		pos += n;
+		step = step * 3 + 1;
+	}
+	sha1.end(&hash2);
+	char hex2[41] = {};
+	sha1.format(&hash2, hex2, sizeof(hex2));
+	test.streq("34aa973cd4c4daa4f61eeb2bdbad27316534016f", hex2);
+
+	OS.free(buf);
 	return test.fails();
 }
@@ -0,0 +1,90 @@
+#import fft
+#import math/complex
+#import test
+
+int main() {
+	// Powers of 2 and 4, the other fast radices, a generic radix and
+	// a prime size.
+	size_t sizes[] = {1, 2, 3, 4, 5, 8, 12, 16, 60, 64, 100, 49, 1024, 97};
+	for (size_t i = 0; i < nelem(sizes); i++) {
+		checksize(sizes[i]);
+	}
+
+	test.truth("plans are cached", fft.plan(64, false) == fft.plan(64, false));
+	test.truth("inverse is another plan", fft.plan(64, false) != fft.plan(64, true));
+
+	// Real transforms agree with complex ones and come back.
+	size_t n = 60;
+	double x[60] = {};
+	complex.t cx[60] = {};
+	for (size_t i = 0; i < n; i++) {
+		x[i] = sin(0.3 * (double) i) + (double) (i % 7) / 7;
+		cx[i].re = x[i];
+	}
+	complex.t want[60] = {};
+	fft.run(fft.plan(n, false), cx, want);
+	complex.t bins[31] = {};
+	fft.rfft(fft.rplan(n, false), x, bins);
+	double err = 0;
+	for (size_t k = 0; k <= n / 2; k++) {
+		err = OS.fmax(err, complex.abs(complex.diff(bins[k], want[k])));
+	}
+	test.truth("rfft", err < 1e-9);
+
+	double back[60] = {};
+	fft.irfft(fft.rplan(n, true), bins, back);
+	err = 0;
+	for (size_t i = 0; i < n; i++) {
+		err = OS.fmax(err, fabs(back[i] / (double) n - x[i]));
+	}
+	test.truth("irfft", err < 1e-12);
+
+	// Batches give the same bins as single transforms.
+	double frames[120] = {};
+	for (size_t i = 0; i < 120; i++) {
+		frames[i] = x[i % 60] * (double) (1 + i / 60);
+	}
+	complex.t many[62] = {};
+	fft.rfftmany(fft.rplan(n, false), frames, many, 2);
+	err = 0;
+	for (size_t k = 0; k <= n / 2; k++) {
+		err = OS.fmax(err, complex.abs(complex.diff(many[k], bins[k])));
+		err = OS.fmax(err, complex.abs(complex.diff(many[31 + k], complex.scale(bins[k], 2))));
+	}
+	test.truth("rfftmany", err < 1e-9);
+	return test.fails();
+}
+
+// Compares the transforms of size n with a plain DFT, in and out of
+// place, both ways.
+void checksize(size_t n) {
+	complex.t *x = calloc!(n, sizeof(complex.t));
+	complex.t *y = calloc!(n, sizeof(complex.t));
+	for (size_t i = 0; i < n; i++) {
+		x[i] = complex.make(cos(0.7 * (double) i), (double) (i % 5) - 2);
+	}
+	fft.run(fft.plan(n, false), x, y);
+	double err = 0;
+	for (size_t k = 0; k < n; k++) {
+		complex.t sum = {};
+		for (size_t i = 0; i < n; i++) {
+			double phase = -2 * OS.M_PI * (double) ((i * k) % n) / (double) n;
+			sum = complex.sum(sum, complex.mul(x[i], complex.make(cos(phase), sin(phase))));
+		}
+		err = OS.fmax(err, complex.abs(complex.diff(sum, y[k])));
+	}
+	char name[40] = {};
+	snprintf(name, sizeof(name), "dft %zu", n);
+	test.truth(name, err < 1e-9 * (double) n);
+
+	// Inverse in place brings back n times the input.
+	fft.run(fft.plan(n, true), y, y);
+	err = 0;
+	for (size_t i = 0; i < n; i++) {
+		err = OS.fmax(err, complex.abs(complex.diff(complex.scale(y[i], 1.0 / (double) n), x[i])));
+	}
+	snprintf(name, sizeof(name), "inverse %zu", n);
+	test.truth(name, err < 1e-12 * (double) n);
+	free(x);
+	free(y);
+}
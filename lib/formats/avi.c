@@ -1,172 +1,210 @@
+// AVI writer for uncompressed 24-bit video.
+//
+// Frames are written out as they come, so the output can be a pipe.
+// The index goes at the end. If the output file is seekable, stop also
+// fills in the sizes and the frame count in the headers. Otherwise
+// they stay as placeholders, and players find the frames by the index.
+
 #import enc/endian
 #import image
 #import writer
 
 pub typedef {
 	writer.t *out;
-    int64_t riff_size_pos;
-    int64_t hdrl_size_pos;
-    int64_t strl_size_pos;
-    int64_t movi_size_pos;
-    int64_t movi_start;
-    int width, height, fps;
-    int frame_count;
-	uint8_t *frame;
+	FILE *f;
+	int64_t base; // file position of the stream start, -1 if not seekable
+	int64_t riff_size_pos;
+	int64_t frames_pos;
+	int64_t length_pos;
+	int64_t movi_size_pos;
+	int64_t movi_start;
+	int width, height, fps;
+	int frame_count;
+	size_t rowsize; // bytes per row, padded to 4
+	uint32_t framesize;
+	uint8_t *chunk; // chunk header followed by the frame
 } writer_t;
 
 // Starts an AVI stream writing into f.
 pub writer_t *start(FILE *f, int width, height, fps) {
 	writer.t *w = writer.file(f);
-    writer_t *avi = calloc!(1, sizeof(writer_t));
+	writer_t *avi = calloc!(1, sizeof(writer_t));
 	avi->out = w;
-    avi->width = width;
-    avi->height = height;
-    avi->fps = fps;
+	avi->f = f;
+	avi->base = ftell(f);
+	avi->width = width;
+	avi->height = height;
+	avi->fps = fps;
+	// DIB rows are padded to multiples of 4 bytes.
+	avi->rowsize = ((size_t) width * 3 + 3) / 4 * 4;
+	avi->framesize = (uint32_t) (avi->rowsize * (size_t) height);
+	uint32_t framesize = avi->framesize;
 
 	// Begin RIFF
-	writer.write(w, (uint8_t *)"RIFF", 4);
-    avi->riff_size_pos = w->nwritten;
-	
-	endian.write4le(w, 999999); // placeholder
+	writer.write(w, (uint8_t *) "RIFF", 4);
+	avi->riff_size_pos = w->nwritten;
+	endian.write4le(w, 0); // patched in stop
 
 	writer.write(w, (uint8_t *) "AVI ", 4);
 	writer.write(w, (uint8_t *) "LIST", 4);
-    avi->hdrl_size_pos = w->nwritten;
-	endian.write4le(w, 999999); // placeholder
+	endian.write4le(w, 192); // hdrl size: avih and the strl list
 	writer.write(w, (uint8_t *) "hdrl", 4);
 
 	// avi header
 	writer.write(w, (uint8_t *) "avih", 4);
 	endian.write4le(w, 56);
-    endian.write4le(w, 1000000 / fps);         // dwMicroSecPerFrame
-    endian.write4le(w, width * height * 3 * fps);
-    endian.write4le(w, 0);                     // padding
-    endian.write4le(w, 0x10);                  // flags
-    endian.write4le(w, 0);                     // total frames (patch later)
-    endian.write4le(w, 0);                     // initial frames
-    endian.write4le(w, 1);                     // streams
-    endian.write4le(w, width * height * 3);    // buffer size
-    endian.write4le(w, width);
-    endian.write4le(w, height);
-    for (int i = 0; i < 4; i++) {
+	endian.write4le(w, 1000000 / fps); // dwMicroSecPerFrame
+	endian.write4le(w, framesize * fps); // dwMaxBytesPerSec
+	endian.write4le(w, 0); // padding
+	endian.write4le(w, 0x10); // flags: has index
+	avi->frames_pos = w->nwritten;
+	endian.write4le(w, 0); // total frames, patched in stop
+	endian.write4le(w, 0); // initial frames
+	endian.write4le(w, 1); // streams
+	endian.write4le(w, framesize + 8); // buffer size
+	endian.write4le(w, width);
+	endian.write4le(w, height);
+	for (int i = 0; i < 4; i++) {
 		endian.write4le(w, 0);
 	}
 
 	writer.write(w, (uint8_t *) "LIST", 4);
-    avi->strl_size_pos = w->nwritten;
-	endian.write4le(w, 0); // placeholder
+	endian.write4le(w, 116); // strl size: strh and strf
 	writer.write(w, (uint8_t *) "strl", 4);
 
 	writer.write(w, (uint8_t *) "strh", 4);
 	endian.write4le(w, 56);
 	writer.write(w, (uint8_t *) "vids", 4);
 	writer.write(w, (uint8_t *) "DIB ", 4);
-    endian.write4le(w, 0);
+	endian.write4le(w, 0);
 	writer.write(w, (uint8_t *) "\0\0\0\0", 4); // priority+language
-    endian.write4le(w, 0);
-    endian.write4le(w, 1);
-    endian.write4le(w, fps);
-    endian.write4le(w, 0);
-    endian.write4le(w, 0); // length (patch later)
-    endian.write4le(w, width * height * 3);
-    endian.write4le(w, 0xFFFFFFFF);
-    endian.write4le(w, 0);
+	endian.write4le(w, 0);
+	endian.write4le(w, 1);
+	endian.write4le(w, fps);
+	endian.write4le(w, 0);
+	avi->length_pos = w->nwritten;
+	endian.write4le(w, 0); // length, patched in stop
+	endian.write4le(w, framesize + 8);
+	endian.write4le(w, 0xFFFFFFFF);
+	endian.write4le(w, 0);
 	writer.write(w, (uint8_t *) "\0\0\0\0\0\0\0\0", 8); // rcFrame
 
-	//
-    writer.write(w, (uint8_t *) "strf", 4);
+	// Bitmap header. The positive height means that rows go bottom up.
+	writer.write(w, (uint8_t *) "strf", 4);
+	endian.write4le(w, 40);
 	endian.write4le(w, 40);
-    endian.write4le(w, 40);
-    endian.write4le(w, width);
-    endian.write4le(w, height);
-    writer.write(w, (uint8_t *) "\1\0", 2); // planes
-    writer.write(w, (uint8_t *) "\30\0", 2); // 24-bit
-    endian.write4le(w, 0);
-    endian.write4le(w, width * height * 3);
-    endian.write4le(w, 0);
-    endian.write4le(w, 0);
-    endian.write4le(w, 0);
-    endian.write4le(w, 0);
-
-	//
-    writer.write(w, (uint8_t *) "LIST", 4);
-    avi->movi_size_pos = w->nwritten;
-	endian.write4le(w, 9999999); // placeholder
-    writer.write(w, (uint8_t *) "movi", 4);
-    avi->movi_start = w->nwritten;
-
-	avi->frame = calloc!(1, width * height * 3);
-
-    return avi;
+	endian.write4le(w, width);
+	endian.write4le(w, height);
+	writer.write(w, (uint8_t *) "\1\0", 2); // planes
+	writer.write(w, (uint8_t *) "\30\0", 2); // 24-bit
+	endian.write4le(w, 0);
+	endian.write4le(w, framesize);
+	endian.write4le(w, 0);
+	endian.write4le(w, 0);
+	endian.write4le(w, 0);
+	endian.write4le(w, 0);
+
+	writer.write(w, (uint8_t *) "LIST", 4);
+	avi->movi_size_pos = w->nwritten;
+	endian.write4le(w, 0); // patched in stop
+	writer.write(w, (uint8_t *) "movi", 4);
+	avi->movi_start = w->nwritten;
+
+	// The chunk header stays the same for all frames.
+	avi->chunk = calloc!(8 + (size_t) framesize, 1);
+	memcpy(avi->chunk, "00db", 4);
+	put4le(avi->chunk + 4, framesize);
+	return avi;
 }
 
+// Appends img as the next frame.
+// The image must have the size given to start.
 pub void addframe(writer_t *avi, image.image_t *img) {
 	if (img->width != avi->width || img->height != avi->height) {
 		panic("frame image size mismatch");
 	}
-	int width = avi->width;
-	int height = avi->height;
-
-	uint8_t *frame = avi->frame;
-	memset(frame, 0, width * height * 3);
-	
-	// uint8_t *frame = calloc!(1, width * height * 3);
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			int pos = y * (width*3) + (x*3);
-			image.rgba_t c = image.get(img, x, y);
-			frame[pos++] = c.red;
-			frame[pos++] = c.green;
-			frame[pos++] = c.blue;
-		}
+	uint8_t *frame = avi->chunk + 8;
+	for (int y = 0; y < avi->height; y++) {
+		bgrrow(img, y, frame + (size_t) (avi->height - 1 - y) * avi->rowsize);
 	}
+	// The frame size is even, so the chunk needs no padding byte.
+	writer.write(avi->out, avi->chunk, 8 + (size_t) avi->framesize);
+	avi->frame_count++;
+}
 
-	writer.t *w = avi->out;
-	writer.write(w, (uint8_t *) "00db", 4);
-    uint32_t frame_size = avi->width * avi->height * 3;
-    endian.write4le(w, frame_size);
-	writer.write(w, frame, frame_size);
-    if (frame_size & 1) {
-		writer.writebyte(w, 0);
+// Puts row y of img into dst as BGR pixels.
+void bgrrow(image.image_t *img, int y, uint8_t *dst) {
+	int n = img->width;
+	const uint8_t *src = image.row(img, y);
+	switch (img->format) {
+		case image.RGBA8: {
+			for (int x = 0; x < n; x++) {
+				dst[3 * x + 0] = src[4 * x + 2];
+				dst[3 * x + 1] = src[4 * x + 1];
+				dst[3 * x + 2] = src[4 * x + 0];
+			}
+		}
+		case image.RGB8: {
+			for (int x = 0; x < n; x++) {
+				dst[3 * x + 0] = src[3 * x + 2];
+				dst[3 * x + 1] = src[3 * x + 1];
+				dst[3 * x + 2] = src[3 * x + 0];
+			}
+		}
+		default: {
+			image.readrow(img, y, image.RGB8, dst);
+			for (int x = 0; x < n; x++) {
+				uint8_t r = dst[3 * x];
+				dst[3 * x] = dst[3 * x + 2];
+				dst[3 * x + 2] = r;
+			}
+		}
 	}
-    avi->frame_count++;
-	// free(frame);
 }
 
+// Writes the index, finishes the stream and frees the writer.
 pub void stop(writer_t *avi) {
-	free(avi->frame);
+	free(avi->chunk);
 	writer.t *w = avi->out;
+	int64_t movi_end = w->nwritten;
 
-    // int64_t movi_end = ftell(f);
-    // fseek(f, avi->movi_size_pos, SEEK_SET);
-    // endian.write4le(w, movi_end - (avi->movi_size_pos + 4));
-    // fseek(f, movi_end, SEEK_SET);
-
+	// Index entries are offsets from the "movi" tag, and all frames have
+	// the same size, so there's nothing to remember between frames.
+	uint8_t entry[16] = {'0', '0', 'd', 'b', 0x10, 0, 0, 0};
+	put4le(entry + 12, avi->framesize);
 	writer.write(w, (uint8_t *) "idx1", 4);
-    endian.write4le(w, avi->frame_count * 16);
-
-    int64_t offset = avi->movi_start - 8;
-    for (int i = 0; i < avi->frame_count; i++) {
-        writer.write(w, (uint8_t *) "00db", 4);
-        endian.write4le(w, 0x10);
-        endian.write4le(w, offset);
-        endian.write4le(w, avi->width * avi->height * 3);
-        offset += 8 + avi->width * avi->height * 3;
-        if ((avi->width * avi->height * 3) & 1) offset++;
-    }
-
-    // // Patch RIFF size
-    // int64_t file_end = ftell(f);
-    // fseek(f, 4, SEEK_SET);
-    // endian.write4le(w, file_end - 8);
-
-    // // Patch frame count in headers
-    // fseek(f, 32, SEEK_SET); // dwTotalFrames in avih
-    // endian.write4le(w, avi->frame_count);
-
-    // fseek(f, 140, SEEK_SET); // dwLength in strh
-    // endian.write4le(w, avi->frame_count);
+	endian.write4le(w, (uint32_t) avi->frame_count * 16);
+	int64_t offset = 4;
+	for (int i = 0; i < avi->frame_count; i++) {
+		put4le(entry + 8, (uint32_t) offset);
+		writer.write(w, entry, 16);
+		offset += 8 + (int64_t) avi->framesize;
+	}
 
+	if (avi->base >= 0) {
+		int64_t end = w->nwritten;
+		patch(avi, avi->riff_size_pos, (uint32_t) (end - 8));
+		patch(avi, avi->movi_size_pos, (uint32_t) (movi_end - avi->movi_size_pos - 4));
+		patch(avi, avi->frames_pos, (uint32_t) avi->frame_count);
+		patch(avi, avi->length_pos, (uint32_t) avi->frame_count);
+		fseek(avi->f, avi->base + end, SEEK_SET);
+	}
 	writer.free(w);
-    free(avi);
+	free(avi);
+}
+
+// Overwrites the 4-byte value at position pos of the stream.
+void patch(writer_t *avi, int64_t pos, uint32_t v) {
+	uint8_t buf[4] = {};
+	put4le(buf, v);
+	fflush(avi->f);
+	if (fseek(avi->f, avi->base + pos, SEEK_SET) == 0) {
+		fwrite(buf, 1, 4, avi->f);
+	}
+}
+
+void put4le(uint8_t *p, uint32_t v) {
+	for (int i = 0; i < 4; i++) {
+		p[i] = (v >> (8 * i)) & 0xFF;
+	}
 }
@@ -0,0 +1,49 @@
+#import formats/avi
+#import image
+#import test
+
+int main() {
+	// A 3x2 image: rows are padded to 12 bytes and go bottom up in BGR.
+	image.image_t *img = image.new(3, 2);
+	image.rgba_t top = {1, 2, 3, 0};
+	image.rgba_t bottom = {4, 5, 6, 0};
+	image.set(img, 0, 0, top);
+	image.set(img, 0, 1, bottom);
+
+	FILE *f = tmpfile();
+	avi.writer_t *vid = avi.start(f, 3, 2, 10);
+	for (int i = 0; i < 3; i++) {
+		avi.addframe(vid, img);
+	}
+	avi.stop(vid);
+	image.free(img);
+
+	uint8_t buf[1000] = {};
+	int64_t size = ftell(f);
+	rewind(f);
+	test.truth("read", fread(buf, 1, sizeof(buf), f) == (size_t) size);
+	fclose(f);
+
+	// Headers, 3 chunks of 8+24 bytes and 3 index entries.
+	test.truth("size", size == 224 + 3 * 32 + 8 + 3 * 16);
+	test.truth("riff size", get4le(buf + 4) == (uint32_t) size - 8);
+	test.truth("total frames", get4le(buf + 48) == 3);
+	test.truth("length", get4le(buf + 140) == 3);
+	test.truth("movi size", get4le(buf + 216) == 4 + 3 * 32);
+
+	const uint8_t *chunk = buf + 224 + 32;
+	test.truth("chunk tag", memcmp(chunk, "00db", 4) == 0);
+	test.truth("chunk size", get4le(chunk + 4) == 24);
+	uint8_t pixels[] = {6, 5, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 2, 1};
+	test.truth("pixels", memcmp(chunk + 8, pixels, sizeof(pixels)) == 0);
+
+	const uint8_t *idx = buf + 224 + 3 * 32;
+	test.truth("idx1", memcmp(idx, "idx1", 4) == 0 && get4le(idx + 4) == 48);
+	test.truth("entry 1", get4le(idx + 8 + 16 + 8) == 4 + 32);
+	test.truth("entry size", get4le(idx + 8 + 16 + 12) == 24);
+	return test.fails();
+}
+
+uint32_t get4le(const uint8_t *p) {
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
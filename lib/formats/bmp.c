@@ -62,18 +62,20 @@ pub bool write(image.image_t *img, const char *filename) {
 	endian.write4le(w, 0);
 	endian.write4le(w, 0);
 
+	uint8_t *buf = calloc!(width, 3);
 	for (int y = height - 1; y >= 0; y--) {
+		image.readrow(img, y, image.RGB8, buf);
 		for (int x = 0; x < width; x++) {
-			image.rgba_t *c = image.getpixel(img, x, y);
-			endian.write1(w, c->blue);
-			endian.write1(w, c->green);
-			endian.write1(w, c->red);
+			endian.write1(w, buf[3 * x + 2]);
+			endian.write1(w, buf[3 * x + 1]);
+			endian.write1(w, buf[3 * x]);
 		}
 		for (int i = 0; i < pad; i++) {
 			endian.write1(w, 0);
 		}
 	}
 
+	OS.free(buf);
 	OS.free(w);
 	return fclose(out) == 0;
 }
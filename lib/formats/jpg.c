@@ -2,6 +2,8 @@
 #import compress/huffman
 #import enc/endian
 #import image
+#import os/self
+#import os/threads
 #import reader
 // #import dbg
 #import formats/tiff
@@ -41,6 +43,17 @@ pub typedef {
 
 pub jpeg_t *read(const char *path, err_t *err) {
 	FILE *f = fopen(path, "rb");
+	if (!f) {
+		seterr(err, "failed to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	jpeg_t *j = readfile(f, err);
+	fclose(f);
+	return j;
+}
+
+// Reads an image from file f, which stays open.
+pub jpeg_t *readfile(FILE *f, err_t *err) {
 	reader.t *R = reader.file(f);
 	jpeg_t *self = calloc!(1, sizeof(jpeg_t));
 	while (true) {
@@ -58,20 +71,18 @@ pub jpeg_t *read(const char *path, err_t *err) {
 			case 0xffdb: { read_quant_table(self, R); }
 			case 0xffdd: { read_restart_interval(self, R, err); }
 			case 0xffc0: { read_baseline_dct(self, R, err); }
-			case 0xffc4: { read_huffman_table(self, R); }
-			case 0xffda: { read_scan(self, R); }
+			case 0xffc4: { read_huffman_table(self, R, err); }
+			case 0xffda: { read_scan(self, R, err); }
 			case 0xffd8: {}
 			default: { panic("unknown header %x", hdr); }
 		}
 		if (err->set) {
 			OS.free(self);
 			reader.free(R);
-			fclose(f);
 			return NULL;
 		}
 	}
 	reader.free(R);
-	fclose(f);
 	return self;
 }
 
@@ -252,10 +263,6 @@ void read_baseline_dct(jpeg_t *self, reader.t *r, err_t *err) {
 		uint8_t id = c->id;
 		printf("\tcomponent %u: id=%u (%s)", i, id, ids[id]);
 		printf(" sampling_factors=%d,%d qtable_num=%u\n", c->hsize, c->vsize, c->qtable_index);
-		if (c->vsize != 1 || c->hsize != 1) {
-			seterr(err, "sampling factors != 1 not implemented");
-			// return;
-		}
 		if (i == 0 && id != 1) {
 			panic("expected component %d, got %u", 1, id);
 		}
@@ -272,7 +279,7 @@ void read_baseline_dct(jpeg_t *self, reader.t *r, err_t *err) {
 	self->img = image.new(w, h);
 }
 
-void read_huffman_table(jpeg_t *self, reader.t *r) {
+void read_huffman_table(jpeg_t *self, reader.t *r, err_t *err) {
 	uint16_t len = 0;
 	uint8_t id;
 	uint8_t lengths[16] = {};
@@ -280,6 +287,11 @@ void read_huffman_table(jpeg_t *self, reader.t *r) {
 	endian.read2be(r, &len);
 	reader.read(r, &id, 1);
 	reader.read(r, lengths, 16);
+	// The class (0=dc, 1=ac) in the high half, the table number in the low.
+	if ((id >> 4) > 1 || (id & 0xf) > 3) {
+		seterr(err, "invalid Huffman table id 0x%x", id);
+		return;
+	}
 
 	size_t sum = 0;
 	for (int i = 0; i < 16; i++) {
@@ -308,7 +320,34 @@ void read_huffman_table(jpeg_t *self, reader.t *r) {
 	OS.free(elements);
 }
 
-void read_scan(jpeg_t *self, reader.t *r) {
+// State of a scan being decoded.
+typedef {
+	// The scan's components, in the order their blocks come in an MCU.
+	int comps[3]; // indexes into the frame's components
+	int dctables[3]; // Huffman table ids
+	int actables[3];
+	int hmax, vmax; // largest sampling factors
+	int mcux, mcuy; // number of MCUs across and down
+	int nmcu;
+
+	// The components are decoded into planes, which cover whole MCUs.
+	uint8_t *planes[3];
+	int pw[3], ph[3]; // plane sizes
+	int cw[3], ch[3]; // sizes of the component within the image
+	int fh[3], fv[3]; // how many times the component is scaled up
+
+	// The entropy-coded data with the 0xff stuffing removed, cut into
+	// restart intervals.
+	uint8_t *data;
+	size_t *segments; // nsegments + 1 offsets into data
+	int nsegments;
+
+	threads.mtx_t *lock;
+	int next; // next interval to decode
+	bool truncated; // an interval ended before all its MCUs
+} scan_t;
+
+void read_scan(jpeg_t *self, reader.t *r, err_t *err) {
 	uint16_t len = 0;
 	endian.read2be(r, &len);
 	if (len != 12) {
@@ -319,8 +358,10 @@ void read_scan(jpeg_t *self, reader.t *r) {
 	// read scan header
 	//
 	printf("scan header\n");
+	scan_t *s = calloc!(1, sizeof(scan_t));
 	uint8_t ncomp;
 	reader.read(r, &ncomp, 1);
+	bool seen[3] = {};
 	for (uint8_t i = 0; i < ncomp; i++) {
         uint8_t id;
 		uint8_t wtf;
@@ -328,7 +369,21 @@ void read_scan(jpeg_t *self, reader.t *r) {
         reader.read(r, &wtf, 1);
         int dc_table_id = wtf >> 4;
         int ac_table_id = wtf & 0xf;
-		printf("\tcomponent %u: dctable=%d actable=%d\n", i, dc_table_id, ac_table_id);
+		printf("\tcomponent %u: id=%u dctable=%d actable=%d\n", i, id, dc_table_id, ac_table_id);
+		if (i >= 3 || err->set) {
+			continue;
+		}
+		// Components are referred to by their ids, which needn't follow
+		// the order of the frame header.
+		int k = findcomponent(self, id);
+		if (k < 0 || seen[k]) {
+			seterr(err, "scan component %u is not in the frame", id);
+			continue;
+		}
+		seen[k] = true;
+		s->comps[i] = k;
+		s->dctables[i] = dc_table_id;
+		s->actables[i] = 16 + ac_table_id;
 	}
 
 	uint8_t ss;
@@ -339,154 +394,369 @@ void read_scan(jpeg_t *self, reader.t *r) {
 	reader.read(r, &ahal, 1);
     printf("ss=%u se=%u ah/al=%u\n", ss, se, ahal);
 
-	reader.t *e = escreader(r);
-	read_scan_data(self, e);
-	reader.free(e);
+	if (!err->set && ncomp != 3) {
+		seterr(err, "scans with %u components not implemented", ncomp);
+	}
+	if (!err->set) {
+		checktables(self, s, err);
+	}
+	if (err->set) {
+		OS.free(s);
+		return;
+	}
+	readsegments(s, r);
+	if (!initscan(self, s, err)) {
+		freescan(s);
+		return;
+	}
+	// Data cut off at a restart marker has fewer intervals.
+	int nintervals = 1;
+	if (self->restart_interval > 0) {
+		int ri = self->restart_interval;
+		nintervals = (s->nmcu + ri - 1) / ri;
+	}
+	if (s->nsegments < nintervals) {
+		seterr(err, "scan data ended early");
+		freescan(s);
+		return;
+	}
+
+	// The restart intervals don't depend on each other, so they are
+	// decoded on several threads, each taking the next undecoded one.
+	size_t nthreads = ncpus();
+	if (nthreads > (size_t) s->nsegments) {
+		nthreads = (size_t) s->nsegments;
+	}
+	// The Huffman decoding tables are built on the first use, do that
+	// before the threads share them.
+	for (int i = 0; i < 3; i++) {
+		huffman.prepare(self->htables[s->dctables[i]], false);
+		huffman.prepare(self->htables[s->actables[i]], false);
+	}
+	s->lock = threads.mtx_new();
+	if (nthreads <= 1) {
+		decodeintervals(self, s);
+	} else {
+		threads.thr_t **tt = calloc!(nthreads, sizeof(threads.thr_t *));
+		decoder_t *dd = calloc!(nthreads, sizeof(decoder_t));
+		for (size_t i = 0; i < nthreads; i++) {
+			dd[i].jpeg = self;
+			dd[i].scan = s;
+			tt[i] = threads.start(&decoder, &dd[i]);
+		}
+		for (size_t i = 0; i < nthreads; i++) {
+			threads.wait(tt[i], NULL);
+		}
+		OS.free(tt);
+		OS.free(dd);
+	}
+	threads.mtx_free(s->lock);
+	if (s->truncated) {
+		seterr(err, "scan data ended early");
+		freescan(s);
+		return;
+	}
+
+	composergb(self, s);
+	freescan(s);
 }
 
-void read_scan_data(jpeg_t *self, reader.t *r) {
-	bits.reader_t *br = bits.newreader(r, bits.STRAIGHT);
+// Returns the index of the frame component with the given id, or -1.
+int findcomponent(jpeg_t *self, uint8_t id) {
+	for (int i = 0; i < (int) self->ncomponents; i++) {
+		if (self->components[i].id == id) return i;
+	}
+	return -1;
+}
 
-	// First values ("DC") are diff-encoded across all blocks.
-	// These will contain the current values.
-	int dc[3] = {0,0,0};
+// Checks that the tables the scan uses have been defined.
+void checktables(jpeg_t *self, scan_t *s, err_t *err) {
+	for (int i = 0; i < 3; i++) {
+		if (!self->htables[s->dctables[i]]) {
+			seterr(err, "undefined DC table %d", s->dctables[i]);
+			return;
+		}
+		if (!self->htables[s->actables[i]]) {
+			seterr(err, "undefined AC table %d", s->actables[i] - 16);
+			return;
+		}
+		component_t *c = &self->components[s->comps[i]];
+		if (c->qtable_index >= 4 || !self->quant[c->qtable_index]) {
+			seterr(err, "undefined quantization table %u", c->qtable_index);
+			return;
+		}
+	}
+}
+
+size_t ncpus() {
+	return (size_t) self.ncpus();
+}
+
+typedef {
+	jpeg_t *jpeg;
+	scan_t *scan;
+} decoder_t;
+
+void *decoder(void *arg) {
+	decoder_t *d = arg;
+	decodeintervals(d->jpeg, d->scan);
+	return NULL;
+}
 
-	// Read n blocks and tile them into the main image left to right.
+// Computes the scan geometry and allocates the planes.
+bool initscan(jpeg_t *self, scan_t *s, err_t *err) {
 	int w = self->img->width;
 	int h = self->img->height;
-	int ri = self->restart_interval;
-	image.image_t *block = image.new(8, 8);
-	int x = 0;
-	int y = 0;
-	int n = (h/8) * (w/8);
-	for (int i = 0; i < n; i++) {
-		ri--;
-		// printf("ri=%d\n", ri);
-		readunit(self, dc, br, block);
-		image.paste(self->img, block, x, y);
-		x += 8;
-		if (x >= w) {
-			x = 0;
-			y += 8;
-		}
-	}
-	image.free(block);
-}
-
-void readunit(jpeg_t *self, int *dc, bits.reader_t *br, image.image_t *block) {
-	// Read 3 component blocks
-	int vals1[64] = {};
-	int vals2[64] = {};
-	int vals3[64] = {};
-
-	// Y
-	huffman.reader_t *hrdc = huffman.newreader(self->htables[0], br);
-	huffman.reader_t *hrac = huffman.newreader(self->htables[16], br);
-	readblock(br, hrdc, hrac, dc[0], vals1);
-	huffman.closereader(hrdc);
-	huffman.closereader(hrac);
-	dc[0] = vals1[0];
-
-	// B
-	hrdc = huffman.newreader(self->htables[1], br);
-	hrac = huffman.newreader(self->htables[17], br);
-	readblock(br, hrdc, hrac, dc[1], vals2);
-	huffman.closereader(hrdc);
-	huffman.closereader(hrac);
-	dc[1] = vals2[0];
-
-	// R
-	hrdc = huffman.newreader(self->htables[1], br);
-	hrac = huffman.newreader(self->htables[17], br);
-	readblock(br, hrdc, hrac, dc[2], vals3);
-	huffman.closereader(hrdc);
-	huffman.closereader(hrac);
-	dc[2] = vals3[0];
-
-	// Undo quantization
-	uint8_t *quant1 = self->quant[self->components[0].qtable_index];
-	uint8_t *quant2 = self->quant[self->components[1].qtable_index];
-	uint8_t *quant3 = self->quant[self->components[2].qtable_index];
-	for (int i = 0; i < 64; i++) {
-		vals1[i] *= quant1[i];
-		vals2[i] *= quant2[i];
-		vals3[i] *= quant3[i];
-	}
-
-	// Undo zigzag
-	undozz(vals1);
-	undozz(vals2);
-	undozz(vals3);
-
-	// Rebuild the components
-	double Y[64] = {};
-	double Cb[64] = {};
-	double Cr[64] = {};
-	rebuild(vals1, Y);
-	rebuild(vals2, Cb);
-	rebuild(vals3, Cr);
-
-	// Compose RGB
-	image.rgba_t vv[64];
-	for (int i = 0; i < 64; i++) {
-		vv[i] = toRGB(Y[i], Cr[i], Cb[i]);
-	}
-
-	// Draw the block
-	int pos = 0;
-	for (int y = 0; y < 8; y++) {
-		for (int x = 0; x < 8; x++) {
-			image.rgba_t val = vv[pos++];
-			image.set(block, x, y, val);
+	for (int i = 0; i < 3; i++) {
+		component_t *c = &self->components[i];
+		if ((int) c->hsize > s->hmax) s->hmax = c->hsize;
+		if ((int) c->vsize > s->vmax) s->vmax = c->vsize;
+	}
+	for (int i = 0; i < 3; i++) {
+		component_t *c = &self->components[i];
+		if (c->hsize == 0 || c->vsize == 0 || s->hmax % c->hsize != 0 || s->vmax % c->vsize != 0) {
+			seterr(err, "sampling factors %u,%u not implemented", c->hsize, c->vsize);
+			return false;
 		}
 	}
+	int mcuw = 8 * s->hmax;
+	int mcuh = 8 * s->vmax;
+	s->mcux = (w + mcuw - 1) / mcuw;
+	s->mcuy = (h + mcuh - 1) / mcuh;
+	s->nmcu = s->mcux * s->mcuy;
+	for (int i = 0; i < 3; i++) {
+		component_t *c = &self->components[i];
+		s->pw[i] = s->mcux * c->hsize * 8;
+		s->ph[i] = s->mcuy * c->vsize * 8;
+		s->cw[i] = (w * c->hsize + s->hmax - 1) / s->hmax;
+		s->ch[i] = (h * c->vsize + s->vmax - 1) / s->vmax;
+		s->fh[i] = s->hmax / c->hsize;
+		s->fv[i] = s->vmax / c->vsize;
+		s->planes[i] = calloc!(s->pw[i] * s->ph[i], 1);
+	}
+	return true;
 }
 
-void rebuild(int *weights, double *out) {
-	double shape[64];
-	for (int i = 0; i < 64; i++) {
-		int w = weights[i];
-		if (w == 0) continue;
-		int n = i & 0x7;
-		int m = i >> 3;
-		getshape(shape, n, m);
-		mmulk(shape, (double) w);
-		madd(out, shape);
+void freescan(scan_t *s) {
+	for (int i = 0; i < 3; i++) {
+		OS.free(s->planes[i]);
 	}
+	OS.free(s->data);
+	OS.free(s->segments);
+	OS.free(s);
 }
 
-const uint8_t zigzag[] = {
-	0,   1,  8, 16,  9,  2,  3, 10,
-	17, 24, 32, 25, 18, 11,  4,  5,
-	12, 19,	26, 33, 40, 48, 41, 34,
-	27, 20, 13,  6,  7, 14, 21, 28,
-	35, 42, 49, 56, 57, 50, 43, 36,
-	29, 22, 15, 23, 30, 37, 44, 51,
-	58, 59, 52, 45, 38, 31, 39, 46,
-	53, 60, 61, 54, 47, 55, 62, 63};
+// Decodes restart intervals until there are none left.
+void decodeintervals(jpeg_t *self, scan_t *s) {
+	while (true) {
+		threads.lock(s->lock);
+		int i = s->next++;
+		threads.unlock(s->lock);
+		if (i >= s->nsegments) break;
+		if (!decodeinterval(self, s, i)) {
+			threads.lock(s->lock);
+			s->truncated = true;
+			threads.unlock(s->lock);
+		}
+	}
+}
+
+// Decodes restart interval i, the MCUs from i * restart_interval.
+// Without restart markers the whole scan is one interval.
+// Returns false if the data ended before the last MCU.
+bool decodeinterval(jpeg_t *self, scan_t *s, int i) {
+	int first = 0;
+	int n = s->nmcu;
+	if (self->restart_interval > 0) {
+		first = i * self->restart_interval;
+		n = self->restart_interval;
+		if (first + n > s->nmcu) n = s->nmcu - first;
+	}
+	reader.t *in = reader.static_buffer(s->data + s->segments[i], s->segments[i + 1] - s->segments[i]);
+	bits.reader_t *br = bits.newreader(in, bits.STRAIGHT);
+	huffman.reader_t *dcr[3] = {};
+	huffman.reader_t *acr[3] = {};
+	for (int c = 0; c < 3; c++) {
+		dcr[c] = huffman.newreader(self->htables[s->dctables[c]], br);
+		acr[c] = huffman.newreader(self->htables[s->actables[c]], br);
+	}
+
+	// First values ("DC") are diff-encoded across all blocks of an
+	// interval. These will contain the current values.
+	int dc[3] = {0,0,0};
+	bool ok = true;
+	for (int m = first; m < first + n; m++) {
+		if (!readunit(self, s, dc, br, dcr, acr, m)) {
+			ok = false;
+			break;
+		}
+	}
+
+	for (int c = 0; c < 3; c++) {
+		huffman.closereader(dcr[c]);
+		huffman.closereader(acr[c]);
+	}
+	bits.closereader(br);
+	reader.free(in);
+	return ok;
+}
+
+// Decodes MCU m: hsize x vsize blocks of every component, put into the
+// planes. Returns false if the data ended.
+bool readunit(jpeg_t *self, scan_t *s, int *dc, bits.reader_t *br, huffman.reader_t **dcr, **acr, int m) {
+	int mx = m % s->mcux;
+	int my = m / s->mcux;
+	for (int i = 0; i < 3; i++) {
+		int ci = s->comps[i];
+		component_t *c = &self->components[ci];
+		uint8_t *quant = self->quant[c->qtable_index];
+		int hsize = c->hsize;
+		int vsize = c->vsize;
+		for (int by = 0; by < vsize; by++) {
+			for (int bx = 0; bx < hsize; bx++) {
+				int vals[64] = {};
+				if (!readblock(br, dcr[i], acr[i], dc[i], vals)) {
+					return false;
+				}
+				dc[i] = vals[0];
+
+				// Undo quantization and zigzag.
+				int coefs[64] = {};
+				for (int k = 0; k < 64; k++) {
+					coefs[zigzag[k]] = vals[k] * quant[k];
+				}
+				int x = (mx * hsize + bx) * 8;
+				int y = (my * vsize + by) * 8;
+				idct(coefs, s->planes[ci] + y * s->pw[ci] + x, s->pw[ci]);
+			}
+		}
+	}
+	return true;
+}
 
-void undozz(int *vals) {
-	int tmp[64] = {};
-	for (int i = 0; i < 64; i++) {
-		tmp[zigzag[i]] = vals[i];
+// Upsamples the chroma planes and puts the RGB pixels into the image.
+void composergb(jpeg_t *self, scan_t *s) {
+	int w = self->img->width;
+	int h = self->img->height;
+	uint8_t *rows[3] = {};
+	for (int i = 0; i < 3; i++) {
+		rows[i] = calloc!(s->mcux * s->hmax * 8, 1);
+	}
+	for (int y = 0; y < h; y++) {
+		for (int i = 0; i < 3; i++) {
+			upsamplerow(s, i, y, rows[i]);
+		}
+		torgb(rows[0], rows[1], rows[2], image.row(self->img, y), w);
+	}
+	for (int i = 0; i < 3; i++) {
+		OS.free(rows[i]);
+	}
+}
+
+// Puts image row y of component i, scaled up to the full resolution,
+// into out. Halved resolutions are interpolated the way libjpeg does
+// ("fancy upsampling"): every output sample is 3/4 of the nearest input
+// sample and 1/4 of the next nearest one, in each direction.
+void upsamplerow(scan_t *s, int i, y, uint8_t *out) {
+	int fh = s->fh[i];
+	int fv = s->fv[i];
+	int pw = s->pw[i];
+	int cw = s->cw[i];
+	uint8_t *plane = s->planes[i];
+	if (fh == 1 && fv == 1) {
+		memcpy(out, plane + y * pw, cw);
+		return;
+	}
+	if (fh == 2 && fv == 1) {
+		uint8_t *in = plane + y * pw;
+		h2v1(in, cw, out);
+		return;
+	}
+	if (fv == 2 && (fh == 1 || fh == 2)) {
+		int r = y / 2;
+		// The nearest other row: above for even rows, below for odd
+		// ones, with the edge rows repeated.
+		int r2 = r + 1;
+		int bias = 2;
+		if (y % 2 == 0) {
+			r2 = r - 1;
+			bias = 1;
+		}
+		if (r2 < 0) r2 = 0;
+		if (r2 > s->ch[i] - 1) r2 = s->ch[i] - 1;
+		uint8_t *in0 = plane + r * pw;
+		uint8_t *in1 = plane + r2 * pw;
+		if (fh == 1) {
+			for (int x = 0; x < cw; x++) {
+				out[x] = (uint8_t) (((int) in0[x] * 3 + (int) in1[x] + bias) >> 2);
+			}
+		} else {
+			h2v2(in0, in1, cw, out);
+		}
+		return;
 	}
-	for (int i = 0; i < 64; i++) {
-		vals[i] = tmp[i];
+	// Other factors are just repeated.
+	uint8_t *in = plane + (y / fv) * pw;
+	int n = cw * fh;
+	for (int x = 0; x < n; x++) {
+		out[x] = in[x / fh];
 	}
 }
 
-void mmulk(double *m, double k) {
-	for (int i = 0; i < 64; i++) {
-		m[i] *= k;
+// Doubles the row of n samples horizontally.
+void h2v1(const uint8_t *in, int n, uint8_t *out) {
+	if (n == 1) {
+		out[0] = in[0];
+		out[1] = in[0];
+		return;
+	}
+	out[0] = in[0];
+	out[1] = (uint8_t) (((int) in[0] * 3 + (int) in[1] + 2) >> 2);
+	for (int x = 1; x < n - 1; x++) {
+		int v = (int) in[x] * 3;
+		out[2 * x] = (uint8_t) ((v + (int) in[x - 1] + 1) >> 2);
+		out[2 * x + 1] = (uint8_t) ((v + (int) in[x + 1] + 2) >> 2);
 	}
+	int last = n - 1;
+	out[2 * last] = (uint8_t) (((int) in[last] * 3 + (int) in[last - 1] + 1) >> 2);
+	out[2 * last + 1] = in[last];
 }
 
-void madd(double *s, double *m) {
-	for (int i = 0; i < 64; i++) {
-		s[i] += m[i];
+// Doubles the row of n samples horizontally, mixed with the nearest
+// row next to it.
+void h2v2(const uint8_t *in0, *in1, int n, uint8_t *out) {
+	int this = (int) in0[0] * 3 + (int) in1[0];
+	if (n == 1) {
+		out[0] = (uint8_t) ((this * 4 + 8) >> 4);
+		out[1] = (uint8_t) ((this * 4 + 7) >> 4);
+		return;
+	}
+	int next = (int) in0[1] * 3 + (int) in1[1];
+	out[0] = (uint8_t) ((this * 4 + 8) >> 4);
+	out[1] = (uint8_t) ((this * 3 + next + 7) >> 4);
+	int last = this;
+	this = next;
+	for (int x = 1; x < n - 1; x++) {
+		next = (int) in0[x + 1] * 3 + (int) in1[x + 1];
+		out[2 * x] = (uint8_t) ((this * 3 + last + 8) >> 4);
+		out[2 * x + 1] = (uint8_t) ((this * 3 + next + 7) >> 4);
+		last = this;
+		this = next;
 	}
+	out[2 * (n - 1)] = (uint8_t) ((this * 3 + last + 8) >> 4);
+	out[2 * (n - 1) + 1] = (uint8_t) ((this * 4 + 7) >> 4);
 }
 
+const uint8_t zigzag[] = {
+	0,   1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19,	26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63};
+
 // Puts the standard basis shape (u, v) into res.
 // u and v are indexes [0..63].
 // res is a 8x8 array.
@@ -506,34 +776,136 @@ pub void getshape(double *shape, int n, m) {
 	}
 }
 
-image.rgba_t toRGB(double Y, Cr, Cb) {
-	image.rgba_t c = {};
-	double R = Cr * (2 - 2 * 0.299) + Y;
-	double B = Cb * (2 -2 * 0.114) + Y;
-	double G = (Y - 0.114 * B - 0.299*R) / 0.587;
-	c.red = clamp(R+128);
-	c.green = clamp(G+128);
-	c.blue = clamp(B+128);
-	return c;
+#define CONST_BITS 13
+#define PASS1_BITS 2
+
+// Integer inverse DCT of the coefficients in natural order (islow from
+// the IJG library, which follows Loeffler, Ligtenberg and Moschytz).
+// The 2D transform is done as 1D transforms on the columns and then on
+// the rows, with the cosines as 13-bit fixed-point constants. The
+// columns keep PASS1_BITS of extra precision between the passes.
+// Puts the 8x8 samples, level-shifted to 0..255, into out with the
+// given stride.
+void idct(int *in, uint8_t *out, int stride) {
+	int ws[64] = {};
+	for (int c = 0; c < 8; c++) {
+		int *col = in + c;
+		// Columns with only the DC term are flat.
+		if ((col[8] | col[16] | col[24] | col[32] | col[40] | col[48] | col[56]) == 0) {
+			int v = col[0] * (1 << PASS1_BITS);
+			for (int k = 0; k < 8; k++) {
+				ws[8 * k + c] = v;
+			}
+			continue;
+		}
+		int32_t r[8] = {};
+		idct1(col[0], col[8], col[16], col[24], col[32], col[40], col[48], col[56], r);
+		for (int k = 0; k < 8; k++) {
+			ws[8 * k + c] = descale(r[k], CONST_BITS - PASS1_BITS);
+		}
+	}
+	for (int y = 0; y < 8; y++) {
+		int *row = ws + 8 * y;
+		uint8_t *o = out + y * stride;
+		if ((row[1] | row[2] | row[3] | row[4] | row[5] | row[6] | row[7]) == 0) {
+			uint8_t v = clamp8(descale(row[0], PASS1_BITS + 3) + 128);
+			for (int k = 0; k < 8; k++) {
+				o[k] = v;
+			}
+			continue;
+		}
+		int32_t r[8] = {};
+		idct1(row[0], row[1], row[2], row[3], row[4], row[5], row[6], row[7], r);
+		for (int k = 0; k < 8; k++) {
+			o[k] = clamp8(descale(r[k], CONST_BITS + PASS1_BITS + 3) + 128);
+		}
+	}
 }
 
-uint8_t clamp(double x) {
-	if (x > 255) return 255;
+// 1D inverse DCT of 8 values, scaled by 2^CONST_BITS.
+void idct1(int32_t d0, d1, d2, d3, d4, d5, d6, d7, int32_t *r) {
+	// Even part.
+	int32_t z1 = (d2 + d6) * 4433; // 0.541196100
+	int32_t tmp2 = z1 - d6 * 15137; // 1.847759065
+	int32_t tmp3 = z1 + d2 * 6270; // 0.765366865
+	int32_t tmp0 = (d0 + d4) * (1 << CONST_BITS);
+	int32_t tmp1 = (d0 - d4) * (1 << CONST_BITS);
+	int32_t tmp10 = tmp0 + tmp3;
+	int32_t tmp13 = tmp0 - tmp3;
+	int32_t tmp11 = tmp1 + tmp2;
+	int32_t tmp12 = tmp1 - tmp2;
+
+	// Odd part.
+	int32_t z13 = d7 + d1;
+	int32_t z24 = d5 + d3;
+	int32_t z37 = d7 + d3;
+	int32_t z45 = d5 + d1;
+	int32_t z5 = (z37 + z45) * 9633; // 1.175875602
+	int32_t t0 = d7 * 2446; // 0.298631336
+	int32_t t1 = d5 * 16819; // 2.053119869
+	int32_t t2 = d3 * 25172; // 3.072711026
+	int32_t t3 = d1 * 12299; // 1.501321110
+	z13 = z13 * -7373; // 0.899976223
+	z24 = z24 * -20995; // 2.562915447
+	z37 = z37 * -16069 + z5; // 1.961570560
+	z45 = z45 * -3196 + z5; // 0.390180644
+	t0 += z13 + z37;
+	t1 += z24 + z45;
+	t2 += z24 + z37;
+	t3 += z13 + z45;
+
+	r[0] = tmp10 + t3;
+	r[7] = tmp10 - t3;
+	r[1] = tmp11 + t2;
+	r[6] = tmp11 - t2;
+	r[2] = tmp12 + t1;
+	r[5] = tmp12 - t1;
+	r[3] = tmp13 + t0;
+	r[4] = tmp13 - t0;
+}
+
+// Divides x by 2^n, rounding.
+int32_t descale(int32_t x, int n) {
+	return (x + (1 << (n - 1))) >> n;
+}
+
+uint8_t clamp8(int x) {
 	if (x < 0) return 0;
+	if (x > 255) return 255;
 	return (uint8_t) x;
 }
 
-void readblock(bits.reader_t *br, huffman.reader_t *hrdc, *hrac, int prevdc, int *vals) {
+// Converts n pixels from the Y, Cb and Cr rows into RGBA8 at out.
+// The JFIF conversion factors are 16-bit fixed-point constants:
+// R = Y + 1.402 Cr, G = Y - 0.344136 Cb - 0.714136 Cr, B = Y + 1.772 Cb.
+void torgb(const uint8_t *Y, *Cb, *Cr, uint8_t *out, int n) {
+	for (int i = 0; i < n; i++) {
+		int y = Y[i];
+		int cb = Cb[i] - 128;
+		int cr = Cr[i] - 128;
+		out[4 * i + 0] = clamp8(y + ((91881 * cr + 32768) >> 16));
+		out[4 * i + 1] = clamp8(y + ((-22554 * cb - 46802 * cr + 32768) >> 16));
+		out[4 * i + 2] = clamp8(y + ((116130 * cb + 32768) >> 16));
+		out[4 * i + 3] = 0;
+	}
+}
+
+// Reads the coefficients of one block into vals.
+// Returns false if the data ended.
+bool readblock(bits.reader_t *br, huffman.reader_t *hrdc, *hrac, int prevdc, int *vals) {
 	// DC: huff(valsize),val from raw bits
 	int code = huffman.read(hrdc);
-	vals[0] = prevdc + weirdonum(br, code);
+	if (code == EOF) return false;
+	int diff = 0;
+	if (!weirdonum(br, code, &diff)) return false;
+	vals[0] = prevdc + diff;
 
 	// 63 ACs: val from rle+huff+bits spaghetti
 	int l = 1;
 	while (l<64) {
 		// huff(run,size)
 		code = huffman.read(hrac);
-		if (code == EOF) panic("eof");
+		if (code == EOF) return false;
 		int run = code / 16;
         int size = code & 0xf;
 
@@ -541,74 +913,87 @@ void readblock(bits.reader_t *br, huffman.reader_t *hrdc, *hrac, int prevdc, int
 		if (run == 0 && size == 0) {
 			break;
 		}
-		// 15,0 means 15 zeros.
+		// 15,0 means 16 zeros: the run and the zero value itself.
 		if (run == 15 && size == 0) {
-			l += 15;
+			l += 16;
 			continue;
 		}
 		l += run;
 		code = size;
 		if (l<64) {
-			int coeff = weirdonum(br, code);
-			vals[l] = coeff;
+			if (!weirdonum(br, code, &vals[l])) return false;
 			l+=1;
 		}
 	}
+	return true;
 }
 
-int weirdonum(bits.reader_t *br, int code) {
+// Reads a value of code bits into v.
+// Returns false if the data ended.
+bool weirdonum(bits.reader_t *br, int code, int *v) {
+	if (code == 0) {
+		*v = 0;
+		return true;
+	}
 	int bval = bits.readn(br, code);
+	if (bval < 0) return false;
 	int l = 1 << (code-1);
 	if (bval >= l) {
-		return bval;
+		*v = bval;
+		return true;
 	}
 	int z = 2*l-1;
-	return bval - z;
+	*v = bval - z;
+	return true;
 }
 
-typedef {
-    reader.t *in;
-    bool ended;
-} escaper_t;
-
-reader.t *escreader(reader.t *in) {
-	escaper_t *e = calloc!(1, sizeof(escaper_t));
-	e->in = in;
-	return reader.new(e, escreadn, OS.free);
-}
-
-int escreadn(void *ctx, uint8_t *buf, size_t n) {
-    escaper_t *r = ctx;
-    for (size_t i = 0; i < n; i++) {
-        int c = escread1(r);
-        if (c == -1) return -1;
-        buf[i] = (uint8_t) c;
-    }
-    return (int) n;
-}
-
-int escread1(escaper_t *r) {
-    if (r->ended) {
-		panic("reading from closed escaper");
-	}
-    uint8_t x;
-    if (reader.read(r->in, &x, 1) != 1) {
-		panic("read failed");
-	}
-    if (x == 0xff) {
-        if (reader.read(r->in, &x, 1) != 1) {
-			panic("read failed");
-		}
-        // 0xff 0x00 means just 0xff as data.
-        if (x == 0) {
-            return 0xff;
-        }
-        // 0xff 0xd9 means end of data.
-        if (x == 0xd9) {
-            r->ended = true;
-            return EOF;
-        }
-        panic("unexpected 0xff 0x%x", x);
-    }
-    return x;
+// Reads the entropy-coded data up to the end of image marker into
+// s->data, with the stuffed zero bytes removed, and cuts it at the
+// restart markers.
+void readsegments(scan_t *s, reader.t *r) {
+	size_t cap = 4096;
+	size_t len = 0;
+	s->data = calloc!(cap, 1);
+	size_t nsegs = 0;
+	size_t segcap = 16;
+	s->segments = calloc!(segcap, sizeof(size_t));
+	while (true) {
+		uint8_t x = 0;
+		if (reader.read(r, &x, 1) != 1) {
+			break;
+		}
+		if (x == 0xff) {
+			// Markers may be padded with any number of 0xff bytes.
+			while (x == 0xff) {
+				if (reader.read(r, &x, 1) != 1) {
+					panic("read failed");
+				}
+			}
+			// 0xff 0xd9 means end of data.
+			if (x == 0xd9) {
+				break;
+			}
+			// 0xff 0xd0..0xd7 starts the next restart interval.
+			if (x >= 0xd0 && x <= 0xd7) {
+				if (nsegs + 2 >= segcap) {
+					segcap *= 2;
+					s->segments = realloc(s->segments, segcap * sizeof(size_t));
+				}
+				s->segments[++nsegs] = len;
+				continue;
+			}
+			// 0xff 0x00 means just 0xff as data.
+			if (x != 0) {
+				panic("unexpected 0xff 0x%x", x);
+			}
+			x = 0xff;
+		}
+		if (len == cap) {
+			cap *= 2;
+			s->data = realloc(s->data, cap);
+		}
+		s->data[len++] = x;
+	}
+	s->segments[++nsegs] = len;
+	s->nsegments = (int) nsegs;
 }
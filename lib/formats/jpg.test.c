@@ -0,0 +1,128 @@
+#import formats/jpg
+#import image
+#import test
+
+// A 20x12 baseline image with 4:2:0 chroma and restart markers after
+// every second MCU.
+uint8_t REF[] = {
+	0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 0x4a, 0x46, 0x49, 0x46, 0x00, 0x01,
+	0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0xff, 0xdb, 0x00, 0x43,
+	0x00, 0x05, 0x03, 0x04, 0x04, 0x04, 0x03, 0x05, 0x04, 0x04, 0x04, 0x05,
+	0x05, 0x05, 0x06, 0x07, 0x0c, 0x08, 0x07, 0x07, 0x07, 0x07, 0x0f, 0x0b,
+	0x0b, 0x09, 0x0c, 0x11, 0x0f, 0x12, 0x12, 0x11, 0x0f, 0x11, 0x11, 0x13,
+	0x16, 0x1c, 0x17, 0x13, 0x14, 0x1a, 0x15, 0x11, 0x11, 0x18, 0x21, 0x18,
+	0x1a, 0x1d, 0x1d, 0x1f, 0x1f, 0x1f, 0x13, 0x17, 0x22, 0x24, 0x22, 0x1e,
+	0x24, 0x1c, 0x1e, 0x1f, 0x1e, 0xff, 0xdb, 0x00, 0x43, 0x01, 0x05, 0x05,
+	0x05, 0x07, 0x06, 0x07, 0x0e, 0x08, 0x08, 0x0e, 0x1e, 0x14, 0x11, 0x14,
+	0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+	0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+	0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+	0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e,
+	0x1e, 0x1e, 0xff, 0xc0, 0x00, 0x11, 0x08, 0x00, 0x0c, 0x00, 0x14, 0x03,
+	0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01, 0xff, 0xc4, 0x00,
+	0x1f, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+	0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0xff, 0xc4, 0x00, 0xb5, 0x10, 0x00,
+	0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00,
+	0x00, 0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21,
+	0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81,
+	0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24,
+	0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25,
+	0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a,
+	0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56,
+	0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86,
+	0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+	0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3,
+	0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6,
+	0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9,
+	0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1,
+	0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xff, 0xc4, 0x00,
+	0x1f, 0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+	0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0xff, 0xc4, 0x00, 0xb5, 0x11, 0x00,
+	0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00,
+	0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31,
+	0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08,
+	0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15,
+	0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18,
+	0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55,
+	0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84,
+	0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+	0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
+	0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4,
+	0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
+	0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xff, 0xdd, 0x00,
+	0x04, 0x00, 0x02, 0xff, 0xda, 0x00, 0x0c, 0x03, 0x01, 0x00, 0x02, 0x11,
+	0x03, 0x11, 0x00, 0x3f, 0x00, 0xa1, 0xa2, 0xf8, 0x4f, 0xfe, 0x25, 0xe3,
+	0xf7, 0x5d, 0xbd, 0x29, 0xbf, 0x17, 0x3e, 0x13, 0xc5, 0xe1, 0x99, 0x6c,
+	0x24, 0x8b, 0x50, 0xfb, 0x77, 0xdb, 0x0c, 0x99, 0x1f, 0x67, 0xf2, 0xf6,
+	0x6c, 0xdb, 0xfe, 0xd1, 0xce, 0x77, 0x7b, 0x74, 0xaf, 0x6b, 0xd1, 0xb4,
+	0xdb, 0x4f, 0xec, 0xf1, 0xfb, 0xbe, 0xd5, 0xca, 0xf8, 0x8b, 0x4d, 0xb4,
+	0xfb, 0x5f, 0xfa, 0xbe, 0xf5, 0xf3, 0xdc, 0x30, 0xb1, 0x13, 0xc7, 0x53,
+	0x9d, 0x3a, 0x9c, 0xb0, 0x8d, 0xf9, 0xa3, 0x64, 0xf9, 0xae, 0xb4, 0xd7,
+	0x78, 0xd9, 0xeb, 0xa6, 0xfb, 0x32, 0xf8, 0xcb, 0x8a, 0x6a, 0xac, 0xa6,
+	0x9d, 0xd3, 0xd9, 0x1e, 0x5b, 0xa3, 0xf8, 0x4f, 0xfd, 0x05, 0x3f, 0x75,
+	0xfa, 0x51, 0x5e, 0xd3, 0xa3, 0xe9, 0xb6, 0x9f, 0x61, 0x4f, 0xdd, 0xd1,
+	0x5f, 0xab, 0xba, 0xce, 0xe7, 0x89, 0x83, 0xe2, 0x8a, 0xde, 0xc2, 0x1e,
+	0x88, 0xff, 0xd9,
+};
+
+// Pixels of REF as decoded by libjpeg.
+typedef { int x, y; image.rgba_t c; } pixel_t;
+pixel_t pixels[] = {
+	{0, 0, {128, 42, 0, 0}},
+	{7, 0, {190, 45, 62, 0}},
+	{9, 5, {250, 249, 11, 0}},
+	{10, 5, {230, 255, 17, 0}},
+	{19, 5, {121, 117, 191, 0}},
+	{0, 11, {136, 202, 76, 0}},
+	{10, 11, {118, 199, 167, 0}},
+	{19, 11, {130, 202, 242, 0}},
+};
+
+int main() {
+	uint8_t buf[sizeof(REF)] = {};
+	memcpy(buf, REF, sizeof(REF));
+	jpg.err_t err = {};
+	jpg.jpeg_t *j = decode(buf, sizeof(buf), &err);
+	test.truth("no error", !err.set);
+	test.truth("width", j->img->width == 20);
+	test.truth("height", j->img->height == 12);
+	for (size_t i = 0; i < nelem(pixels); i++) {
+		pixel_t p = pixels[i];
+		image.rgba_t c = image.get(j->img, p.x, p.y);
+		bool ok = c.red == p.c.red && c.green == p.c.green && c.blue == p.c.blue;
+		if (!ok) {
+			printf("pixel %d,%d: got %d %d %d, want %d %d %d\n", p.x, p.y, c.red, c.green, c.blue, p.c.red, p.c.green, p.c.blue);
+		}
+		test.truth("pixel", ok);
+	}
+
+	// The scan header is at 615: the first component's id, then its tables.
+	buf[620] = 9;
+	test.truth("unknown component", decode(buf, sizeof(buf), &err) == NULL);
+	test.streq(err.msg, "scan component 9 is not in the frame");
+	buf[620] = 1;
+	buf[621] = 0x33;
+	test.truth("undefined table", decode(buf, sizeof(buf), &err) == NULL);
+	buf[621] = 0;
+
+	test.truth("truncated", decode(buf, 700, &err) == NULL);
+	test.streq(err.msg, "scan data ended early");
+	return test.fails();
+}
+
+jpg.jpeg_t *decode(uint8_t *data, size_t n, jpg.err_t *err) {
+	jpg.err_t clean = {};
+	*err = clean;
+	FILE *f = tmpfile();
+	fwrite(data, 1, n, f);
+	rewind(f);
+	jpg.jpeg_t *j = jpg.readfile(f, err);
+	fclose(f);
+	return j;
+}
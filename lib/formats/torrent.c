@@ -131,9 +131,7 @@ pub info_t *parse(const char *data, size_t size) {
 	bencode.freereader(r);
 
 	sha1.digest_t hash = {};
-	for (size_t i = info_begin; i < info_end; i++) {
-		sha1.add(&hash, data[i]);
-	}
+	sha1.update(&hash, (uint8_t *) data + info_begin, info_end - info_begin);
 	sha1.end(&hash);
 	sha1.format(&hash, tf->infohash, sizeof(tf->infohash));
 	sha1.as_bytes(&hash, (uint8_t*) tf->infohash_bytes);
@@ -2,10 +2,18 @@
 #import reader
 #import sound
 #import writer
-#import sound
+
+// Sample formats.
+pub enum {
+	PCM = 1, // 16 or 24-bit integers
+	FLOAT = 3 // 32-bit floats
+}
+
+// Frames converted at a time by the block functions.
+#define BLOCKFRAMES 1024
 
 pub typedef {
-    uint16_t format; // 1=PCM
+    uint16_t format; // PCM or FLOAT
     uint16_t channels; // 1 or 2
     uint32_t frequency; // 44100 (Hz)
     uint16_t bits_per_sample;
@@ -21,6 +29,7 @@ pub typedef {
 
 pub typedef {
 	writer.t *writer;
+	wav_t wav;
 } writer_t;
 
 // Loads wav file at given path and returns it as a clip.
@@ -30,22 +39,64 @@ pub sound.clip_t *loadfile(const char *path) {
 		return NULL;
 	}
 	sound.clip_t *c = sound.newclip(r->wav.frequency);
-	while (more(r)) {
-		sound.push_sample(c, read_samplef(r));
+	float left[BLOCKFRAMES] = {};
+	float right[BLOCKFRAMES] = {};
+	while (true) {
+		size_t n = read_block(r, left, right, BLOCKFRAMES);
+		if (n == 0) break;
+		for (size_t i = 0; i < n; i++) {
+			sound.samplef_t s = {left[i], right[i]};
+			sound.push_sample(c, s);
+		}
 	}
 	close_reader(r);
 	return c;
 }
 
-// Starts a wave stream writing to file f.
+// Starts a 16-bit stereo 44100 Hz wave stream writing to file f.
 pub writer_t *open_writer(FILE *f) {
+	wav_t fmt = {
+		.format = PCM,
+		.channels = 2,
+		.frequency = 44100,
+		.bits_per_sample = 16
+	};
+	return open_writer_format(f, fmt);
+}
+
+// Starts a wave stream with the given format writing to file f.
+pub writer_t *open_writer_format(FILE *f, wav_t fmt) {
+	checkformat(fmt);
 	writer.t *wr = writer.file(f);
 	writer_t *w = calloc!(1, sizeof(writer_t));
 	w->writer = wr;
+	w->wav = fmt;
 	write_headers(w);
 	return w;
 }
 
+// Panics if the format isn't one of those supported.
+void checkformat(wav_t w) {
+	if (w.channels != 2 && w.channels != 1) {
+		panic("expected 1 or 2 channels, got %u", w.channels);
+	}
+	switch (w.format) {
+		case PCM: {
+			if (w.bits_per_sample != 16 && w.bits_per_sample != 24) {
+				panic("expected 16 or 24 bits per sample, got %d", w.bits_per_sample);
+			}
+		}
+		case FLOAT: {
+			if (w.bits_per_sample != 32) {
+				panic("expected 32 bits per float sample, got %d", w.bits_per_sample);
+			}
+		}
+		default: {
+			panic("expected format 1 (PCM) or 3 (float), got %u", w.format);
+		}
+	}
+}
+
 pub void close_writer(writer_t *w) {
 	writer.free(w->writer);
 	OS.free(w);
@@ -56,21 +107,22 @@ pub reader_t *open_reader(const char *path) {
 	if (!f) {
 		return NULL;
 	}
-    reader.t *r = reader.file(f);
+	reader_t *wr = newreader(reader.file(f));
+	wr->file = f;
+	return wr;
+}
 
+// Starts reading a wave stream from r.
+// close_reader frees r too.
+pub reader_t *newreader(reader.t *r) {
 	reader_t *wr = calloc!(1, sizeof(reader_t));
 	wr->reader = r;
 
 	wav_t w = {};
     if (!read_headers(r, &w, &wr->datalen)) {
-		fclose(f);
-		reader.free(r);
-		OS.free(wr);
 		panic("failed to read headers");
 	}
 	wr->wav = w;
-	wr->file = f;
-
 	return wr;
 }
 
@@ -91,21 +143,14 @@ bool read_headers(reader.t *r, wav_t *wp, uint32_t *datalen) {
 	// wav fmt struct
 	//
 	if (!expect_tag(r, "fmt ")) return false;
-    endian.read4le(r, &tmp4u); // fmt chunk size, 16 bytes
-	if (tmp4u != 16) panic("expected 16 bytes fmt chunk, got %u", tmp4u);
+    endian.read4le(r, &tmp4u); // fmt chunk size, 16 bytes or more
+	if (tmp4u < 16) panic("expected 16 bytes fmt chunk, got %u", tmp4u);
 	uint8_t buf[16] = {};
 	reader.read(r, buf, 16);
+	// Float files may have an 18-byte chunk with an empty extension.
+	reader.skip(r, tmp4u - 16);
 	wav_t w = read_fmt(buf);
-
-    if (w.format != 1) {
-		panic("expected format 1 (PCM), got %u", w.format);
-	}
-    if (w.channels != 2 && w.channels != 1) {
-		panic("expected 1 or 2 channels, got %u", w.channels);
-	}
-	if (w.bits_per_sample != 16 && w.bits_per_sample != 24) {
-		panic("expected 16 or 24 bits per sample, got %d", w.bits_per_sample);
-	}
+	checkformat(w);
 	*wp = w;
 
 	//
@@ -163,13 +208,7 @@ void write_headers(writer_t *w) {
 	//
 	writetag(w->writer, "fmt ");
 	endian.write4le(w->writer, 16); // fmt chunk size, 16 bytes
-	wav_t fmt = {
-		.format = 1,
-		.channels = 2,
-		.frequency = 44100,
-		.bits_per_sample = 16
-	};
-	write_fmt(w->writer, fmt);
+	write_fmt(w->writer, w->wav);
 
 	//
 	// Start an infinite data chunk
@@ -210,73 +249,163 @@ pub bool more(reader_t *r) {
 	return r->done < r->datalen;
 }
 
-int read_sample0(reader_t *r) {
-	int bps = r->wav.bits_per_sample / 8;
-	switch (r->wav.bits_per_sample) {
-		// 8 bit - [0, 255], zero at 128
-		// 16-bit - [-32768, +32767], zero at 0
-		case 16: {
-			uint16_t u = 0;
-			endian.read2le(r->reader, &u);
-			r->done += bps;
-			int s = (int) u;
-			if (s >= 32768) s -= 65536;
-			return s;
+// Reads the next sample frame.
+pub sound.samplef_t read_samplef(reader_t *r) {
+	float left = 0;
+	float right = 0;
+	read_block(r, &left, &right, 1);
+	sound.samplef_t s = {left, right};
+	return s;
+}
+
+// Reads up to n frames, putting the channels into left and right.
+// A mono stream gets the same samples in both.
+// Returns the number of frames read, which is less than n only at the
+// end of the data.
+pub size_t read_block(reader_t *r, float *left, float *right, size_t n) {
+	size_t bps = r->wav.bits_per_sample / 8;
+	size_t framesize = bps * r->wav.channels;
+	uint8_t buf[BLOCKFRAMES * 8] = {};
+	size_t done = 0;
+	while (done < n && more(r)) {
+		size_t k = n - done;
+		if (k > BLOCKFRAMES) k = BLOCKFRAMES;
+		size_t left_in_data = (r->datalen - r->done) / framesize;
+		if (k > left_in_data) k = left_in_data;
+		if (k == 0) break;
+		// A short read may end in the middle of a frame, so read on until
+		// the frames are whole.
+		size_t want = k * framesize;
+		size_t got = 0;
+		while (got < want) {
+			int q = reader.read(r->reader, buf + got, want - got);
+			if (q <= 0) break;
+			got += (size_t) q;
 		}
-		// 24-bit - [−8,388,608, +8,388,607], zero at 0.
-		case 24: {
-			uint32_t u = 0;
-			endian.read3le(r->reader, &u);
-			r->done += bps;
-			int s = (int) u;
-			if (s >= 8388608) s -= 2 * 8388608;
-			return s;
+		r->done += (uint32_t) got;
+		if (got < want) {
+			// The data ends early, a partial frame at the end is dropped.
+			r->datalen = r->done;
 		}
-		default: {
-			panic("unimplemented sample size: %d", r->wav.bits_per_sample);
+		k = got / framesize;
+
+		// The right channel of a mono stream is the left one.
+		const uint8_t *lp = buf;
+		const uint8_t *rp = buf;
+		if (r->wav.channels == 2) {
+			rp = buf + bps;
 		}
+		decode(r->wav, lp, framesize, k, left + done);
+		decode(r->wav, rp, framesize, k, right + done);
+		done += k;
 	}
-	return 0;
+	return done;
 }
 
-// Reads the next sample frame.
-pub sound.samplef_t read_samplef(reader_t *r) {
-	sound.samplef_t s = {};
-	double scale = (1 << (r->wav.bits_per_sample-1)) - 1;
-
-	switch (r->wav.channels) {
-		case 1: {
-			s.left = (double) read_sample0(r) / scale;
-			s.right = s.left;
+// Converts n samples that are stride bytes apart at p to floats in dst.
+void decode(wav_t w, const uint8_t *p, size_t stride, size_t n, float *dst) {
+	if (w.format == FLOAT) {
+		for (size_t i = 0; i < n; i++) {
+			const uint8_t *q = p + i * stride;
+			uint32_t u = (uint32_t) q[0] | (uint32_t) q[1] << 8 | (uint32_t) q[2] << 16 | (uint32_t) q[3] << 24;
+			memcpy(&dst[i], &u, 4);
 		}
-		case 2: {
-			s.left = (double) read_sample0(r) / scale;
-			s.right = (double) read_sample0(r) / scale;
+		return;
+	}
+	switch (w.bits_per_sample) {
+		// 16-bit - [-32768, +32767], zero at 0
+		case 16: {
+			float scale = 1.0 / 32767;
+			for (size_t i = 0; i < n; i++) {
+				const uint8_t *q = p + i * stride;
+				int16_t s = (int16_t) ((uint16_t) q[0] | (uint16_t) q[1] << 8);
+				dst[i] = (float) s * scale;
+			}
 		}
-		default: {
-			panic("unimplemented channels number: %d", r->wav.channels);
+		// 24-bit - [−8,388,608, +8,388,607], zero at 0.
+		// The sample is put into the top of an int32 and shifted back
+		// down to extend the sign.
+		case 24: {
+			float scale = 1.0 / 8388607;
+			for (size_t i = 0; i < n; i++) {
+				const uint8_t *q = p + i * stride;
+				uint32_t u = (uint32_t) q[0] << 8 | (uint32_t) q[1] << 16 | (uint32_t) q[2] << 24;
+				int32_t s = (int32_t) u / 256;
+				dst[i] = (float) s * scale;
+			}
 		}
 	}
-	return s;
 }
 
 // Writes the next sample frame.
 pub void write_sample(writer_t *w, double left, right) {
-	// Assuming 16-bit stereo.
-	double scale = (1 << 15) - 1;
+	float l = (float) left;
+	float r = (float) right;
+	write_block(w, &l, &r, 1);
+}
 
-	int s = (int) (left * scale);
-	if (s < 0) s += 65536;
-	endian.write2le(w->writer, (uint16_t) s);
+// Writes n frames with the channels from left and right.
+// A mono stream gets the average of the two.
+// Integer samples outside [-1, 1] are clipped, floats are kept as they are.
+pub void write_block(writer_t *w, const float *left, const float *right, size_t n) {
+	size_t bps = w->wav.bits_per_sample / 8;
+	size_t framesize = bps * w->wav.channels;
+	uint8_t buf[BLOCKFRAMES * 8] = {};
+	float mono[BLOCKFRAMES] = {};
+	while (n > 0) {
+		size_t k = n;
+		if (k > BLOCKFRAMES) k = BLOCKFRAMES;
+		if (w->wav.channels == 1) {
+			for (size_t i = 0; i < k; i++) {
+				mono[i] = (left[i] + right[i]) / 2;
+			}
+			encode(w->wav, mono, k, buf, framesize);
+		} else {
+			encode(w->wav, left, k, buf, framesize);
+			encode(w->wav, right, k, buf + bps, framesize);
+		}
+		writer.write(w->writer, buf, k * framesize);
+		left += k;
+		right += k;
+		n -= k;
+	}
+}
 
-	s = (int) (right * scale);
-	if (s < 0) s += 65536;
-	endian.write2le(w->writer, (uint16_t) s);
+// Converts n floats from src to samples that are stride bytes apart at p.
+void encode(wav_t w, const float *src, size_t n, uint8_t *p, size_t stride) {
+	if (w.format == FLOAT) {
+		for (size_t i = 0; i < n; i++) {
+			uint8_t *q = p + i * stride;
+			uint32_t u = 0;
+			memcpy(&u, &src[i], 4);
+			for (int j = 0; j < 4; j++) {
+				q[j] = (uint8_t) (u >> (8 * j));
+			}
+		}
+		return;
+	}
+	double max = 32767;
+	if (w.bits_per_sample == 24) {
+		max = 8388607;
+	}
+	for (size_t i = 0; i < n; i++) {
+		uint8_t *q = p + i * stride;
+		double v = src[i];
+		if (v > 1) v = 1;
+		if (v < -1) v = -1;
+		// The two's complement bytes, low first.
+		uint32_t u = (uint32_t) (int32_t) (v * max);
+		q[0] = (uint8_t) u;
+		q[1] = (uint8_t) (u >> 8);
+		if (w.bits_per_sample == 24) {
+			q[2] = (uint8_t) (u >> 16);
+		}
+	}
 }
 
 pub void close_reader(reader_t *r) {
     reader.free(r->reader);
-    fclose(r->file);
+    if (r->file) fclose(r->file);
 	OS.free(r);
 }
 
@@ -0,0 +1,93 @@
+#import formats/wav
+#import reader
+#import test
+
+// More than a block, so that the conversions cross block boundaries.
+#define N 3000
+
+int main() {
+	float left[N] = {};
+	float right[N] = {};
+	for (int i = 0; i < N; i++) {
+		left[i] = (float) (i % 200) / 100 - 1;
+		right[i] = (float) (i % 77) / -77;
+	}
+	// Out of range samples are clipped, except as floats.
+	left[10] = 2;
+	right[10] = -3;
+
+	wav.wav_t pcm16 = {.format = wav.PCM, .channels = 2, .frequency = 44100, .bits_per_sample = 16};
+	wav.wav_t pcm24 = {.format = wav.PCM, .channels = 2, .frequency = 48000, .bits_per_sample = 24};
+	wav.wav_t floats = {.format = wav.FLOAT, .channels = 2, .frequency = 44100, .bits_per_sample = 32};
+	wav.wav_t mono = {.format = wav.PCM, .channels = 1, .frequency = 22050, .bits_per_sample = 16};
+	roundtrip("pcm16", pcm16, left, right, 1.0 / 32767);
+	roundtrip("pcm24", pcm24, left, right, 1.0 / 8388607);
+	roundtrip("float", floats, left, right, 0);
+	roundtrip("mono", mono, left, right, 1.0 / 32767);
+	return test.fails();
+}
+
+// Writes the samples in format fmt and reads them back, checking that
+// they come back within tol.
+void roundtrip(const char *name, wav.wav_t fmt, float *left, *right, double tol) {
+	FILE *f = tmpfile();
+	wav.writer_t *w = wav.open_writer_format(f, fmt);
+	wav.write_block(w, left, right, N);
+	wav.close_writer(w);
+	rewind(f);
+
+	// The reader gets its data in pieces that end mid-frame.
+	wav.reader_t *r = wav.newreader(reader.new(f, shortread, NULL));
+	test.truth(name, r->wav.bits_per_sample == fmt.bits_per_sample);
+	test.truth(name, r->wav.channels == fmt.channels);
+	test.truth(name, r->wav.frequency == fmt.frequency);
+
+	float l2[N] = {};
+	float r2[N] = {};
+	size_t n = 0;
+	while (n < N) {
+		size_t k = wav.read_block(r, l2 + n, r2 + n, 700);
+		if (k == 0) break;
+		n += k;
+	}
+	test.truth(name, n == N);
+	test.truth(name, wav.read_block(r, l2, r2, 1) == 0);
+	wav.close_reader(r);
+	fclose(f);
+
+	int bad = 0;
+	for (size_t i = 0; i < n; i++) {
+		double wl = left[i];
+		double wr = right[i];
+		if (fmt.format == wav.PCM) {
+			wl = clip(wl);
+			wr = clip(wr);
+		}
+		if (fmt.channels == 1) {
+			wl = (left[i] + right[i]) / 2;
+			wr = wl;
+		}
+		if (fabs(l2[i] - wl) > tol || fabs(r2[i] - wr) > tol) {
+			bad++;
+		}
+	}
+	if (bad > 0) {
+		printf("%s: %d bad frames\n", name, bad);
+	}
+	test.truth(name, bad == 0);
+}
+
+double clip(double v) {
+	if (v > 1) return 1;
+	if (v < -1) return -1;
+	return v;
+}
+
+// Reads from the file in f, but returns three bytes less than asked
+// for on long reads. The headers are read in short pieces.
+int shortread(void *f, uint8_t *buf, size_t n) {
+	if (n > 100) n -= 3;
+	size_t r = fread(buf, 1, n, f);
+	if (r == 0) return EOF;
+	return (int) r;
+}
@@ -0,0 +1,137 @@
+// HDR histogram: counts non-negative integer values (typically latencies
+// in microseconds) in log-linear buckets with a bounded relative error.
+// Values below 2^PRECISION are counted exactly; above that every power
+// of two range is split into 2^(PRECISION-1) equal buckets, so the error
+// is below 1/2^(PRECISION-1) while the whole int64 range fits into
+// a few thousand counters. Recording is O(1) and never allocates,
+// which makes it usable in hot loops, and histograms can be merged, so
+// each thread can keep its own and combine them at the end.
+
+#define PRECISION 8
+
+pub typedef {
+	uint64_t *counts;
+	size_t nbuckets;
+	uint64_t total;
+	int64_t min, max;
+	double sum;
+} t;
+
+pub t *new() {
+	t *h = calloc!(1, sizeof(t));
+	// The largest index is the one for the largest int64 value.
+	h->nbuckets = index_of(OS.INT64_MAX) + 1;
+	h->counts = calloc!(h->nbuckets, sizeof(uint64_t));
+	return h;
+}
+
+pub void free(t *h) {
+	OS.free(h->counts);
+	OS.free(h);
+}
+
+// Adds value v to the histogram. Negative values are counted as zeros.
+pub void record(t *h, int64_t v) {
+	if (v < 0) {
+		v = 0;
+	}
+	h->counts[index_of(v)]++;
+	if (h->total == 0 || v < h->min) h->min = v;
+	if (h->total == 0 || v > h->max) h->max = v;
+	h->total++;
+	h->sum += (double) v;
+}
+
+// Adds all values from src to dest.
+pub void merge(t *dest, t *src) {
+	if (src->total == 0) {
+		return;
+	}
+	for (size_t i = 0; i < dest->nbuckets; i++) {
+		dest->counts[i] += src->counts[i];
+	}
+	if (dest->total == 0 || src->min < dest->min) dest->min = src->min;
+	if (dest->total == 0 || src->max > dest->max) dest->max = src->max;
+	dest->total += src->total;
+	dest->sum += src->sum;
+}
+
+// Returns the number of recorded values.
+pub uint64_t count(t *h) {
+	return h->total;
+}
+
+pub int64_t min(t *h) {
+	return h->min;
+}
+
+pub int64_t max(t *h) {
+	return h->max;
+}
+
+pub double mean(t *h) {
+	if (h->total == 0) {
+		return 0;
+	}
+	return h->sum / (double) h->total;
+}
+
+// Returns the value below which p percent of the recorded values fall.
+// The value is the upper bound of the bucket where the percentile lands,
+// so it's never less than the exact percentile.
+pub int64_t percentile(t *h, double p) {
+	if (h->total == 0) {
+		return 0;
+	}
+	if (p < 0) p = 0;
+	if (p > 100) p = 100;
+	uint64_t rank = (uint64_t) ceil(p / 100 * (double) h->total);
+	if (rank == 0) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < h->nbuckets; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			int64_t v = highest_of(i);
+			if (v > h->max) v = h->max;
+			if (v < h->min) v = h->min;
+			return v;
+		}
+	}
+	return h->max;
+}
+
+// Returns the bucket index for value v.
+size_t index_of(int64_t v) {
+	uint64_t x = (uint64_t) v;
+	uint64_t top = 1ULL << PRECISION;
+	if (x < top) {
+		return (size_t) x;
+	}
+	// Shift until the value has PRECISION significant bits left.
+	// The top bit is always set then, so the mantissa is in
+	// [2^(PRECISION-1), 2^PRECISION).
+	size_t shift = 0;
+	while ((x >> shift) >= top) {
+		shift++;
+	}
+	size_t half = (size_t) 1 << (PRECISION - 1);
+	return shift * half + (size_t) (x >> shift);
+}
+
+// Returns the largest value that falls into bucket i.
+int64_t highest_of(size_t i) {
+	size_t top = (size_t) 1 << PRECISION;
+	if (i < top) {
+		return (int64_t) i;
+	}
+	size_t half = top / 2;
+	size_t shift = i / half - 1;
+	uint64_t mantissa = i - shift * half;
+	uint64_t v = ((mantissa + 1) << shift) - 1;
+	if (v > (uint64_t) OS.INT64_MAX) {
+		return OS.INT64_MAX;
+	}
+	return (int64_t) v;
+}
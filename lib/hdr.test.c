@@ -0,0 +1,44 @@
+#import hdr
+#import test
+
+int main() {
+	hdr.t *h = hdr.new();
+	for (int64_t i = 1; i <= 100000; i++) {
+		hdr.record(h, i);
+	}
+	test.truth("count", hdr.count(h) == 100000);
+	test.truth("min", hdr.min(h) == 1);
+	test.truth("max", hdr.max(h) == 100000);
+	test.truth("p100 == max", hdr.percentile(h, 100) == 100000);
+	test.truth("p0 == min", hdr.percentile(h, 0) == 1);
+	checkclose(hdr.percentile(h, 50), 50000);
+	checkclose(hdr.percentile(h, 99), 99000);
+	checkclose(hdr.percentile(h, 99.9), 99900);
+
+	// Small values are exact.
+	hdr.t *h2 = hdr.new();
+	for (int i = 0; i < 10; i++) {
+		hdr.record(h2, 7);
+	}
+	hdr.record(h2, 200);
+	test.truth("p50 == 7", hdr.percentile(h2, 50) == 7);
+	test.truth("p99 == 200", hdr.percentile(h2, 99) == 200);
+
+	// Merged histogram has the values of both.
+	hdr.merge(h, h2);
+	test.truth("merged count", hdr.count(h) == 100011);
+	test.truth("merged min", hdr.min(h) == 1);
+
+	hdr.free(h);
+	hdr.free(h2);
+	return test.fails();
+}
+
+void checkclose(int64_t got, want) {
+	// The histogram guarantees under 1% error.
+	double err = (double) (got - want) / (double) want;
+	if (err < 0 || err > 0.01) {
+		printf("FAIL: got %ld, want %ld\n", got, want);
+		test.truth("percentile", false);
+	}
+}
@@ -2,20 +2,46 @@ pub typedef { int w, h; } dim_t;
 
 pub typedef { int red, green, blue, transparency; } rgba_t;
 
+// Pixel formats.
+// The packed formats store the pixels row by row, every pixel in
+// consecutive bytes. FLOAT32 stores four planes of floats from 0 to 1:
+// red, green, blue and transparency, each plane row by row.
+pub enum {
+	RGBA8, // red, green, blue, transparency; 4 bytes per pixel
+	RGB8, // red, green, blue; 3 bytes per pixel
+	GRAY8, // 1 byte per pixel
+	FLOAT32 // planar floats
+}
+
+// Bytes per pixel (or per sample in one plane) for every format.
+const int pixelsizes[] = {4, 3, 1, 4};
+
 pub typedef {
 	int width;
 	int height;
-	rgba_t *data;
+	int format;
+	size_t stride; // bytes from a row to the next
+	uint8_t *data;
 } image_t;
 
 pub typedef void pixelfunc_t(rgba_t *);
 
-// Creates a new image with the given dimensions.
+// Creates a new RGBA8 image with the given dimensions.
 pub image_t *new(int width, height) {
+	return newformat(width, height, RGBA8);
+}
+
+// Creates a new image with the given dimensions and pixel format.
+pub image_t *newformat(int width, height, format) {
+	if (format < RGBA8 || format > FLOAT32) {
+		panic("unknown pixel format: %d", format);
+	}
 	image_t *img = calloc!(1, sizeof(image_t));
 	img->width = width;
 	img->height = height;
-	img->data = calloc!(width * height, sizeof(rgba_t));
+	img->format = format;
+	img->stride = (size_t) width * (size_t) pixelsizes[format];
+	img->data = calloc!(datasize(img), 1);
 	return img;
 }
 
@@ -25,20 +51,37 @@ pub void free(image_t *img) {
 	OS.free(img);
 }
 
-pub rgba_t *getpixel(image_t *img, int x, y) {
-	return &img->data[y * img->width + x];
+// Returns a pointer to the first pixel of row y in a packed image.
+// The row has width pixels in the image's format.
+pub uint8_t *row(image_t *img, int y) {
+	if (img->format == FLOAT32) {
+		panic("row on a planar image, use planerow");
+	}
+	return img->data + (size_t) y * img->stride;
+}
+
+// Returns a pointer to the first sample of row y in the given plane
+// of a FLOAT32 image. Planes 0 to 3 are red, green, blue and
+// transparency.
+pub float *planerow(image_t *img, int plane, y) {
+	if (img->format != FLOAT32) {
+		panic("planerow on a packed image, use row");
+	}
+	size_t planesize = img->stride * (size_t) img->height;
+	return (float *) (img->data + (size_t) plane * planesize + (size_t) y * img->stride);
 }
 
 // Sets the pixel at (x, y) to the given color.
+// Components outside 0..255 wrap around, only the low 8 bits are kept.
 pub void set(image_t *img, int x, y, rgba_t c) {
 	checkcoords(img, x, y);
-	*getpixel(img, x, y) = c;
+	store(img, x, y, c);
 }
 
 // Returns the color at the given pixel.
 pub rgba_t get(image_t *img, int x, y) {
 	checkcoords(img, x, y);
-	return *getpixel(img, x, y);
+	return load(img, x, y);
 }
 
 void checkcoords(image_t *img, int x, y) {
@@ -50,17 +93,238 @@ void checkcoords(image_t *img, int x, y) {
 	}
 }
 
+rgba_t load(image_t *img, int x, y) {
+	rgba_t c = {};
+	switch (img->format) {
+		case RGBA8: {
+			uint8_t *p = row(img, y) + 4 * x;
+			c.red = p[0];
+			c.green = p[1];
+			c.blue = p[2];
+			c.transparency = p[3];
+		}
+		case RGB8: {
+			uint8_t *p = row(img, y) + 3 * x;
+			c.red = p[0];
+			c.green = p[1];
+			c.blue = p[2];
+		}
+		case GRAY8: {
+			int v = row(img, y)[x];
+			c.red = v;
+			c.green = v;
+			c.blue = v;
+		}
+		case FLOAT32: {
+			c.red = fromfloat(planerow(img, 0, y)[x]);
+			c.green = fromfloat(planerow(img, 1, y)[x]);
+			c.blue = fromfloat(planerow(img, 2, y)[x]);
+			c.transparency = fromfloat(planerow(img, 3, y)[x]);
+		}
+	}
+	return c;
+}
+
+void store(image_t *img, int x, y, rgba_t c) {
+	switch (img->format) {
+		case RGBA8: {
+			uint8_t *p = row(img, y) + 4 * x;
+			p[0] = low8(c.red);
+			p[1] = low8(c.green);
+			p[2] = low8(c.blue);
+			p[3] = low8(c.transparency);
+		}
+		case RGB8: {
+			uint8_t *p = row(img, y) + 3 * x;
+			p[0] = low8(c.red);
+			p[1] = low8(c.green);
+			p[2] = low8(c.blue);
+		}
+		case GRAY8: {
+			row(img, y)[x] = luma(low8(c.red), low8(c.green), low8(c.blue));
+		}
+		case FLOAT32: {
+			planerow(img, 0, y)[x] = (float) low8(c.red) / 255;
+			planerow(img, 1, y)[x] = (float) low8(c.green) / 255;
+			planerow(img, 2, y)[x] = (float) low8(c.blue) / 255;
+			planerow(img, 3, y)[x] = (float) low8(c.transparency) / 255;
+		}
+	}
+}
+
+uint8_t low8(int v) {
+	return (uint8_t) (v & 255);
+}
+
+uint8_t clamp(int v) {
+	if (v < 0) return 0;
+	if (v > 255) return 255;
+	return (uint8_t) v;
+}
+
+int fromfloat(float v) {
+	return clamp((int) (v * 255 + 0.5f));
+}
+
+// Returns the gray level of the given color (ITU-R BT.601 weights).
+uint8_t luma(int r, g, b) {
+	return (uint8_t) ((r * 2989 + g * 5870 + b * 1140) / 10000);
+}
+
+// Converts row y of img into n = width pixels of the packed format
+// at dst. This is the fast way for encoders to get pixels in the
+// layout they need.
+pub void readrow(image_t *img, int y, int format, uint8_t *dst) {
+	int n = img->width;
+	if (format == FLOAT32) {
+		panic("readrow into a planar format");
+	}
+	if (img->format == format) {
+		memcpy(dst, row(img, y), (size_t) n * (size_t) pixelsizes[format]);
+		return;
+	}
+	if (img->format == FLOAT32) {
+		float *r = planerow(img, 0, y);
+		float *g = planerow(img, 1, y);
+		float *b = planerow(img, 2, y);
+		float *a = planerow(img, 3, y);
+		for (int x = 0; x < n; x++) {
+			rgba_t c = {fromfloat(r[x]), fromfloat(g[x]), fromfloat(b[x]), fromfloat(a[x])};
+			putpacked(dst, format, x, c);
+		}
+		return;
+	}
+	const uint8_t *src = row(img, y);
+	switch (img->format) {
+		case RGBA8: {
+			switch (format) {
+				case RGB8: {
+					for (int x = 0; x < n; x++) {
+						dst[3 * x + 0] = src[4 * x + 0];
+						dst[3 * x + 1] = src[4 * x + 1];
+						dst[3 * x + 2] = src[4 * x + 2];
+					}
+				}
+				case GRAY8: {
+					for (int x = 0; x < n; x++) {
+						dst[x] = luma(src[4 * x], src[4 * x + 1], src[4 * x + 2]);
+					}
+				}
+			}
+		}
+		case RGB8: {
+			switch (format) {
+				case RGBA8: {
+					for (int x = 0; x < n; x++) {
+						dst[4 * x + 0] = src[3 * x + 0];
+						dst[4 * x + 1] = src[3 * x + 1];
+						dst[4 * x + 2] = src[3 * x + 2];
+						dst[4 * x + 3] = 0;
+					}
+				}
+				case GRAY8: {
+					for (int x = 0; x < n; x++) {
+						dst[x] = luma(src[3 * x], src[3 * x + 1], src[3 * x + 2]);
+					}
+				}
+			}
+		}
+		case GRAY8: {
+			int size = pixelsizes[format];
+			for (int x = 0; x < n; x++) {
+				for (int i = 0; i < 3; i++) {
+					dst[size * x + i] = src[x];
+				}
+				if (format == RGBA8) {
+					dst[4 * x + 3] = 0;
+				}
+			}
+		}
+	}
+}
+
+void putpacked(uint8_t *dst, int format, int x, rgba_t c) {
+	switch (format) {
+		case RGBA8: {
+			dst[4 * x + 0] = (uint8_t) c.red;
+			dst[4 * x + 1] = (uint8_t) c.green;
+			dst[4 * x + 2] = (uint8_t) c.blue;
+			dst[4 * x + 3] = (uint8_t) c.transparency;
+		}
+		case RGB8: {
+			dst[3 * x + 0] = (uint8_t) c.red;
+			dst[3 * x + 1] = (uint8_t) c.green;
+			dst[3 * x + 2] = (uint8_t) c.blue;
+		}
+		case GRAY8: {
+			dst[x] = luma(c.red, c.green, c.blue);
+		}
+	}
+}
+
+// Returns a copy of img in the given pixel format.
+pub image_t *convert(image_t *img, int format) {
+	image_t *r = newformat(img->width, img->height, format);
+	if (format != FLOAT32) {
+		for (int y = 0; y < img->height; y++) {
+			readrow(img, y, format, row(r, y));
+		}
+		return r;
+	}
+	uint8_t *buf = calloc!((size_t) img->width, 4);
+	for (int y = 0; y < img->height; y++) {
+		readrow(img, y, RGBA8, buf);
+		for (int i = 0; i < 4; i++) {
+			float *p = planerow(r, i, y);
+			for (int x = 0; x < img->width; x++) {
+				p[x] = (float) buf[4 * x + i] / 255;
+			}
+		}
+	}
+	OS.free(buf);
+	return r;
+}
+
 // Clears the entire image to all black.
 pub void clear(image_t *img) {
-	memset(img->data, 0, img->width * img->height * sizeof(rgba_t));
+	memset(img->data, 0, datasize(img));
+}
+
+// Copies the pixels of src into dst.
+// The images must have the same size and format.
+pub void copy(image_t *dst, *src) {
+	if (dst->width != src->width || dst->height != src->height || dst->format != src->format) {
+		panic("copying between different images");
+	}
+	memcpy(dst->data, src->data, datasize(src));
+}
+
+size_t datasize(image_t *img) {
+	size_t nplanes = 1;
+	if (img->format == FLOAT32) {
+		nplanes = 4;
+	}
+	return nplanes * img->stride * (size_t) img->height;
 }
 
 // Fills the whole image with the given color.
 pub void fill(image_t *img, rgba_t color) {
+	if (img->height == 0) {
+		return;
+	}
 	for (int x = 0; x < img->width; x++) {
-		for (int y = 0; y < img->height; y++) {
-			*getpixel(img, x, y) = color;
+		store(img, x, 0, color);
+	}
+	if (img->format == FLOAT32) {
+		for (int i = 0; i < 4; i++) {
+			for (int y = 1; y < img->height; y++) {
+				memcpy(planerow(img, i, y), planerow(img, i, 0), img->stride);
+			}
 		}
+		return;
+	}
+	for (int y = 1; y < img->height; y++) {
+		memcpy(row(img, y), row(img, 0), img->stride);
 	}
 }
 
@@ -74,7 +338,7 @@ pub void blend(image_t *img, int x, y, rgba_t color, float opacity) {
 }
 
 int blendcolor(int old, new, float opacity) {
-	float oldpart = (opacity-1) * (float) old;
+	float oldpart = (1-opacity) * (float) old;
 	float newpart = opacity * (float) new;
 	return oldpart + newpart;
 }
@@ -235,7 +499,7 @@ pub image_t *colormap_image(colormap_t *cm) {
 	for (int x = 0; x < img->width; x++) {
 		rgba_t c = mapcolor(cm, x);
 		for (int y = 0; y < img->height; y++) {
-			*getpixel(img, x, y) = c;
+			store(img, x, y, c);
 		}
 	}
 	return img;
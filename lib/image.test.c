@@ -0,0 +1,51 @@
+#import image
+#import test
+
+int main() {
+	image.rgba_t c = {10, 20, 30, 40};
+
+	// Every format keeps what it can of a color.
+	int formats[] = {image.RGBA8, image.RGB8, image.GRAY8, image.FLOAT32};
+	for (size_t i = 0; i < nelem(formats); i++) {
+		image.image_t *img = image.newformat(3, 2, formats[i]);
+		image.set(img, 2, 1, c);
+		image.rgba_t r = image.get(img, 2, 1);
+		image.rgba_t zero = image.get(img, 0, 0);
+		test.truth("untouched pixel", zero.red == 0 && zero.transparency == 0);
+		switch (formats[i]) {
+			case image.RGBA8, image.FLOAT32: {
+				test.truth("rgba", r.red == 10 && r.green == 20 && r.blue == 30 && r.transparency == 40);
+			}
+			case image.RGB8: {
+				test.truth("rgb", r.red == 10 && r.green == 20 && r.blue == 30 && r.transparency == 0);
+			}
+			case image.GRAY8: {
+				test.truth("gray", r.red == 18 && r.green == 18 && r.blue == 18);
+			}
+		}
+		image.free(img);
+	}
+
+	// Rows are packed.
+	image.image_t *img = image.new(4, 3);
+	image.fill(img, c);
+	uint8_t *row = image.row(img, 2);
+	test.truth("row", row[12] == 10 && row[13] == 20 && row[14] == 30 && row[15] == 40);
+
+	// Conversions go through any format and back.
+	image.set(img, 1, 1, image.white());
+	image.image_t *f = image.convert(img, image.FLOAT32);
+	test.truth("float plane", image.planerow(f, 0, 1)[1] == 1.0f);
+	image.image_t *rgb = image.convert(f, image.RGB8);
+	uint8_t line[12] = {};
+	image.readrow(rgb, 1, image.RGB8, line);
+	test.truth("readrow", line[0] == 10 && line[3] == 255 && line[6] == 10);
+	image.image_t *back = image.convert(rgb, image.RGBA8);
+	image.rgba_t w = image.get(back, 1, 1);
+	test.truth("back", w.red == 255 && w.green == 255 && w.blue == 255);
+	image.free(back);
+	image.free(rgb);
+	image.free(f);
+	image.free(img);
+	return test.fails();
+}
@@ -1,8 +1,15 @@
+#import reader
+
 pub typedef {
 	FILE *f;
 	char *buf;
 	size_t bufsize;
 	bool ended;
+
+	// Input when reading from a reader instead of a file.
+	reader.t *in;
+	uint8_t inbuf[4096];
+	size_t inpos, inlen;
 } t;
 
 // Allocates and returns a new instance reading from f.
@@ -14,6 +21,29 @@ pub t *new(FILE *f) {
 	return r;
 }
 
+// Allocates and returns a new instance reading from in.
+pub t *newreader(reader.t *in) {
+	t *r = new(NULL);
+	r->in = in;
+	return r;
+}
+
+// Returns the next input byte or EOF.
+int nextc(t *b) {
+	if (!b->in) {
+		return fgetc(b->f);
+	}
+	if (b->inpos == b->inlen) {
+		int n = reader.read(b->in, b->inbuf, sizeof(b->inbuf));
+		if (n <= 0) {
+			return EOF;
+		}
+		b->inpos = 0;
+		b->inlen = (size_t) n;
+	}
+	return b->inbuf[b->inpos++];
+}
+
 // Reads the next line into b.
 // Returns false if there is nothing more to read.
 pub bool read(t *b) {
@@ -22,7 +52,7 @@ pub bool read(t *b) {
 	}
 	size_t len = 0;
 	while (true) {
-		char c = fgetc(b->f);
+		char c = nextc(b);
 		if (c == EOF) {
 			b->ended = true;
 			break;
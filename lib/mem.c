@@ -88,10 +88,8 @@ pub size_t memwrite(mem_t *m, const char *buf, size_t size)
 		return 0;
 	}
 
-	for(size_t i = 0; i < size; i++) {
-		m->data[m->pos] = buf[i];
-		m->pos++;
-	}
+	memcpy(m->data + m->pos, buf, size);
+	m->pos += size;
 
 	/*
 	 * Advance datalen if we have written past it.
@@ -2,9 +2,13 @@
 
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -12,6 +16,15 @@ const char *error = "no error";
 pub typedef struct sockaddr sockaddr_t;
 typedef struct sockaddr_in sockaddr_in_t;
 typedef struct addrinfo addrinfo_t;
+typedef struct pollfd pollfd_t;
+typedef struct msghdr msghdr_t;
+typedef struct iovec iovec_t;
+
+// A buffer for gathered writes.
+pub typedef {
+	void *base;
+	size_t len;
+} iov_t;
 
 #type socklen_t
 
@@ -86,6 +99,138 @@ pub int write(net_t *c, const char *buf, size_t n) {
 	return OS.send(c->fd, buf, n, OS.MSG_NOSIGNAL);
 }
 
+// Writes all n bytes from buf to connection c, repeating the send
+// after partial writes.
+// Returns false on failure. On a non-blocking connection this waits
+// for the socket to become writable instead of failing with EAGAIN.
+pub bool write_all(net_t *c, const char *buf, size_t n) {
+	size_t done = 0;
+	while (done < n) {
+		int r = write(c, buf + done, n - done);
+		if (r < 0 && errno == OS.EAGAIN) {
+			if (!waitfd(c->fd, OS.POLLOUT, -1)) return false;
+			continue;
+		}
+		if (r < 0) return false;
+		done += (size_t) r;
+	}
+	return true;
+}
+
+// Writes the n buffers described by iov with a single call,
+// so that, for example, a header and a body go out in one segment.
+// At most 16 buffers are taken per call.
+// Returns the number of bytes sent, or -1 on failure.
+pub int writev(net_t *c, iov_t *iov, size_t n) {
+	iovec_t vec[16] = {};
+	if (n > nelem(vec)) {
+		n = nelem(vec);
+	}
+	for (size_t i = 0; i < n; i++) {
+		vec[i].iov_base = iov[i].base;
+		vec[i].iov_len = iov[i].len;
+	}
+	// sendmsg instead of the plain writev to pass MSG_NOSIGNAL.
+	msghdr_t m = {
+		.msg_iov = vec,
+		.msg_iovlen = n,
+	};
+	return OS.sendmsg(c->fd, &m, OS.MSG_NOSIGNAL);
+}
+
+// Same as writev, but repeats the call until all buffers are sent.
+// The iov array is modified in the process.
+// Returns false on failure.
+pub bool writev_all(net_t *c, iov_t *iov, size_t n) {
+	while (n > 0) {
+		int r = writev(c, iov, n);
+		if (r < 0 && errno == OS.EAGAIN) {
+			if (!waitfd(c->fd, OS.POLLOUT, -1)) return false;
+			continue;
+		}
+		if (r < 0) return false;
+		// Skip the fully sent buffers and cut the partially sent one.
+		size_t sent = (size_t) r;
+		while (n > 0 && sent >= iov->len) {
+			sent -= iov->len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->base = (char *) iov->base + sent;
+			iov->len -= sent;
+		}
+	}
+	return true;
+}
+
+// Same as read, but waits at most timeout_ms milliseconds for the data.
+// Returns -1 and sets errno to ETIMEDOUT if no data arrived in time.
+pub int read_timeout(net_t *c, char *buf, size_t size, int timeout_ms) {
+	if (!waitfd(c->fd, OS.POLLIN, timeout_ms)) return -1;
+	return read(c, buf, size);
+}
+
+// Same as write, but waits at most timeout_ms milliseconds for the
+// connection to accept data.
+// Returns -1 and sets errno to ETIMEDOUT if the time ran out.
+pub int write_timeout(net_t *c, const char *buf, size_t n, int timeout_ms) {
+	if (!waitfd(c->fd, OS.POLLOUT, timeout_ms)) return -1;
+	return write(c, buf, n);
+}
+
+// Waits until fd is ready for the given poll events.
+// Negative timeout means no limit.
+// Returns false and sets errno on error or timeout.
+bool waitfd(int fd, int events, int timeout_ms) {
+	pollfd_t p = { .fd = fd, .events = events };
+	while (true) {
+		int r = OS.poll(&p, 1, timeout_ms);
+		if (r < 0 && errno == OS.EINTR) continue;
+		if (r < 0) return false;
+		if (r == 0) {
+			errno = OS.ETIMEDOUT;
+			return false;
+		}
+		return true;
+	}
+}
+
+// Switches the connection to non-blocking mode or back.
+// In non-blocking mode read, write and accept fail with EAGAIN
+// instead of waiting.
+// Returns false on failure.
+pub bool set_nonblock(net_t *c, bool on) {
+	int flags = OS.fcntl(c->fd, OS.F_GETFL, 0);
+	if (flags < 0) return false;
+	if (on) {
+		flags |= OS.O_NONBLOCK;
+	} else {
+		flags &= ~OS.O_NONBLOCK;
+	}
+	return OS.fcntl(c->fd, OS.F_SETFL, flags) == 0;
+}
+
+// Turns off Nagle's algorithm (TCP_NODELAY) if on is true, so that
+// small writes are sent immediately instead of being held back until
+// the previous segment is acknowledged.
+// Returns false on failure.
+pub bool set_nodelay(net_t *c, bool on) {
+	int val = 0;
+	if (on) val = 1;
+	return OS.setsockopt(c->fd, OS.IPPROTO_TCP, OS.TCP_NODELAY, &val, sizeof(val)) == 0;
+}
+
+// Turns corking on or off for connection c. While corked, the kernel
+// holds back partial segments, so that a header and a body written
+// separately go out together. Turning it off sends what's pending.
+// Returns false on failure.
+pub bool set_cork(net_t *c, bool on) {
+	int val = 0;
+	if (on) val = 1;
+	return OS.setsockopt(c->fd, OS.IPPROTO_TCP, OS.TCP_CORK, &val, sizeof(val)) == 0;
+}
+
 // Connects to addr over protocol proto ("tcp")
 // On failure returns NULL, sets errno.
 pub net_t *connect(const char *proto, const char *addr) {
@@ -103,9 +248,7 @@ pub net_t *connect(const char *proto, const char *addr) {
 pub net_t *connect_nonblock(const char *proto, *addr) {
 	net_t *c = newconn(proto, addr);
 	if (!c) return NULL;
-	int flags = OS.fcntl(c->fd, OS.F_GETFL, 0);
-	if (flags < 0) panic("fcntl failed");
-	if (OS.fcntl(c->fd, OS.F_SETFL, flags | OS.O_NONBLOCK) < 0) panic("fcntl failed");
+	if (!set_nonblock(c, true)) panic("fcntl failed");
 	if (OS.connect(c->fd, &(c->ai_addr), c->addrlen) < 0) {
 		if (errno == OS.EINPROGRESS) return c;
 		free(c);
@@ -114,16 +257,26 @@ pub net_t *connect_nonblock(const char *proto, *addr) {
 	return c;
 }
 
-// getsockopt(...SO_ERROR...)
-// int get_socket_error(int fd) {
-// 	int error = 0;
-// 	size_t n = sizeof(error);
-// // so_error may contain connection error on a non-blocking socket.
-// 	if (getsockopt(fd, SOL_SOCKET,SO_ERROR, &error, &n) < 0) {
-// 		return -1;
-// 	}
-// 	return error;
-// }
+// Completes a connection started with connect_nonblock.
+// Waits at most timeout_ms milliseconds (no limit if negative) for the
+// connection to be established.
+// Returns false and sets errno if the connection failed or timed out.
+pub bool connect_wait(net_t *c, int timeout_ms) {
+	if (!waitfd(c->fd, OS.POLLOUT, timeout_ms)) {
+		return false;
+	}
+	// SO_ERROR holds the outcome of the connection attempt.
+	int err = 0;
+	socklen_t n = sizeof(err);
+	if (OS.getsockopt(c->fd, OS.SOL_SOCKET, OS.SO_ERROR, &err, &n) < 0) {
+		return false;
+	}
+	if (err != 0) {
+		errno = err;
+		return false;
+	}
+	return true;
+}
 
 
 pub net_t *net_listen(const char *proto, const char *addr) {
@@ -170,6 +323,21 @@ pub net_t *net_accept(net_t *l) {
 	return newconn;
 }
 
+// Accepts up to max pending connections on listener l and puts them
+// into out. The listener has to be in non-blocking mode, then a single
+// readiness event can be drained at once instead of accepting one
+// connection per poll round.
+// Returns the number of accepted connections.
+pub size_t accept_batch(net_t *l, net_t **out, size_t max) {
+	size_t n = 0;
+	while (n < max) {
+		net_t *c = net_accept(l);
+		if (!c) break;
+		out[n++] = c;
+	}
+	return n;
+}
+
 // Closes connection c.
 pub void close(net_t *c) {
 	OS.close(c->fd);
@@ -283,15 +451,12 @@ bool format_address(sockaddr_t *a, char *buf, size_t n) {
  */
 int net_puts(const char *s, net_t *c) {
 	size_t len = strlen(s);
-	int r = write(c, s, len);
-
 	// return EOF if a write error occurs
-	if (r < 0 || (size_t) r < len) {
+	if (!write_all(c, s, len)) {
 		return EOF;
 	}
-
 	// return a non-negative value on success
-	return r;
+	return 1;
 }
 
 /*
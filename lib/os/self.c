@@ -18,3 +18,12 @@ pub bool getcwd(char *buf, size_t n) {
 pub const char *getenv(const char *name) {
 	return OS.getenv(name);
 }
+
+// Returns the number of online processors, at least 1.
+pub int ncpus() {
+	int64_t n = OS.sysconf(OS._SC_NPROCESSORS_ONLN);
+	if (n < 1) {
+		return 1;
+	}
+	return (int) n;
+}
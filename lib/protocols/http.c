@@ -440,10 +440,12 @@ pub void serve_text(request_t *req, net.net_t *conn, const char *s, *content_typ
 		req->version,
 		strlen(s),
 		content_type);
-	if (net.write(conn, buf, strlen(buf)) < 0) {
-		panic("net write failed");
-	}
-	if (net.write(conn, s, strlen(s)) < 0) {
+	// Header and body in one call.
+	net.iov_t iov[2] = {
+		{ .base = buf, .len = strlen(buf) },
+		{ .base = (char *) s, .len = strlen(s) },
+	};
+	if (!net.writev_all(conn, iov, 2)) {
 		panic("net write failed");
 	}
 }
@@ -466,21 +468,29 @@ pub void servefile(request_t *req, net.net_t *conn, const char *filepath) {
 		req->version,
 		filesize,
 		content_type);
-	if (net.write(conn, buf, strlen(buf)) < 0) {
-		panic("net write failed");
-	}
 
 	FILE *f = fopen(filepath, "rb");
 	if (!f) {
 		panic("oops");
 	}
 
+	// The header goes out together with the first chunk of the file.
+	char *tmp = calloc!(65536, 1);
+	size_t n = fread(tmp, 1, 65536, f);
+	net.iov_t iov[2] = {
+		{ .base = buf, .len = strlen(buf) },
+		{ .base = tmp, .len = n },
+	};
+	if (!net.writev_all(conn, iov, 2)) {
+		panic("net write failed");
+	}
 	while (true) {
-		char tmp[4096];
-		size_t n = fread(tmp, 1, 4096, f);
+		n = fread(tmp, 1, 65536, f);
 		if (n == 0) break;
-		int r = net.write(conn, tmp, n);
-		if (r < 0) panic("net write failed");
+		if (!net.write_all(conn, tmp, n)) {
+			panic("net write failed");
+		}
 	}
+	free(tmp);
 	fclose(f);
 }
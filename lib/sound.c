@@ -50,40 +50,137 @@ pub void normalize(clip_t *c, double level) {
 	}
 }
 
+// Filter bank resolution: kernels are tabulated at NPHASES fractional
+// positions between samples, and interpolated between them.
+#define NPHASES 256
+
+// Zero crossings of the sinc on each side of the kernel at full band.
+#define SINC_ZEROS 8
+
+// A windowed-sinc lowpass kernel tabulated for fractional offsets.
+typedef {
+	double cutoff;
+	int half; // taps on each side
+	int ntaps; // 2 * half
+	float *taps; // NPHASES + 1 rows of ntaps
+	void *next;
+} bank_t;
+
+// Banks made so far. All stretches share the full band one, and
+// squeezing by the same ratio again finds its bank here.
+bank_t *banks = NULL;
+
+// Returns the bank for the given cutoff, making it on first use.
+// The banks are kept until the program exits.
+// This function is not thread safe.
+bank_t *getbank(double cutoff) {
+	for (bank_t *b = banks; b; b = b->next) {
+		if (b->cutoff == cutoff) return b;
+	}
+	bank_t *b = newbank(cutoff);
+	b->next = banks;
+	banks = b;
+	return b;
+}
+
+// Makes a bank for the given cutoff, as a fraction of the Nyquist
+// frequency. A lower cutoff needs proportionally wider kernels.
+bank_t *newbank(double cutoff) {
+	bank_t *b = calloc!(1, sizeof(bank_t));
+	b->cutoff = cutoff;
+	b->half = (int) ceil(SINC_ZEROS / cutoff);
+	b->ntaps = 2 * b->half;
+	b->taps = calloc!((NPHASES + 1) * b->ntaps, sizeof(float));
+	for (int p = 0; p <= NPHASES; p++) {
+		double frac = (double) p / NPHASES;
+		float *row = b->taps + p * b->ntaps;
+		double sum = 0;
+		for (int k = 0; k < b->ntaps; k++) {
+			// Distance from the output point to the input sample.
+			double x = (double) (k - b->half + 1) - frac;
+			double h = cutoff * sinc(cutoff * x) * blackman(x / b->half);
+			row[k] = (float) h;
+			sum += h;
+		}
+		// Unity gain at DC for every phase.
+		for (int k = 0; k < b->ntaps; k++) {
+			row[k] = (float) (row[k] / sum);
+		}
+	}
+	return b;
+}
+
+double sinc(double x) {
+	if (x == 0) return 1;
+	double y = M_PI * x;
+	return sin(y) / y;
+}
+
+// Blackman window over [-1, 1].
+double blackman(double x) {
+	if (x <= -1 || x >= 1) return 0;
+	double t = M_PI * (x + 1);
+	return 0.42 - 0.5 * cos(t) + 0.08 * cos(2 * t);
+}
+
 // Returns a copy of clip c stretched by factor of r.
 // r > 1 results in lower sound, r < 1 in higher.
+// The clip is resampled with a windowed-sinc filter, which also removes
+// the frequencies that wouldn't fit below Nyquist when r < 1.
+// This function is not thread safe, the filter banks are shared.
 pub clip_t *transpose(clip_t *c, float r) {
-	clip_t *c2 = newclip(c->freq);
-
 	// How many samples the new clip will have.
 	size_t n2 = (size_t) ((float) c->nsamples * r);
+	clip_t *c2 = calloc!(1, sizeof(clip_t));
+	c2->freq = c->freq;
+	c2->cap = n2 + 1;
+	c2->samples = calloc!(c2->cap, sizeof(samplef_t));
+	c2->nsamples = n2;
 
+	double cutoff = 1;
+	if (r < 1) {
+		cutoff = r;
+	}
+	bank_t *b = getbank(cutoff);
+	int64_t n = (int64_t) c->nsamples;
 	for (size_t t = 0; t < n2; t++) {
 		// The "time" in the original sample flows r times slower.
-		float t0 = (float) t / r;
-
-		// Split the fractional time into an integer and a remainder.
 		// t0 = 13.156 means 0.156 between samples 13 and 14.
-		size_t t0_int = (size_t) t0;
-		float b = t0 - (float) t0_int;
-		float a = 1 - b;
+		double t0 = (double) t / r;
+		int64_t i0 = (int64_t) t0;
+		double pos = (t0 - (double) i0) * NPHASES;
+		int p = (int) pos;
+		if (p >= NPHASES) p = NPHASES - 1;
+		double mu = pos - (double) p;
 
-		if (t0_int >= c->nsamples) {
-			panic("oopsie, %zu >= %zu (at t=%zu)\n", t0_int, c->nsamples, t);
-		}
+		// Samples past the clip's ends are silence.
+		int64_t first = i0 - b->half + 1;
+		int k0 = 0;
+		int k1 = b->ntaps;
+		if (first < 0) k0 = (int) -first;
+		if (first + k1 > n) k1 = (int) (n - first);
 
-		// Mix two original samples in the proportion according
-		// to the remainder in t.
-		samplef_t *s = &c->samples[t0_int];
-		double left = s->left * a;
-		double right = s->right * a;
-		if (b > 0) {
-			s = &c->samples[t0_int+1];
-			left += s->left * b;
-			right += s->right * b;
+		// Filter with the kernels of the two tabulated phases around the
+		// offset and interpolate between the results, which is the same
+		// as filtering with the interpolated kernel.
+		const float *row0 = b->taps + p * b->ntaps;
+		const float *row1 = row0 + b->ntaps;
+		double left0 = 0;
+		double right0 = 0;
+		double left1 = 0;
+		double right1 = 0;
+		const samplef_t *s = &c->samples[first + k0];
+		for (int k = k0; k < k1; k++) {
+			double w0 = row0[k];
+			double w1 = row1[k];
+			left0 += s->left * w0;
+			right0 += s->right * w0;
+			left1 += s->left * w1;
+			right1 += s->right * w1;
+			s++;
 		}
-		samplef_t t = {left, right};
-		push_sample(c2, t);
+		c2->samples[t].left = left0 + (left1 - left0) * mu;
+		c2->samples[t].right = right0 + (right1 - right0) * mu;
 	}
 	return c2;
 }
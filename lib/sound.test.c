@@ -0,0 +1,48 @@
+#import sound
+#import test
+
+int main() {
+	// A tone stretched twice is the same tone an octave lower, and
+	// squeezed twice an octave higher.
+	float ratios[] = {2, 0.5, 1.5, 0.8};
+	for (size_t i = 0; i < nelem(ratios); i++) {
+		float r = ratios[i];
+		sound.clip_t *c = tone(44100, 0.01);
+		sound.clip_t *c2 = sound.transpose(c, r);
+		test.truth("length", c2->nsamples == (size_t) (44100 * r));
+		// Away from the edges, where the filter runs out of samples.
+		double err = 0;
+		for (size_t t = 100; t < c2->nsamples - 100; t++) {
+			double want = sin(0.01 * (double) t / r);
+			err = OS.fmax(err, fabs(c2->samples[t].left - want));
+			err = OS.fmax(err, fabs(c2->samples[t].right - want / 2));
+		}
+		test.truth("tone", err < 1e-5);
+		sound.freeclip(c);
+		sound.freeclip(c2);
+	}
+
+	// Squeezing a tone above the new Nyquist frequency filters it out
+	// instead of folding it back.
+	sound.clip_t *c = tone(44100, 2.5);
+	sound.clip_t *c2 = sound.transpose(c, 0.5);
+	double max = 0;
+	for (size_t t = 100; t < c2->nsamples - 100; t++) {
+		max = OS.fmax(max, fabs(c2->samples[t].left));
+	}
+	test.truth("alias", max < 1e-3);
+
+	return test.fails();
+}
+
+// Returns a clip of n samples of a sine with the given angular step,
+// at half the amplitude on the right.
+sound.clip_t *tone(size_t n, double step) {
+	sound.clip_t *c = sound.newclip(44100);
+	for (size_t t = 0; t < n; t++) {
+		double v = sin(step * (double) t);
+		sound.samplef_t s = {v, v / 2};
+		sound.push_sample(c, s);
+	}
+	return c;
+}
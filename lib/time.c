@@ -229,6 +229,14 @@ pub iso_t now() {
 	return r;
 }
 
+// Returns a monotonic clock reading in microseconds.
+// The value is meaningful only as a difference between two readings.
+pub int64_t ticks() {
+	timespec_t ts = {};
+	OS.clock_gettime(OS.CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * SECONDS + ts.tv_nsec / 1000;
+}
+
 // Returns time corresponding to the given unix time.
 pub iso_t fromunix(int64_t seconds) {
 	time_t s = seconds;
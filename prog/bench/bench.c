@@ -0,0 +1,135 @@
+#import compress/gzip
+#import compress/lzw
+#import compress/parallel
+#import crypt/sha1
+#import mem
+#import reader
+#import rnd
+#import sound
+#import time
+#import writer
+
+// Prints the throughput of library code that the tests only check for
+// correctness.
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s sha1|lzw|gzip|transpose\n", argv[0]);
+		return 1;
+	}
+	const char *name = argv[1];
+	if (strcmp(name, "sha1") == 0) {
+		sha1bench();
+		return 0;
+	}
+	if (strcmp(name, "lzw") == 0) {
+		lzwbench();
+		return 0;
+	}
+	if (strcmp(name, "gzip") == 0) {
+		gzipbench();
+		return 0;
+	}
+	if (strcmp(name, "transpose") == 0) {
+		transposebench();
+		return 0;
+	}
+	fprintf(stderr, "unknown benchmark: %s\n", name);
+	return 1;
+}
+
+// Prints the hashing throughput.
+void sha1bench() {
+	size_t n = 1000000;
+	uint8_t *buf = calloc!(n, 1);
+	memset(buf, 'a', n);
+	int rounds = 100;
+	sha1.digest_t hash = {};
+	int64_t t = time.ticks();
+	for (int i = 0; i < rounds; i++) {
+		sha1.update(&hash, buf, n);
+	}
+	sha1.end(&hash);
+	printf("sha1: %.1f MB/s\n", mbps(n * rounds, t));
+	free(buf);
+}
+
+// Prints the compression throughput on repetitive text.
+void lzwbench() {
+	size_t n = 1000000;
+	uint8_t *data = words(n);
+	size_t outsize = n * 2;
+	uint8_t *out = calloc!(outsize, 1);
+	int rounds = 10;
+	int64_t t = time.ticks();
+	for (int i = 0; i < rounds; i++) {
+		reader.t *in = reader.static_buffer(data, n);
+		writer.t *w = writer.static_buffer(out, outsize);
+		lzw.compress(in, 256, w);
+		reader.free(in);
+		writer.free(w);
+	}
+	printf("lzw: %.1f MB/s\n", mbps(n * rounds, t));
+	free(out);
+	free(data);
+}
+
+// Prints the throughput of the parallel gzip writer on 4 threads.
+void gzipbench() {
+	size_t n = 10000000;
+	uint8_t *data = words(n);
+	mem.mem_t *m = mem.memopen();
+	writer.t *w = mem.newwriter(m);
+	int64_t t = time.ticks();
+	parallel.t *p = gzip.newparallel(w, 6, 256 * 1024, 4);
+	parallel.write(p, data, n);
+	if (!parallel.close(p)) {
+		panic("gzip failed");
+	}
+	printf("gzip on 4 threads: %.1f MB/s\n", mbps(n, t));
+	writer.free(w);
+	mem.memclose(m);
+	free(data);
+}
+
+// Prints the time to transpose a second of sound to the notes of two
+// octaves around it, as futu does for the keys it has no samples for.
+void transposebench() {
+	sound.clip_t *c = sound.newclip(44100);
+	for (int t = 0; t < 44100; t++) {
+		double v = sin(0.05 * (double) t);
+		sound.samplef_t s = {v, v / 2};
+		sound.push_sample(c, s);
+	}
+	int64_t t = time.ticks();
+	int n = 0;
+	for (int k = -12; k < 12; k++) {
+		float r = (float) pow(2, (double) k / 12);
+		sound.freeclip(sound.transpose(c, r));
+		n++;
+	}
+	double ms = (double) (time.ticks() - t) / 1e3;
+	printf("transpose: %.1f ms per second of sound\n", ms / n);
+	sound.freeclip(c);
+}
+
+// Returns n bytes of words picked from a small vocabulary.
+uint8_t *words(size_t n) {
+	const char *vocab[] = {"the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ", "and ", "a "};
+	uint8_t *buf = calloc!(n, 1);
+	rnd.seed(2);
+	size_t pos = 0;
+	while (pos < n) {
+		const char *w = vocab[rnd.intn(nelem(vocab))];
+		for (size_t i = 0; w[i] != '\0' && pos < n; i++) {
+			buf[pos++] = (uint8_t) w[i];
+		}
+	}
+	return buf;
+}
+
+// Returns the throughput of n bytes processed since the time t.
+double mbps(size_t n, int64_t t) {
+	double seconds = (double) (time.ticks() - t) / 1e6;
+	return (double) n / 1e6 / seconds;
+}
@@ -1,6 +1,5 @@
 #import formats/wav
 #import opt
-#import sound
 
 enum {
     HARD,
@@ -30,11 +29,16 @@ int main(int argc, char** argv) {
 	wav.writer_t *out = wav.open_writer(stdout);
 
 	double dgain = gain;
-	while (wav.more(in)) {
-		sound.samplef_t s = wav.read_samplef(in);
-		double left = dist(type, s.left * dgain);
-		double right = dist(type, s.right * dgain);
-		wav.write_sample(out, left, right);
+	float left[4096] = {};
+	float right[4096] = {};
+	while (true) {
+		size_t n = wav.read_block(in, left, right, nelem(left));
+		if (n == 0) break;
+		for (size_t i = 0; i < n; i++) {
+			left[i] = (float) dist(type, left[i] * dgain);
+			right[i] = (float) dist(type, right[i] * dgain);
+		}
+		wav.write_block(out, left, right, n);
 	}
 
 	wav.close_reader(in);
@@ -0,0 +1,285 @@
+#import os/net
+#import strings
+
+pub typedef {
+	int status;
+	size_t size; // total size of the response in bytes, including the head
+	bool keepalive; // false if the server will close the connection after this response
+} response_t;
+
+// Response parser states.
+enum {
+	ST_STATUS,
+	ST_HEADERS,
+	ST_BODY,
+	ST_CHUNK_SIZE,
+	ST_CHUNK_DATA,
+	ST_CHUNK_END,
+	ST_TRAILER,
+	ST_UNTIL_CLOSE,
+}
+
+// A client connection with its own receive buffer.
+// Responses are parsed directly from the buffer, so pipelined responses
+// that arrive in one segment are all consumed without extra reads.
+// The parser is resumable, so the same connection type serves both
+// blocking workers and the non-blocking event loop.
+pub typedef {
+	net.net_t *net;
+	char buf[65536];
+	size_t start; // position of the first unconsumed byte in buf
+	size_t end; // end of the received data in buf
+	size_t consumed; // total bytes consumed from the connection
+
+	// State of the response being parsed.
+	int state;
+	size_t remaining; // body or chunk bytes left to consume
+	bool chunked;
+	bool has_length;
+	size_t pos0; // value of consumed where the response started
+	response_t res;
+} t;
+
+// Connects to addr.
+// Returns NULL on failure.
+pub t *open(const char *addr) {
+	return wrap(net.connect("tcp", addr));
+}
+
+// Starts connecting to addr without waiting for the connection to be
+// established. The connection is ready when it becomes writable.
+// Returns NULL on failure.
+pub t *open_nonblock(const char *addr) {
+	return wrap(net.connect_nonblock("tcp", addr));
+}
+
+t *wrap(net.net_t *n) {
+	if (!n) return NULL;
+	// Requests are written whole, Nagle's algorithm would only delay
+	// the pipelined ones.
+	net.set_nodelay(n, true);
+	t *c = calloc!(1, sizeof(t));
+	c->net = n;
+	return c;
+}
+
+pub void close(t *c) {
+	net.close(c->net);
+	free(c);
+}
+
+// Returns the connection's file descriptor for polling.
+pub int fd(t *c) {
+	return c->net->fd;
+}
+
+// Writes n bytes from buf to the connection, retrying on partial writes.
+// Returns false on failure.
+pub bool write(t *c, const uint8_t *buf, size_t n) {
+	return net.write_all(c->net, (char *) buf, n);
+}
+
+// Makes a single send attempt of n bytes from buf.
+// Returns the number of bytes sent or -1 on error.
+pub int send(t *c, const uint8_t *buf, size_t n) {
+	return net.write(c->net, (char *) buf, n);
+}
+
+// Receives more data into the buffer, moving the unconsumed tail
+// to the beginning first.
+// Returns the number of bytes received, 0 on EOF or -1 on error,
+// including the case when a header line doesn't fit into the buffer.
+pub int recv(t *c) {
+	if (c->start > 0) {
+		memmove(c->buf, c->buf + c->start, c->end - c->start);
+		c->end -= c->start;
+		c->start = 0;
+	}
+	if (c->end == sizeof(c->buf)) {
+		return -1;
+	}
+	int r = net.read(c->net, c->buf + c->end, sizeof(c->buf) - c->end);
+	if (r > 0) {
+		c->end += r;
+	}
+	return r;
+}
+
+// Reads one response into r, blocking until it's received.
+// Returns false if the connection was closed or the response is malformed.
+pub bool read_response(t *c, response_t *r) {
+	while (true) {
+		int p = parse(c, r);
+		if (p != 0) {
+			return p > 0;
+		}
+		int n = recv(c);
+		if (n <= 0) {
+			return n == 0 && finish(c, r);
+		}
+	}
+}
+
+// Parses the buffered data.
+// Returns 1 and puts the response into r when a complete response has
+// been consumed, 0 if more data is needed and -1 if the response is
+// malformed.
+pub int parse(t *c, response_t *r) {
+	while (true) {
+		switch (c->state) {
+			case ST_STATUS: {
+				// HTTP/1.1 200 OK
+				c->pos0 = c->consumed;
+				char *line = nextline(c);
+				if (!line) return 0;
+				bool v11 = strings.starts_with(line, "HTTP/1.1 ");
+				if (!v11 && !strings.starts_with(line, "HTTP/1.0 ")) {
+					return -1;
+				}
+				memset(&c->res, 0, sizeof(response_t));
+				c->res.status = atoi(line + 9);
+				c->res.keepalive = v11;
+				c->chunked = false;
+				c->has_length = false;
+				c->remaining = 0;
+				c->state = ST_HEADERS;
+			}
+			case ST_HEADERS: {
+				char *line = nextline(c);
+				if (!line) return 0;
+				if (*line == '\0') {
+					c->state = body_state(c);
+				} else if (!header(c, line)) {
+					return -1;
+				}
+			}
+			case ST_BODY: {
+				c->remaining -= take(c, c->remaining);
+				if (c->remaining > 0) return 0;
+				return done(c, r);
+			}
+			case ST_CHUNK_SIZE: {
+				char *line = nextline(c);
+				if (!line) return 0;
+				// Chunk extensions after ';' are ignored by strtoull.
+				c->remaining = strtoull(line, NULL, 16);
+				if (c->remaining == 0) {
+					c->state = ST_TRAILER;
+				} else {
+					c->state = ST_CHUNK_DATA;
+				}
+			}
+			case ST_CHUNK_DATA: {
+				c->remaining -= take(c, c->remaining);
+				if (c->remaining > 0) return 0;
+				c->state = ST_CHUNK_END;
+			}
+			case ST_CHUNK_END: {
+				char *line = nextline(c);
+				if (!line) return 0;
+				if (*line != '\0') return -1;
+				c->state = ST_CHUNK_SIZE;
+			}
+			case ST_TRAILER: {
+				char *line = nextline(c);
+				if (!line) return 0;
+				if (*line == '\0') return done(c, r);
+			}
+			case ST_UNTIL_CLOSE: {
+				take(c, c->end - c->start);
+				return 0;
+			}
+			default: {
+				panic("unexpected state: %d", c->state);
+			}
+		}
+	}
+}
+
+// Completes the response at the end of the stream.
+// Returns true and puts the response into r if the response had no
+// length and was delimited by closing the connection.
+pub bool finish(t *c, response_t *r) {
+	if (c->state != ST_UNTIL_CLOSE) {
+		return false;
+	}
+	take(c, c->end - c->start);
+	done(c, r);
+	return true;
+}
+
+int done(t *c, response_t *r) {
+	c->res.size = c->consumed - c->pos0;
+	*r = c->res;
+	c->state = ST_STATUS;
+	return 1;
+}
+
+bool header(t *c, char *line) {
+	char *val = strchr(line, ':');
+	if (!val) return false;
+	*val++ = '\0';
+	while (*val == ' ' || *val == '\t') val++;
+	if (strings.casecmp(line, "Content-Length")) {
+		c->has_length = true;
+		c->remaining = strtoull(val, NULL, 10);
+	} else if (strings.casecmp(line, "Transfer-Encoding")) {
+		c->chunked = strings.casecmp(val, "chunked");
+	} else if (strings.casecmp(line, "Connection")) {
+		if (strings.casecmp(val, "close")) {
+			c->res.keepalive = false;
+		} else if (strings.casecmp(val, "keep-alive")) {
+			c->res.keepalive = true;
+		}
+	}
+	return true;
+}
+
+// Returns the parser state for the body after the headers have been read.
+int body_state(t *c) {
+	int status = c->res.status;
+	if (status / 100 == 1 || status == 204 || status == 304) {
+		// No body by definition.
+		c->remaining = 0;
+		return ST_BODY;
+	}
+	if (c->chunked) {
+		return ST_CHUNK_SIZE;
+	}
+	if (c->has_length) {
+		return ST_BODY;
+	}
+	// No length: the body extends to the end of the connection.
+	c->res.keepalive = false;
+	return ST_UNTIL_CLOSE;
+}
+
+// Consumes up to n buffered bytes.
+// Returns the number of bytes consumed.
+size_t take(t *c, size_t n) {
+	size_t avail = c->end - c->start;
+	if (avail > n) avail = n;
+	c->start += avail;
+	c->consumed += avail;
+	return avail;
+}
+
+// Consumes one buffered line and returns it as a string without the
+// terminator. Lines end with CRLF, but a bare LF is accepted too.
+// The string is valid until the next recv.
+// Returns NULL if there is no complete line in the buffer.
+char *nextline(t *c) {
+	char *line = c->buf + c->start;
+	char *nl = OS.memchr(line, '\n', c->end - c->start);
+	if (!nl) {
+		return NULL;
+	}
+	size_t len = nl - line;
+	if (len > 0 && line[len-1] == '\r') {
+		line[len-1] = '\0';
+	}
+	*nl = '\0';
+	c->consumed += len + 1;
+	c->start += len + 1;
+	return line;
+}
@@ -1,38 +1,94 @@
+#import conn.c
 #import dbg
+#import hdr
 #import opt
-#import os/net
 #import os/threads
 #import protocols/http
-#import reader
 #import strings
 #import time
 #import url
 #import writer
 
+#include <poll.h>
+typedef struct pollfd pollfd_t;
+
 const char *DBG_TAG = "exab";
 
 char *addr = NULL;
 uint8_t REQUEST[1000] = {};
 size_t REQUESTLEN = 0;
 
-threads.mtx_t *stdout_lock = NULL;
+// The request repeated for every pipelining slot, so that a whole
+// batch goes out in one write.
+uint8_t *BATCH = NULL;
+
+bool keepalive = false;
+size_t depth = 1;
 
+// Requests left to do, shared by the closed-loop workers.
+// In the timed mode (-d) the count is ignored and the workers run
+// until the deadline.
+threads.mtx_t *budget_lock = NULL;
+size_t budget = 0;
+bool timed = false;
+int64_t deadline = 0;
+
+// Per-thread state and statistics.
+// Every thread records into its own histogram, the histograms are merged
+// when all threads are done.
 typedef {
 	size_t id;
-	threads.pipe_t *pipe;
-} worker_arg_t;
+
+	// Open-loop mode parameters.
+	size_t nconns; // connections driven by this thread
+	double rate; // requests per second issued by this thread
+	size_t quota; // requests to issue, unless timed
+
+	hdr.t *latency; // microseconds
+	size_t responses;
+	size_t errors;
+	size_t non2xx;
+	size_t received; // bytes
+} worker_t;
 
 int main(int argc, char *argv[]) {
-	stdout_lock = threads.mtx_new();
+	budget_lock = threads.mtx_new();
 	size_t concurrency = 1;
 	size_t requests_to_do = 1;
+	size_t rate = 0;
+	size_t nthreads = 1;
+	char *duration = NULL;
 	opt.nargs(1, "<url>");
 	opt.summary("makes a series of HTTP requests to <url> and prints statistics");
 	opt.size("n", "number of requests to perform", &requests_to_do);
-	opt.size("c", "number of requests running concurrently", &concurrency);
+	opt.size("c", "number of connections running concurrently", &concurrency);
+	opt.flag("k", "keep connections alive between requests", &keepalive);
+	opt.size("p", "number of requests pipelined on a connection, implies -k", &depth);
+	opt.str("d", "run for the given duration (500ms, 30s, 2m) instead of -n requests", &duration);
+	opt.size("R", "open-loop mode: issue requests at this rate per second regardless of responses, implies -k", &rate);
+	opt.size("t", "number of threads driving the connections in the open-loop mode", &nthreads);
 	char **args = opt.parse(argc, argv);
 	char *urlstr = *args;
 
+	if (depth == 0 || concurrency == 0 || nthreads == 0) {
+		fprintf(stderr, "-p, -c and -t must be positive\n");
+		return 1;
+	}
+	if (depth > 1 || rate > 0) {
+		keepalive = true;
+	}
+	if (duration) {
+		int64_t us = 0;
+		if (!parse_duration(duration, &us)) {
+			fprintf(stderr, "failed to parse duration: %s\n", duration);
+			return 1;
+		}
+		timed = true;
+		deadline = time.ticks() + us;
+	} else {
+		budget = requests_to_do;
+	}
+
 	//
 	// Parse and check the URL.
 	//
@@ -52,137 +108,469 @@ int main(int argc, char *argv[]) {
 
 	//
 	// Create and format the HTTP request as a bytes buffer.
+	// Persistent connections are the default in HTTP/1.1, so keep-alive
+	// only needs the version bump.
 	//
 	http.request_t req = {};
 	if (!http.init_request(&req, http.GET, u->path)) {
 		fprintf(stderr, "failed to init request: %s\n", http.errstr(req.err));
 		return 1;
 	}
+	if (keepalive) {
+		strcpy(req.version, "HTTP/1.1");
+	}
 	http.set_header(&req, "Host", u->hostname);
 	http.set_header(&req, "User-Agent", "exab");
 
 	writer.t *w = writer.static_buffer(REQUEST, sizeof(REQUEST));
-	if (!http.write_request(w, &req)) {
+	if (http.write_request(w, &req) < 0) {
 		panic("failed to write the request");
 	}
 	REQUESTLEN = w->nwritten;
 	writer.free(w);
 
-	// Adjust the workers number if there is not enough work for all.
-	if (concurrency > requests_to_do) {
-		concurrency = requests_to_do;
+	BATCH = calloc!(depth, REQUESTLEN);
+	for (size_t i = 0; i < depth; i++) {
+		memcpy(BATCH + i * REQUESTLEN, REQUEST, REQUESTLEN);
 	}
 
-	threads.pipe_t *pipe = threads.newpipe();
-	threads.thr_t **tt = calloc!(concurrency, sizeof(threads.thr_t *));
-	worker_arg_t *aa = calloc!(concurrency, sizeof(worker_arg_t));
-
-	print_result_header();
-	for (size_t i = 0; i < concurrency; i++) {
-		aa[i].id = i;
-		aa[i].pipe = pipe;
-		tt[i] = threads.start(&worker, &aa[i]);
+	//
+	// Decide the threads layout. In the closed-loop mode every connection
+	// has its own blocking thread. In the open-loop mode the connections
+	// are spread over the threads, and so are the rate and the requests.
+	//
+	if (!timed && concurrency > requests_to_do) {
+		concurrency = requests_to_do;
 	}
-
-	for (size_t i = 0; i < requests_to_do; i++) {
-		// Sending NULL because there is nothing to send, we only
-		// need to nudge a worker to make another request.
-		threads.pwrite(pipe, NULL);
+	if (rate == 0) {
+		nthreads = concurrency;
+	} else if (nthreads > concurrency) {
+		nthreads = concurrency;
 	}
-	threads.pclose(pipe);
+	threads.thr_t **tt = calloc!(nthreads, sizeof(threads.thr_t *));
+	worker_t *ww = calloc!(nthreads, sizeof(worker_t));
+	size_t quota_given = 0;
+	for (size_t i = 0; i < nthreads; i++) {
+		worker_t *w = &ww[i];
+		w->id = i;
+		w->latency = hdr.new();
+		w->nconns = concurrency / nthreads;
+		if (i < concurrency % nthreads) {
+			w->nconns++;
+		}
+		w->rate = (double) rate * w->nconns / concurrency;
+		w->quota = requests_to_do * w->nconns / concurrency;
+		quota_given += w->quota;
+	}
+	ww[0].quota += requests_to_do - quota_given;
 
-	for (size_t i = 0; i < concurrency; i++) {
+	int64_t t0 = time.ticks();
+	for (size_t i = 0; i < nthreads; i++) {
+		if (rate > 0) {
+			tt[i] = threads.start(&openloop, &ww[i]);
+		} else {
+			tt[i] = threads.start(&worker, &ww[i]);
+		}
+	}
+	for (size_t i = 0; i < nthreads; i++) {
 		threads.wait(tt[i], NULL);
 	}
-	free(aa);
+	int64_t elapsed = time.ticks() - t0;
+
+	print_summary(ww, nthreads, elapsed);
+	for (size_t i = 0; i < nthreads; i++) {
+		hdr.free(ww[i].latency);
+	}
+	free(ww);
 	free(tt);
-	threads.freepipe(pipe);
+	free(BATCH);
 	return 0;
 }
 
+// Parses a duration like "500ms", "30s", "2m" or "1h" into microseconds.
+// A number without a unit is taken as seconds.
+bool parse_duration(const char *s, int64_t *us) {
+	char *end = NULL;
+	int64_t val = strtoull(s, &end, 10);
+	if (end == s || *s == '-') {
+		return false;
+	}
+	switch str (end) {
+		case "ms": { *us = val * time.MS; }
+		case "", "s": { *us = val * time.SECONDS; }
+		case "m": { *us = val * time.MINUTES; }
+		case "h": { *us = val * 60 * time.MINUTES; }
+		default: { return false; }
+	}
+	return true;
+}
+
+void print_summary(worker_t *ww, size_t n, int64_t elapsed) {
+	hdr.t *h = hdr.new();
+	size_t responses = 0;
+	size_t errors = 0;
+	size_t non2xx = 0;
+	size_t received = 0;
+	for (size_t i = 0; i < n; i++) {
+		hdr.merge(h, ww[i].latency);
+		responses += ww[i].responses;
+		errors += ww[i].errors;
+		non2xx += ww[i].non2xx;
+		received += ww[i].received;
+	}
+	double seconds = (double) elapsed / time.SECONDS;
+	char transfer[20] = {};
+	strings.fmt_bytes((size_t) (received / seconds), transfer, sizeof(transfer));
+
+	printf("responses\t%zu\n", responses);
+	printf("errors\t%zu\n", errors);
+	printf("non-2xx\t%zu\n", non2xx);
+	printf("elapsed_s\t%.3f\n", seconds);
+	printf("req_per_s\t%.1f\n", responses / seconds);
+	printf("transfer_per_s\t%s\n", transfer);
+	printf("mean_ms\t%.3f\n", hdr.mean(h) / time.MS);
+	printf("p50_ms\t%.3f\n", (double) hdr.percentile(h, 50) / time.MS);
+	printf("p90_ms\t%.3f\n", (double) hdr.percentile(h, 90) / time.MS);
+	printf("p99_ms\t%.3f\n", (double) hdr.percentile(h, 99) / time.MS);
+	printf("p99.9_ms\t%.3f\n", (double) hdr.percentile(h, 99.9) / time.MS);
+	printf("max_ms\t%.3f\n", (double) hdr.max(h) / time.MS);
+	hdr.free(h);
+}
+
+// Accounts a received response that was meant to start at time t0.
+void record(worker_t *w, conn.response_t *r, int64_t t0) {
+	hdr.record(w->latency, time.ticks() - t0);
+	w->responses++;
+	w->received += r->size;
+	if (r->status / 100 != 2) {
+		w->non2xx++;
+	}
+}
+
+//
+// Closed loop: every connection has a thread that sends the next request
+// only after the previous response has arrived.
+//
+
+// Takes up to max requests from the shared budget.
+// Returns zero when there is no more work to do.
+size_t take(size_t max) {
+	if (timed) {
+		if (time.ticks() >= deadline) {
+			return 0;
+		}
+		return max;
+	}
+	threads.lock(budget_lock);
+	size_t n = budget;
+	if (n > max) {
+		n = max;
+	}
+	budget -= n;
+	threads.unlock(budget_lock);
+	return n;
+}
+
+// Returns n taken but unfinished requests to the budget.
+void giveback(size_t n) {
+	if (timed) {
+		return;
+	}
+	threads.lock(budget_lock);
+	budget += n;
+	threads.unlock(budget_lock);
+}
+
 void *worker(void *arg) {
-	dbg.m(DBG_TAG, "thread started");
-	worker_arg_t *a = arg;
-	threads.pipe_t *pipe = a->pipe;
+	worker_t *w = arg;
+	dbg.m(DBG_TAG, "thread %zu started", w->id);
 
-	char resbytes[4096] = {};
+	conn.t *c = NULL;
+	while (true) {
+		size_t n = take(depth);
+		if (n == 0) {
+			break;
+		}
+		int64_t t0 = time.ticks();
+		bool fresh = false;
+		if (!c) {
+			c = conn.open(addr);
+			if (!c) {
+				fprintf(stderr, "failed to connect to %s: %s\n", addr, strerror(errno));
+				w->errors += n;
+				break;
+			}
+			fresh = true;
+		}
 
-	result_t _res = {};
-	result_t *res = &_res;
-	res->worker_id = a->id;
+		bool reusable = keepalive;
+		size_t done = run_batch(w, c, n, t0, &reusable);
+		if (!reusable || done < n) {
+			conn.close(c);
+			c = NULL;
+		}
+		if (done < n) {
+			// An idle persistent connection may have been dropped by
+			// the server, so only a fresh connection failing is an error.
+			if (done == 0 && fresh) {
+				fprintf(stderr, "no response from %s\n", addr);
+				w->errors += n;
+				break;
+			}
+			giveback(n - done);
+		}
+	}
+	if (c) {
+		conn.close(c);
+	}
+	return NULL;
+}
+
+// Sends n pipelined requests over connection c and reads the responses.
+// Returns the number of responses received, which is less than n if the
+// connection broke or the server closed it. Clears reusable if the
+// connection can't be used for more requests.
+size_t run_batch(worker_t *w, conn.t *c, size_t n, int64_t t0, bool *reusable) {
+	if (!conn.write(c, BATCH, n * REQUESTLEN)) {
+		*reusable = false;
+		return 0;
+	}
+	for (size_t i = 0; i < n; i++) {
+		conn.response_t r = {};
+		if (!conn.read_response(c, &r)) {
+			*reusable = false;
+			return i;
+		}
+		record(w, &r, t0);
+		if (!r.keepalive) {
+			*reusable = false;
+			return i + 1;
+		}
+	}
+	return n;
+}
+
+//
+// Open loop: requests are issued on a fixed schedule whether or not the
+// previous ones have been answered, and each latency is measured from the
+// time the request was supposed to be sent. This way a stalled server
+// shows up in the latencies instead of silently slowing the client down
+// (the "coordinated omission" problem of closed-loop testers).
+//
+
+// A connection driven by the open-loop event loop.
+typedef {
+	conn.t *c;
+	bool answered; // got a response since connecting
+	int64_t *queue; // intended start times of the requests in flight
+	size_t qstart;
+	size_t qlen;
+	size_t outbytes; // bytes of queued requests not yet sent
+	size_t outpos; // offset in the request of the next byte to send
+} olconn_t;
+
+void *openloop(void *arg) {
+	worker_t *w = arg;
+	dbg.m(DBG_TAG, "thread %zu started: %zu connections, %.1f rps", w->id, w->nconns, w->rate);
+
+	olconn_t *cc = calloc!(w->nconns, sizeof(olconn_t));
+	pollfd_t *pp = calloc!(w->nconns, sizeof(pollfd_t));
+	for (size_t i = 0; i < w->nconns; i++) {
+		cc[i].queue = calloc!(depth, sizeof(int64_t));
+		cc[i].c = conn.open_nonblock(addr);
+	}
 
-	size_t i = 0;
+	int64_t start = time.ticks();
+	double interval = (double) time.SECONDS / w->rate;
+	size_t dispatched = 0;
+	size_t next = 0;
 	while (true) {
-		if (!threads.pread(pipe, NULL)) {
+		int64_t now = time.ticks();
+		if (timed && now >= deadline) {
 			break;
 		}
-		res->number = i;
-		res->time_started = time.now();
-		net.net_t *conn = net.connect("tcp", addr);
-		if (!conn) {
-			fprintf(stderr, "failed to connect to %s: %s\n", addr, strerror(errno));
+
+		// Put all due requests on the connections. If every pipeline is
+		// full, the requests wait and their latency keeps growing.
+		bool full = false;
+		while (timed || dispatched < w->quota) {
+			int64_t due = start + (int64_t) (dispatched * interval);
+			if (due > now) {
+				break;
+			}
+			olconn_t *oc = pick(w, cc, &next);
+			if (!oc) {
+				full = true;
+				break;
+			}
+			oc->queue[(oc->qstart + oc->qlen) % depth] = due;
+			oc->qlen++;
+			oc->outbytes += REQUESTLEN;
+			dispatched++;
+		}
+		if (!timed && dispatched == w->quota && inflight(cc, w->nconns) == 0) {
 			break;
 		}
-		res->time_connected = time.now();
-		if ((size_t) net.write(conn, (char *)REQUEST, REQUESTLEN) != REQUESTLEN) {
-			panic("failed to write request: %s", strerror(errno));
+
+		// Wait for events, but not past the time of the next request.
+		int timeout = 100;
+		if (!full && (timed || dispatched < w->quota)) {
+			int64_t due = start + (int64_t) (dispatched * interval);
+			timeout = (int) ((due - now) / time.MS);
+		}
+		if (timed && (deadline - now) / time.MS < timeout) {
+			timeout = (int) ((deadline - now) / time.MS);
 		}
-		res->total_sent = REQUESTLEN;
-		res->time_finished_writing = time.now();
-		int read = net.read(conn, resbytes, sizeof(resbytes));
-		if (read < 0) {
-			panic("read failed");
+		for (size_t i = 0; i < w->nconns; i++) {
+			olconn_t *oc = &cc[i];
+			pp[i].fd = -1;
+			pp[i].revents = 0;
+			if (!oc->c) continue;
+			pp[i].fd = conn.fd(oc->c);
+			pp[i].events = OS.POLLIN;
+			if (oc->outbytes > 0) {
+				pp[i].events |= OS.POLLOUT;
+			}
 		}
-		if ((size_t) read == sizeof(resbytes)) {
-			panic("read buffer too small");
+		if (OS.poll(pp, w->nconns, timeout) < 0 && errno != OS.EINTR) {
+			panic("poll failed: %s", strerror(errno));
 		}
-		resbytes[read] = '\0';
-		res->time_finished_reading = time.now();
-		res->total_received = read;
-		net.close(conn);
-		http.response_t r = {};
-		reader.t *re = reader.string(resbytes);
-		if (!http.parse_response(re, &r)) {
-			panic("failed to parse http response");
+		for (size_t i = 0; i < w->nconns; i++) {
+			if (pp[i].revents != 0) {
+				handle(w, &cc[i], pp[i].revents);
+			}
 		}
-		reader.free(re);
-		res->status = r.status;
-		print_result(res);
+	}
 
-		i++;
+	for (size_t i = 0; i < w->nconns; i++) {
+		if (cc[i].c) {
+			conn.close(cc[i].c);
+		}
+		free(cc[i].queue);
 	}
+	free(cc);
+	free(pp);
 	return NULL;
 }
 
-typedef {
-	size_t worker_id;
-	size_t number;
-	time.iso_t time_started;
-	time.iso_t time_connected;
-	time.iso_t time_finished_writing;
-	time.iso_t time_finished_reading;
-	int status;
-	size_t total_received;
-	size_t total_sent;
-} result_t;
-
-void print_result_header() {
-	printf("#\tstatus\tconnecting_ms\tsending_ms\treceiving_ms\ttotaltime_ms\tsent_bytes\treceived_bytes\n");
+// Returns the next connection in round-robin order that has room in its
+// pipeline, reconnecting dropped connections on the way.
+// Returns NULL if all pipelines are full.
+olconn_t *pick(worker_t *w, olconn_t *cc, size_t *next) {
+	for (size_t k = 0; k < w->nconns; k++) {
+		olconn_t *oc = &cc[*next];
+		*next = (*next + 1) % w->nconns;
+		if (!oc->c) {
+			reconnect(w, oc);
+			if (!oc->c) continue;
+		}
+		if (oc->qlen < depth) {
+			return oc;
+		}
+	}
+	return NULL;
+}
+
+size_t inflight(olconn_t *cc, size_t n) {
+	size_t sum = 0;
+	for (size_t i = 0; i < n; i++) {
+		sum += cc[i].qlen;
+	}
+	return sum;
+}
+
+void handle(worker_t *w, olconn_t *oc, int revents) {
+	if (revents & OS.POLLOUT) {
+		if (!flush(oc)) {
+			reconnect(w, oc);
+			return;
+		}
+	}
+	if ((revents & (OS.POLLIN | OS.POLLHUP | OS.POLLERR)) == 0) {
+		return;
+	}
+	int n = conn.recv(oc->c);
+	if (n < 0 && errno == OS.EAGAIN) {
+		return;
+	}
+	conn.response_t r = {};
+	if (n == 0 && conn.finish(oc->c, &r)) {
+		complete(w, oc, &r);
+	}
+	if (n <= 0) {
+		reconnect(w, oc);
+		return;
+	}
+	while (true) {
+		int p = conn.parse(oc->c, &r);
+		if (p == 0) {
+			return;
+		}
+		if (p < 0) {
+			oc->answered = false;
+			reconnect(w, oc);
+			return;
+		}
+		complete(w, oc, &r);
+		if (!r.keepalive) {
+			reconnect(w, oc);
+			return;
+		}
+	}
+}
+
+void complete(worker_t *w, olconn_t *oc, conn.response_t *r) {
+	if (oc->qlen == 0) {
+		// A response to nothing.
+		w->errors++;
+		return;
+	}
+	int64_t t0 = oc->queue[oc->qstart];
+	oc->qstart = (oc->qstart + 1) % depth;
+	oc->qlen--;
+	oc->answered = true;
+	record(w, r, t0);
 }
 
-void print_result(result_t *res) {
-	threads.lock(stdout_lock);
-	int64_t conn = time.sub(res->time_connected, res->time_started);
-	int64_t write = time.sub(res->time_finished_writing, res->time_started);
-	int64_t read = time.sub(res->time_finished_reading, res->time_finished_writing);
-	int64_t total = time.sub(res->time_finished_reading, res->time_started);
-	printf("%zu/%zu\t", res->worker_id, res->number);
-	printf("%d\t", res->status);
-	printf("%ld\t", conn);
-	printf("%ld\t", write);
-	printf("%ld\t", read);
-	printf("%ld\t", total);
-	printf("%zu\t", res->total_sent);
-	printf("%zu\n", res->total_received);
-	threads.unlock(stdout_lock);
-}
\ No newline at end of file
+// Sends as much of the queued requests as the socket accepts.
+// Returns false on a connection error.
+bool flush(olconn_t *oc) {
+	while (oc->outbytes > 0) {
+		// All requests are the same, so the queue is sent from the
+		// batch buffer starting at the current request offset.
+		size_t n = depth * REQUESTLEN - oc->outpos;
+		if (n > oc->outbytes) {
+			n = oc->outbytes;
+		}
+		int r = conn.send(oc->c, BATCH + oc->outpos, n);
+		if (r < 0) {
+			return errno == OS.EAGAIN;
+		}
+		oc->outbytes -= (size_t) r;
+		oc->outpos = (oc->outpos + (size_t) r) % REQUESTLEN;
+	}
+	return true;
+}
+
+// Replaces a closed or broken connection and queues the unanswered
+// requests for resending. If the connection produced no responses at all,
+// its requests are counted as errors instead, so that a dead server
+// doesn't make the client retry forever.
+void reconnect(worker_t *w, olconn_t *oc) {
+	if (oc->c) {
+		conn.close(oc->c);
+	}
+	if (!oc->answered) {
+		w->errors += oc->qlen;
+		oc->qlen = 0;
+	}
+	oc->answered = false;
+	oc->outbytes = oc->qlen * REQUESTLEN;
+	oc->outpos = 0;
+	oc->c = conn.open_nonblock(addr);
+	if (!oc->c) {
+		w->errors += oc->qlen;
+		oc->qlen = 0;
+		oc->outbytes = 0;
+	}
+}
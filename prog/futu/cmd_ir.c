@@ -43,44 +43,50 @@ void writeclip(char *path, sound.clip_t *c) {
 sound.clip_t *fft_convolve(sound.clip_t *x, *h) {
     size_t Ny = x->nsamples + h->nsamples - 1;
     size_t Nfft = next_pow2(Ny);
+	if (Nfft < 2) Nfft = 2; // real transforms need an even size
 
 	printf("starting fft\n");
-    fft.kiss_fft_state_t *cfg = fft.kiss_fft_alloc(Nfft, 0, NULL, NULL);
-	fft.kiss_fft_state_t *icfg = fft.kiss_fft_alloc(Nfft, 1, NULL, NULL);
+	fft.rplan_t *fwd = fft.rplan(Nfft, false);
+	fft.rplan_t *inv = fft.rplan(Nfft, true);
+	size_t nbins = Nfft / 2 + 1;
 
 	printf("fft x...\n");
-    complex.t *X = calloc!(Nfft, sizeof(complex.t));
+	double *xs = calloc!(Nfft, sizeof(double));
 	for (size_t i = 0; i < x->nsamples; i++) {
-		X[i].re = x->samples[i].left;
+		xs[i] = x->samples[i].left;
 	}
-	fft.kiss_fft(cfg, X, X);
+	complex.t *X = calloc!(nbins, sizeof(complex.t));
+	fft.rfft(fwd, xs, X);
 
 	printf("fft h...\n");
-    complex.t *H = calloc!(Nfft, sizeof(complex.t));
+	double *hs = calloc!(Nfft, sizeof(double));
 	for (size_t i = 0; i < h->nsamples; i++) {
-		H[i].re = h->samples[i].left;
+		hs[i] = h->samples[i].left;
 	}
-	fft.kiss_fft(cfg, H, H);
+	complex.t *H = calloc!(nbins, sizeof(complex.t));
+	fft.rfft(fwd, hs, H);
 
 	printf("multiplying...\n");
-    complex.t *Y = calloc!(Nfft, sizeof(complex.t));
-    for (size_t i = 0; i < Nfft; i++) {
+	complex.t *Y = calloc!(nbins, sizeof(complex.t));
+	for (size_t i = 0; i < nbins; i++) {
 		Y[i] = complex.mul(X[i], H[i]);
-    }
+	}
 
 	printf("inverse fft...\n");
-    fft.kiss_fft(icfg, Y, Y);
+	double *ys = calloc!(Nfft, sizeof(double));
+	fft.irfft(inv, Y, ys);
 
-    // Extract real part, scale by Nfft
+    // Scale by Nfft
 	sound.clip_t *r = sound.newclip(44100);
     for (size_t i = 0; i < Ny; i++) {
-		double v = Y[i].re / Nfft;
+		double v = ys[i] / Nfft;
 		sound.samplef_t s = { v, v };
 		sound.push_sample(r, s);
     }
 
-    free(cfg);
-    free(icfg);
+    free(xs);
+    free(hs);
+    free(ys);
     free(X);
     free(H);
     free(Y);
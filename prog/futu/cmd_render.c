@@ -39,9 +39,12 @@ pub int run(int argc, char *argv[]) {
 	cmpinit(&c, path, trackname);
 
 	wav.writer_t *out = wav.open_writer(stdout);
-	sound.samplef_t s = {};
-	while (cmpnext(&c, &s)) {
-		wav.write_sample(out, s.left, s.right);
+	float left[MIXBLOCK] = {};
+	float right[MIXBLOCK] = {};
+	while (true) {
+		size_t n = cmpblock(&c, left, right, MIXBLOCK);
+		if (n == 0) break;
+		wav.write_block(out, left, right, n);
 	}
 	wav.close_writer(out);
 
@@ -49,11 +52,16 @@ pub int run(int argc, char *argv[]) {
 	return 0;
 }
 
+// Frames mixed at a time.
+#define MIXBLOCK 256
+
 typedef {
 	uint8_t key;
 	size_t t1, t2; // begin and end time in pcm ticks (1/44100 s)
+	size_t end; // when the sound stops: t2 or the end of the samples
 	sound.samplef_t *samples;
 	size_t nsamples;
+	size_t nextopen; // 1 + index of the next open range with the same key
 } range_t;
 
 typedef {
@@ -129,8 +137,11 @@ clip_t *addclip(sound.clip_t *sc, uint8_t key) {
 typedef {
 	size_t nranges;
 	size_t tmax;
-	size_t i;
-	vec.t *ranges;
+	size_t i; // next output frame
+	vec.t *ranges; // in the order of start times
+	size_t nextrange; // first range that hasn't started yet
+	size_t *active; // ranges that sound at frame i, in the order of ranges
+	size_t nactive;
 } composer_t;
 
 void cmpinit(composer_t *c, const char *path, *trackname) {
@@ -156,6 +167,13 @@ void cmpinit(composer_t *c, const char *path, *trackname) {
 
 	c->ranges = vec.new(sizeof(range_t));
 
+	// Open ranges for every key as queues of 1 + range index,
+	// so that a note off closes the oldest one.
+	size_t firstopen[128] = {};
+	size_t lastopen[128] = {};
+
+	// The events are sorted by time, so the ranges come out sorted by
+	// their start.
 	while (true) {
 		midilib.event_t *e = next(&r);
 		if (!e) break;
@@ -163,31 +181,35 @@ void cmpinit(composer_t *c, const char *path, *trackname) {
 
 		switch (e->type) {
 			case midilib.NOTE_ON: {
+				size_t id = vec.len(c->ranges) + 1;
 				range_t *r = vec.alloc(c->ranges);
 				r->t1 = e->t_us * 44100 / 1000000;
 				r->key = e->key;
-				clip_t *c = get_clip(e->key);
-				if (!c) {
+				clip_t *clip = get_clip(e->key);
+				if (!clip) {
 					fprintf(stderr, "no clip for key %u\n", e->key);
 				} else {
-					r->samples = c->clip->samples;
-					r->nsamples = c->clip->nsamples;
+					r->samples = clip->clip->samples;
+					r->nsamples = clip->clip->nsamples;
+				}
+				if (lastopen[e->key]) {
+					range_t *last = vec.index(c->ranges, lastopen[e->key] - 1);
+					last->nextopen = id;
+				} else {
+					firstopen[e->key] = id;
 				}
+				lastopen[e->key] = id;
 			}
 			case midilib.NOTE_OFF: {
-				// Find the first unclosed matching range.
-				range_t *r = NULL;
-				size_t nranges = vec.len(c->ranges);
-				for (size_t i = 0; i < nranges; i++) {
-					range_t *x = vec.index(c->ranges, i);
-					if (x->key == e->key && x->t2 == 0) {
-						r = x;
-						break;
-					}
-				}
-				if (!r) {
+				size_t id = firstopen[e->key];
+				if (!id) {
 					panic("failed to find the open range to close");
 				}
+				range_t *r = vec.index(c->ranges, id - 1);
+				firstopen[e->key] = r->nextopen;
+				if (!r->nextopen) {
+					lastopen[e->key] = 0;
+				}
 				r->t2 = e->t_us * 44100 / 1000000;
 				size_t tlen = r->t2 - r->t1;
 				if (r->nsamples > tlen) {
@@ -207,31 +229,68 @@ void cmpinit(composer_t *c, const char *path, *trackname) {
 		if (r->t2 > tmax) {
 			tmax = r->t2;
 		}
+		// A range that was never closed stays silent.
+		r->end = r->t1;
+		if (r->t2 > r->t1) {
+			r->end = r->t1 + r->nsamples;
+			if (r->end > r->t2) r->end = r->t2;
+		}
 	}
 	c->tmax = tmax;
+	c->active = calloc!(c->nranges + 1, sizeof(size_t));
 }
 
-bool cmpnext(composer_t *c, sound.samplef_t *s) {
-	if (c->i == c->tmax) return false;
-	// This is a brute-force scan from 0 to the max time,
-	// where for each time instant we query all ranges.
-	double left = 0;
-	double right = 0;
-	for (size_t j = 0; j < c->nranges; j++) {
-		range_t *r = vec.index(c->ranges, j);
-		if (c->i < r->t1 || c->i >= r->t2) continue;
-		size_t pos = c->i - r->t1;
-		if (pos >= r->nsamples) continue;
-		left += r->samples[pos].left;
-		right += r->samples[pos].right;
+// Mixes up to n (at most MIXBLOCK) next frames into left and right.
+// Returns the number of frames mixed, 0 at the end.
+size_t cmpblock(composer_t *c, float *left, *right, size_t n) {
+	if (c->i >= c->tmax) return 0;
+	if (n > MIXBLOCK) n = MIXBLOCK;
+	if (n > c->tmax - c->i) n = c->tmax - c->i;
+	size_t t1 = c->i;
+	size_t t2 = t1 + n;
+
+	// Start the ranges that begin within the block.
+	while (c->nextrange < c->nranges) {
+		range_t *r = vec.index(c->ranges, c->nextrange);
+		if (r->t1 >= t2) break;
+		if (r->end > r->t1) {
+			c->active[c->nactive++] = c->nextrange;
+		}
+		c->nextrange++;
 	}
-	s->left = left;
-	s->right = right;
-	c->i++;
-	return true;
-}
 
+	// Add up the playing ranges, dropping those that end within the
+	// block. The sums go in the order of ranges, as they always did.
+	double suml[MIXBLOCK] = {};
+	double sumr[MIXBLOCK] = {};
+	size_t keep = 0;
+	for (size_t j = 0; j < c->nactive; j++) {
+		range_t *r = vec.index(c->ranges, c->active[j]);
+		size_t from = t1;
+		if (r->t1 > from) from = r->t1;
+		size_t to = t2;
+		if (r->end < to) to = r->end;
+		const sound.samplef_t *s = r->samples + (from - r->t1);
+		for (size_t k = from - t1; k < to - t1; k++) {
+			suml[k] += s->left;
+			sumr[k] += s->right;
+			s++;
+		}
+		if (r->end > t2) {
+			c->active[keep++] = c->active[j];
+		}
+	}
+	c->nactive = keep;
+
+	for (size_t k = 0; k < n; k++) {
+		left[k] = (float) suml[k];
+		right[k] = (float) sumr[k];
+	}
+	c->i = t2;
+	return n;
+}
 
 void cmpdone(composer_t *c) {
+	free(c->active);
 	free(c->ranges);
 }
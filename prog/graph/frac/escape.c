@@ -0,0 +1,122 @@
+// Escape-time kernels: they iterate a map for a row of points and return
+// the iteration at which every point escaped.
+//
+// Points are processed in groups of LANES. All points of a group are
+// iterated together in plain arrays with no branches inside the lane
+// loops, so that the C compiler can turn them into vector instructions.
+// Escaped points keep being iterated along with the others, but their
+// results are taken at the moment they escaped. A group stops as soon as
+// all its points have escaped.
+
+#define LANES 8
+
+// Iterates z = z^2 + c, starting at z = 0, for the n points
+// c = (cre[i], cim[i]). Puts into count[i] the number of iterations
+// after which |z| reached 2, or 0 if it didn't within maxit iterations,
+// and into amp[i] the |z| at that moment.
+pub void mandelbrot(const double *cre, *cim, int n, maxit, int *count, double *amp) {
+	for (int start = 0; start < n; start += LANES) {
+		int k = n - start;
+		if (k > LANES) k = LANES;
+		mandelbrot_group(cre + start, cim + start, k, maxit, count + start, amp + start);
+	}
+}
+
+void mandelbrot_group(const double *cre, *cim, int n, maxit, int *count, double *amp) {
+	double cr[LANES] = {};
+	double ci[LANES] = {};
+	double zr[LANES] = {};
+	double zi[LANES] = {};
+	double zr2[LANES] = {};
+	double zi2[LANES] = {};
+	int inside[LANES] = {}; // 1 while the point hasn't escaped
+	int left = 0;
+	for (int l = 0; l < n; l++) {
+		count[l] = 0;
+		if (!interior(cre[l], cim[l])) {
+			cr[l] = cre[l];
+			ci[l] = cim[l];
+			inside[l] = 1;
+			left++;
+		}
+	}
+	for (int it = 1; it <= maxit && left > 0; it++) {
+		for (int l = 0; l < LANES; l++) {
+			double re = zr2[l] - zi2[l] + cr[l];
+			double im = zr[l] * zi[l] + zr[l] * zi[l] + ci[l];
+			zr[l] = re;
+			zi[l] = im;
+			zr2[l] = re * re;
+			zi2[l] = im * im;
+		}
+		for (int l = 0; l < n; l++) {
+			if (inside[l] && zr2[l] + zi2[l] >= 4) {
+				inside[l] = 0;
+				count[l] = it;
+				amp[l] = sqrt(zr2[l] + zi2[l]);
+				left--;
+			}
+		}
+	}
+}
+
+// Tells whether c is inside the main cardioid or the period-2 bulb,
+// where the iteration is known never to escape.
+bool interior(double re, im) {
+	double x = re - 0.25;
+	double y2 = im * im;
+	double q = x * x + y2;
+	if (q * (q + x) <= 0.25 * y2) {
+		return true;
+	}
+	double x1 = re + 1;
+	return x1 * x1 + y2 <= 0.0625;
+}
+
+// Iterates z = l * z * (1 - z), starting at z = (zre[i], zim[i]), for n
+// points. Puts into count[i] the number of iterations after which |z|
+// reached max, or maxit if it didn't.
+pub void lambda(const double *zre, *zim, int n, double lre, lim, max, int maxit, int *count) {
+	for (int start = 0; start < n; start += LANES) {
+		int k = n - start;
+		if (k > LANES) k = LANES;
+		lambda_group(zre + start, zim + start, k, lre, lim, max, maxit, count + start);
+	}
+}
+
+void lambda_group(const double *zre, *zim, int n, double lre, lim, max, int maxit, int *count) {
+	double zr[LANES] = {};
+	double zi[LANES] = {};
+	int inside[LANES] = {};
+	double max2 = max * max;
+	int left = 0;
+	for (int l = 0; l < n; l++) {
+		zr[l] = zre[l];
+		zi[l] = zim[l];
+		count[l] = maxit;
+		if (zr[l] * zr[l] + zi[l] * zi[l] < max2) {
+			inside[l] = 1;
+			left++;
+		} else {
+			count[l] = 0;
+		}
+	}
+	for (int it = 1; it <= maxit && left > 0; it++) {
+		for (int l = 0; l < LANES; l++) {
+			// t = l * z, z = t * (1 - z)
+			double tr = lre * zr[l] - lim * zi[l];
+			double ti = lre * zi[l] + zr[l] * lim;
+			double ur = 1 - zr[l];
+			double ui = 0 - zi[l];
+			zr[l] = tr * ur - ti * ui;
+			zi[l] = tr * ui + ur * ti;
+		}
+		for (int l = 0; l < n; l++) {
+			if (inside[l] && zr[l] * zr[l] + zi[l] * zi[l] >= max2) {
+				inside[l] = 0;
+				count[l] = it;
+				left--;
+			}
+		}
+	}
+}
@@ -1,5 +1,5 @@
+#import escape.c
 #import image
-#import math/complex
 
 typedef {
 	double max;
@@ -22,6 +22,11 @@ pub void mutateparams(void *state) {
 }
 
 pub void draw(image.image_t *img, void *state) {
+	drawtile(img, state, 0, 0, img->width, img->height);
+}
+
+// Draws the part [x0, x1) x [y0, y1) of the frame.
+pub void drawtile(image.image_t *img, void *state, int x0, y0, x1, y1) {
 	params_t *p = state;
 	double max = p->max;
 	int it = p->it;
@@ -30,26 +35,25 @@ pub void draw(image.image_t *img, void *state) {
 
 	int mx = img->width / 2;
 	int my = img->height / 2;
-	for (int x = -mx; x <= mx; x++) {
-		for (int y = -my; y <= my; y++) {
-			complex.t z = {x * 0.01, y * 0.01};
-			complex.t l = {l_re, l_im};
-			int k = 0;
-			while (k < it && complex.abs(z) < max) {
-				complex.t tmp = complex.mul(l, z);
-				tmp = complex.mul(tmp, complex.diff(complex.make(1, 0), z));
-				z = tmp;
-				k++;
-			}
+	int n = x1 - x0;
+	double *zre = calloc!(n, sizeof(double));
+	double *zim = calloc!(n, sizeof(double));
+	int *count = calloc!(n, sizeof(int));
+	for (int iy = y0; iy < y1; iy++) {
+		for (int i = 0; i < n; i++) {
+			zre[i] = (x0 + i - mx) * 0.01;
+			zim[i] = (iy - my) * 0.01;
+		}
+		escape.lambda(zre, zim, n, l_re, l_im, max, it, count);
+		for (int i = 0; i < n; i++) {
+			int k = count[i];
 			if (k < it) {
-				int ix = mx + x;
-				int iy = my + y;
-				if (ix >= 0 && ix < img->width && iy >= 0 && iy < img->height) {
-					// k is in [2..34]
-					int val = (k % 16);
-					image.set(img, mx+x, my+y, image.gray(val * 16));
-				}
+				int val = (k % 16);
+				image.set(img, x0 + i, iy, image.gray(val * 16));
 			}
 		}
 	}
+	free(zre);
+	free(zim);
+	free(count);
 }
@@ -1,5 +1,5 @@
+#import escape.c
 #import image
-#import math/complex
 
 // The Mandelbrot set is based on the function
 //
@@ -66,6 +66,11 @@ pub void mutateparams(void *state) {
 pub typedef { double xmin, xmax, ymin, ymax; } area_t;
 
 pub void draw(image.image_t *img, void *state) {
+	drawtile(img, state, 0, 0, img->width, img->height);
+}
+
+// Draws the part [x0, x1) x [y0, y1) of the frame.
+pub void drawtile(image.image_t *img, void *state, int x0, y0, x1, y1) {
 	params_t *p = state;
 	area_t a = {
 		.xmin = p->zoomx - p->hw,
@@ -78,31 +83,29 @@ pub void draw(image.image_t *img, void *state) {
 	int height = img->height;
 	double xres = (a.xmax - a.xmin) / width;
 	double yres = (a.ymax - a.ymin) / height;
-	for (int j = 0; j < height; j++) {
-		for (int i = 0; i < width; i++) {
-			complex.t c = {
-				.re = a.xmin + i * xres,
-				.im = a.ymin + j * yres
-			};
-			double v = get_val(c, p->iterations);
-			*image.getpixel(img, i, j) = image.mapcolor(p->cm, v);
+	int n = x1 - x0;
+	double *cre = calloc!(n, sizeof(double));
+	double *cim = calloc!(n, sizeof(double));
+	int *count = calloc!(n, sizeof(int));
+	double *amp = calloc!(n, sizeof(double));
+	for (int j = y0; j < y1; j++) {
+		for (int i = 0; i < n; i++) {
+			cre[i] = a.xmin + (x0 + i) * xres;
+			cim[i] = a.ymin + j * yres;
+		}
+		escape.mandelbrot(cre, cim, n, p->iterations, count, amp);
+		for (int i = 0; i < n; i++) {
+			double v = 0;
+			if (count[i] > 0) {
+				v = smooth((double) count[i], amp[i]);
+			}
+			image.set(img, x0 + i, j, image.mapcolor(p->cm, v));
 		}
 	}
-}
-
-double get_val(complex.t c, int it) {
-	complex.t z = { 0, 0 };
-
-	int count = 0;
-	while (complex.abs2(z) < 4 && count < it) {
-		/* Z = Z^2 + C */
-		z = complex.sum( complex.mul(z, z), c );
-		count++;
-	}
-	if (complex.abs2(z) < 4) {
-		return 0;
-	}
-	return smooth((double) count, complex.abs(z));
+	free(cre);
+	free(cim);
+	free(count);
+	free(amp);
 }
 
 double smooth(double count, double amp) {
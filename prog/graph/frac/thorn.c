@@ -20,6 +20,11 @@ pub void mutateparams(void *state) {
 
 // Draws thorn in the given image.
 pub void draw(image.image_t *img, void *state) {
+	drawtile(img, state, 0, 0, img->width, img->height);
+}
+
+// Draws the part [x0, x1) x [y0, y1) of the frame.
+pub void drawtile(image.image_t *img, void *state, int x0, y0, x1, y1) {
 	params_t *p = state;
     double xmin = -M_PI;
     double xmax =  M_PI;
@@ -27,10 +32,10 @@ pub void draw(image.image_t *img, void *state) {
     double ymax =  M_PI;
 	int width = img->width;
 	int height = img->height;
-    for (int i = 0; i < width; i++) {
+    for (int i = x0; i < x1; i++) {
         // map i=[0..width] to zr=[xmin..xmax]
         double zr = xmin + i * (xmax - xmin) / width;
-        for (int j = 0; j < height; j++) {
+        for (int j = y0; j < y1; j++) {
             // map j=[0..height] to zi=[ymin..ymax]
             double zi = ymin + j * (ymax - ymin) / height;
 			double val = get_sample(p->ci, p->cr, zi, zr);
@@ -13,7 +13,9 @@
 #import frac/thorn.c
 #import image
 #import opt
+#import os/self
 #import render.c
+#import tiles.c
 
 typedef void *newparams_func_t();
 typedef void draw_func_t(image.image_t *, void *);
@@ -24,30 +26,33 @@ typedef {
 	newparams_func_t *newparams;
 	draw_func_t *draw;
 	mutate_func_t *mutate;
+	tiles.tilefunc_t *drawtile; // draws a part of the frame, if the model can
 } model_t;
 
 model_t models[] = {
 	{.name = "dejong",       .newparams = dejong.newparams,       .draw = dejong.draw,       .mutate = dejong.mutateparams},
 	{.name = "henon",        .newparams = henon.newparams,        .draw = henon.draw,        .mutate = henon.mutateparams},
 	{.name = "ikeda",        .newparams = ikeda.newparams,        .draw = ikeda.draw,        .mutate = ikeda.mutateparams},
-	{.name = "mandelbrot", .newparams = mandelbrot.newparams,   .draw = mandelbrot.draw,   .mutate = mandelbrot.mutateparams},
+	{.name = "mandelbrot", .newparams = mandelbrot.newparams,   .draw = mandelbrot.draw,   .mutate = mandelbrot.mutateparams, .drawtile = mandelbrot.drawtile},
 	{.name = "pickover",     .newparams = pickover.newparams,     .draw = pickover.draw,     .mutate = pickover.mutateparams},
 	{.name = "dendrite",     .newparams = dendrite.newparams,     .draw = dendrite.draw,     .mutate = dendrite.mutateparams},
 	{.name = "diamondsquare", .newparams = diamondsquare.newparams, .draw = diamondsquare.draw, .mutate = diamondsquare.mutateparams},
 	{.name = "dynamic",      .newparams = dynamic.newparams,      .draw = dynamic.draw,      .mutate = dynamic.mutateparams},
 	{.name = "frothy",       .newparams = frothy.newparams,       .draw = frothy.draw,       .mutate = frothy.mutateparams},
  	{.name = "gingerbread", .newparams = gingerbread.newparams, .draw = gingerbread.draw, .mutate = gingerbread.mutateparams},
-	{.name = "lambda",       .newparams = lambda.newparams,       .draw = lambda.draw,       .mutate = lambda.mutateparams},
+	{.name = "lambda",       .newparams = lambda.newparams,       .draw = lambda.draw,       .mutate = lambda.mutateparams,     .drawtile = lambda.drawtile},
 	{.name = "martin",       .newparams = martin.newparams,       .draw = martin.draw,       .mutate = martin.mutateparams},
-	{.name = "thorn",        .newparams = thorn.newparams,        .draw = thorn.draw,        .mutate = thorn.mutateparams},
+	{.name = "thorn",        .newparams = thorn.newparams,        .draw = thorn.draw,        .mutate = thorn.mutateparams,      .drawtile = thorn.drawtile},
 };
 
 int main(int argc, char *argv[]) {
 	char *size = "400x400";
 	bool ffade = false;
+	size_t nthreads = (size_t) self.ncpus();
 	opt.nargs(1, "<algorithm = thorn / pickover / dejong / ikeda / mandelbrot / ...>");
 	opt.str("s", "image size", &size);
 	opt.flag("f", "fade effect", &ffade);
+	opt.size("j", "number of drawing threads", &nthreads);
 	char **args = opt.parse(argc, argv);
 
 	int width;
@@ -59,8 +64,6 @@ int main(int argc, char *argv[]) {
 
 	const int FRAMES = 1000;
 
-	image.image_t *img = image.new(width, height);
-
 	bool found = false;
 	model_t m = {};
 	for (size_t i = 0; i < nelem(models); i++) {
@@ -76,20 +79,30 @@ int main(int argc, char *argv[]) {
 	}
 
 	void *p = m.newparams();
+	tiles.pool_t *pool = tiles.newpool(nthreads);
+	render.start(width, height);
+	image.image_t *prev = NULL;
 	for (int i = 0; i < FRAMES; i++) {
 		// fprintf(stderr, "%d / %d\n", i, FRAMES);
-		if (ffade) {
+		image.image_t *img = render.next();
+		if (ffade && prev) {
+			image.copy(img, prev);
 			image.apply(img, fade);
 		} else {
 			image.clear(img);
 		}
-		m.draw(img, p);
-		render.push(img);		
+		if (m.drawtile) {
+			tiles.draw(pool, m.drawtile, img, p);
+		} else {
+			m.draw(img, p);
+		}
+		render.push(img);
+		prev = img;
 		m.mutate(p);
 	}
 	free(p);
 	render.end();
-	image.free(img);
+	tiles.freepool(pool);
 	return 0;
 }
 
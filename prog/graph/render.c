@@ -1,15 +1,60 @@
 #import formats/avi
 #import image
+#import os/threads
+
+// Frames are encoded on a separate thread, so that the next frame can be
+// drawn while the previous one is being written out. Two frame buffers
+// take turns: one is drawn on while the other is encoded.
 
 avi.writer_t *vid = NULL;
+threads.pipe_t *full = NULL; // frames waiting to be encoded
+threads.pipe_t *empty = NULL; // frames that can be drawn on
+threads.thr_t *encoder = NULL;
+
+// Starts the output video.
+pub void start(int width, height) {
+	full = threads.newpipe();
+	empty = threads.newpipe();
+	for (int i = 0; i < 2; i++) {
+		threads.pwrite(empty, image.new(width, height));
+	}
+	vid = avi.start(stdout, width, height, 10);
+	encoder = threads.start(&encode, NULL);
+}
+
+// Returns a frame buffer to draw the next frame on, waiting until one is
+// free. The buffer still has an old frame in it.
+pub image.image_t *next() {
+	void *img = NULL;
+	threads.pread(empty, &img);
+	return img;
+}
 
+// Queues a frame returned by next for encoding.
 pub void push(image.image_t *img) {
-	if (!vid) {
-		vid = avi.start(stdout, img->width, img->height, 10);
+	threads.pwrite(full, img);
+}
+
+void *encode(void *arg) {
+	(void) arg;
+	void *img = NULL;
+	while (threads.pread(full, &img)) {
+		avi.addframe(vid, img);
+		threads.pwrite(empty, img);
 	}
-	avi.addframe(vid, img);
+	return NULL;
 }
 
+// Encodes the remaining frames and finishes the video.
 pub void end() {
+	threads.pclose(full);
+	threads.wait(encoder, NULL);
 	avi.stop(vid);
-}
\ No newline at end of file
+	threads.pclose(empty);
+	void *img = NULL;
+	while (threads.pread(empty, &img)) {
+		image.free(img);
+	}
+	threads.freepipe(full);
+	threads.freepipe(empty);
+}
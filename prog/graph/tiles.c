@@ -0,0 +1,133 @@
+#import image
+#import os/threads
+
+// Parallel drawing: a frame is cut into square tiles, and a pool of
+// threads draws them. Every thread takes the next tile from a shared
+// counter, so the threads that get cheap tiles simply take more of them.
+
+#define TILESIZE 32
+
+// Function that draws the part [x0, x1) x [y0, y1) of a frame.
+pub typedef void tilefunc_t(image.image_t *, void *, int, int, int, int); // img, state, x0, y0, x1, y1
+
+pub typedef {
+	threads.mtx_t *lock;
+	threads.cnd_t *changed; // signalled on a new frame and on the last tile of a frame
+	threads.thr_t **workers;
+	size_t nworkers;
+	bool quit;
+
+	// The frame being drawn.
+	int frame; // incremented on every frame
+	tilefunc_t *f;
+	image.image_t *img;
+	void *state;
+	int cols, ntiles;
+	int next; // next tile to draw
+	int done; // number of tiles drawn
+} pool_t;
+
+// Creates a pool that draws on nthreads threads, including the thread
+// calling draw.
+pub pool_t *newpool(size_t nthreads) {
+	pool_t *p = calloc!(1, sizeof(pool_t));
+	p->lock = threads.mtx_new();
+	p->changed = threads.cnd_new();
+	if (nthreads > 1) {
+		p->nworkers = nthreads - 1;
+		p->workers = calloc!(p->nworkers, sizeof(threads.thr_t *));
+		for (size_t i = 0; i < p->nworkers; i++) {
+			p->workers[i] = threads.start(&worker, p);
+		}
+	}
+	return p;
+}
+
+// Stops the threads and frees the pool.
+pub void freepool(pool_t *p) {
+	threads.lock(p->lock);
+	p->quit = true;
+	threads.wake_all(p->changed);
+	threads.unlock(p->lock);
+	for (size_t i = 0; i < p->nworkers; i++) {
+		threads.wait(p->workers[i], NULL);
+	}
+	free(p->workers);
+	threads.cnd_free(p->changed);
+	threads.mtx_free(p->lock);
+	free(p);
+}
+
+// Draws the whole img by calling f on every tile with the given state.
+// Returns when all tiles are drawn.
+pub void draw(pool_t *p, tilefunc_t *f, image.image_t *img, void *state) {
+	threads.lock(p->lock);
+	p->f = f;
+	p->img = img;
+	p->state = state;
+	p->cols = (img->width + TILESIZE - 1) / TILESIZE;
+	int rows = (img->height + TILESIZE - 1) / TILESIZE;
+	p->ntiles = p->cols * rows;
+	p->next = 0;
+	p->done = 0;
+	p->frame++;
+	threads.wake_all(p->changed);
+	threads.unlock(p->lock);
+
+	work(p);
+
+	threads.lock(p->lock);
+	while (p->done < p->ntiles) {
+		threads.unlock_wait_lock(p->lock, p->changed);
+	}
+	threads.unlock(p->lock);
+}
+
+// Draws tiles of the current frame until there are none left.
+void work(pool_t *p) {
+	while (true) {
+		threads.lock(p->lock);
+		if (p->next >= p->ntiles) {
+			threads.unlock(p->lock);
+			return;
+		}
+		int i = p->next++;
+		threads.unlock(p->lock);
+
+		// The frame can't change until this tile is done.
+		image.image_t *img = p->img;
+		int x0 = (i % p->cols) * TILESIZE;
+		int y0 = (i / p->cols) * TILESIZE;
+		int x1 = x0 + TILESIZE;
+		int y1 = y0 + TILESIZE;
+		if (x1 > img->width) x1 = img->width;
+		if (y1 > img->height) y1 = img->height;
+		p->f(img, p->state, x0, y0, x1, y1);
+
+		threads.lock(p->lock);
+		p->done++;
+		if (p->done == p->ntiles) {
+			threads.wake_all(p->changed);
+		}
+		threads.unlock(p->lock);
+	}
+}
+
+void *worker(void *arg) {
+	pool_t *p = arg;
+	int seen = 0;
+	threads.lock(p->lock);
+	while (true) {
+		if (p->quit) break;
+		if (p->frame == seen) {
+			threads.unlock_wait_lock(p->lock, p->changed);
+			continue;
+		}
+		seen = p->frame;
+		threads.unlock(p->lock);
+		work(p);
+		threads.lock(p->lock);
+	}
+	threads.unlock(p->lock);
+	return NULL;
+}
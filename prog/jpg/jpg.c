@@ -1,6 +1,7 @@
 #import formats/jpg
 #import formats/png
 #import image
+#import time
 
 int main(int argc, char *argv[]) {
 	if (argc == 1) {
@@ -8,6 +9,9 @@ int main(int argc, char *argv[]) {
 		drawbasis();
 		return 0;
 	}
+	if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+		return bench(argv[2]);
+	}
 	jpg.err_t err = {};
     jpg.jpeg_t *j = jpg.read(argv[1], &err);
 	if (err.set) {
@@ -19,6 +23,25 @@ int main(int argc, char *argv[]) {
 	return 0;
 }
 
+// Decodes the file several times and prints the average time.
+int bench(const char *path) {
+	const int N = 10;
+	int64_t t0 = time.ticks();
+	for (int i = 0; i < N; i++) {
+		jpg.err_t err = {};
+		jpg.jpeg_t *j = jpg.read(path, &err);
+		if (err.set) {
+			fprintf(stderr, "failed to parse image: %s\n", err.msg);
+			return 1;
+		}
+		image.free(j->img);
+		jpg.free(j);
+	}
+	double ms = (double) (time.ticks() - t0) / 1000 / N;
+	fprintf(stderr, "%s: %.1f ms per decode\n", path, ms);
+	return 0;
+}
+
 void drawbasis() {
 	image.image_t *img = image.new(64 + 9, 64 + 9);
     image.rgba_t red = {255, 0, 0, 0};
@@ -1,6 +1,8 @@
+#import compress/gzip
 #import formats/json
 #import linereader
 #import opt
+#import reader
 #import strings
 #import tty
 #import error
@@ -14,13 +16,24 @@ int main(int argc, char **argv) {
 	OS.setvbuf(stdout, NULL, OS._IOLBF, 0);
 
     char *exclude_string = "";
+	bool gz = false;
 	opt.nargs(0, "");
     opt.str("x", "comma-separated list of fields to exclude", &exclude_string);
+	opt.flag("z", "read gzip-compressed input", &gz);
     opt.parse(argc, argv);
 
     nexclude = strings.split(",", exclude_string, excludefields, sizeof(excludefields));
 
-    linereader.t *lr = linereader.new(stdin);
+	linereader.t *lr = NULL;
+	reader.t *in = NULL;
+	reader.t *gzin = NULL;
+	if (gz) {
+		in = reader.stdin();
+		gzin = gzip.reader(in);
+		lr = linereader.newreader(gzin);
+	} else {
+		lr = linereader.new(stdin);
+	}
 	error.t err = {};
     while (linereader.read(lr)) {
 		char *line = linereader.line(lr);
@@ -35,6 +48,18 @@ int main(int argc, char **argv) {
         json.json_free(entry);
     }
 	linereader.free(lr);
+	if (gz) {
+		// The message lives in the reader, so print it before freeing.
+		const char *err = gzip.error(gzin);
+		if (err) {
+			fprintf(stderr, "logfmt: %s\n", err);
+		}
+		reader.free(gzin);
+		reader.free(in);
+		if (err) {
+			return 1;
+		}
+	}
     return 0;
 }
 
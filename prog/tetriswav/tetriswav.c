@@ -31,8 +31,10 @@ int main() {
 
 void note(wav.writer_t *w, float freq, dur) {
 	int nsamples = (int) (RATE * dur);
+	float *v = calloc!(nsamples, sizeof(float));
 	for (int i = 0; i < nsamples; i++) {
-		float v = sinf((float) i * 2.0 * M_PI / RATE * freq);
-		wav.write_sample(w, v, v);
+		v[i] = sinf((float) i * 2.0 * M_PI / RATE * freq);
 	}
+	wav.write_block(w, v, v, nsamples);
+	free(v);
 }
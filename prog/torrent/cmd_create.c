@@ -1,20 +1,23 @@
-#import crypt/sha1
+#import files.c
 #import formats/torrent
 #import os/fs
 #import opt
+#import enc/hex
 
 const size_t PIECE_LENGTH = 256 * 1024;
 
 pub int run(int argc, char *argv[]) {
+    size_t nthreads = 1;
 	opt.nargs(2, "<file-to-share> <outfile>");
     opt.summary("Creates a torrent file.");
+    opt.size("j", "number of hashing threads", &nthreads);
     char **args = opt.parse(argc, argv);
     const char *filepath = args[0];
     const char *outpath = args[1];
 
     torrent.info_t *info = newtorrent();
 
-    if (!addfile(info, filepath)) {
+    if (!addfile(info, filepath, nthreads)) {
         fprintf(stderr, "could not add file %s: %s\n", filepath, strerror(errno));
         return 1;
     }
@@ -35,54 +38,37 @@ torrent.info_t *newtorrent() {
     return info;
 }
 
-bool addfile(torrent.info_t *info, const char *filepath) {
+bool addfile(torrent.info_t *info, const char *filepath, size_t nthreads) {
     const char *filename = fs.basename(filepath);
     strcpy(info->name, filename);
 
-    FILE *f = fopen(filepath, "rb");
-    if (!f) {
-        fprintf(stderr, "failed to open %s: %s\n", filepath, strerror(errno));
+    char dir[4096] = {};
+    if (!fs.dirname(filepath, dir, sizeof(dir))) {
         return false;
     }
-    uint8_t piece[PIECE_LENGTH];
-    size_t piecelen = 0;
-    size_t npieces = 0;
-
-    while (!feof(f)) {
-        int c = fgetc(f);
-        if (c == EOF) break;
-        if (piecelen == PIECE_LENGTH) {
-            addpiece(info, piece, piecelen, npieces++);
-            piecelen = 0;
-        }
-        piece[piecelen++] = c;
+    if (dir[0] == '\0') {
+        strcpy(dir, ".");
     }
-    if (piecelen > 0) {
-        addpiece(info, piece, piecelen, npieces++);
+    if (!fs.filesize(filepath, &info->length)) {
+        return false;
     }
-    fclose(f);
-    return true;
-}
 
-void addpiece(torrent.info_t *info, uint8_t *piece, size_t piecelen, size_t i) {
-    info->pieces = realloc(info->pieces, info->piece_length * (i+1));
-    if (!info->pieces) {
-        panic("realloc failed");
+    // The pieces are read and hashed in parallel, the hashes land
+    // in piece order.
+    size_t npieces = torrent.npieces(info);
+    info->pieces = calloc!(npieces + 1, 20);
+    if (!files.hash_pieces(dir, info, nthreads, info->pieces)) {
+        return false;
     }
-    sha1.digest_t hash = {};
-    for (size_t j = 0; j < piecelen; j++) {
-        sha1.add(&hash, piece[j]);
+    for (size_t i = 0; i < npieces; i++) {
+        char buf[41] = {};
+        char *p = buf;
+        for (size_t j = 0; j < 20; j++) {
+            p = hex.writebyte(info->pieces[i * 20 + j], p);
+        }
+        printf("piece %zu: %s\n", i, buf);
     }
-    sha1.end(&hash);
-
-    char buf[41] = {};
-    sha1.format(&hash, buf, sizeof(buf));
-    printf("piece %zu: %s\n", i, buf);
-
-    uint8_t *hashesp = info->pieces + i * 20;
-    sha1.as_bytes(&hash, hashesp);
-
-    info->length += piecelen;
+    return true;
 }
 
 bool writetorrent(torrent.info_t *info, const char *outpath) {
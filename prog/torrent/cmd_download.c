@@ -1,13 +1,21 @@
+#import files.c
 #import formats/torrent
 #import lib.c
 #import opt
 #import ioloop.c
 #import peer.c
+#import sched.c
 #import tracker.c
 
 pub int run(int argc, char **argv) {
+    size_t depth = 32;
+    char *resume = NULL;
+    bool self = false;
     opt.nargs(1, "<torrentfile>");
 	opt.summary("Downloads a torrent.");
+    opt.size("d", "number of outstanding block requests per peer", &depth);
+    opt.str("r", "bitfield file from verify -o with the pieces already downloaded", &resume);
+    opt.flag("s", "download from ourselves instead of the other peers, for testing", &self);
     char **args = opt.parse(argc, argv);
     const char *path = args[0];
 
@@ -21,50 +29,52 @@ pub int run(int argc, char **argv) {
 	lib.gen_id(peer_id);
 
     peer.init(tf, peer_id);
+    peer.init_download(depth);
+    if (resume) {
+        uint8_t *bits = files.load_bitfield(resume, tf);
+        if (!bits) {
+            fprintf(stderr, "failed to load %s: %s\n", resume, strerror(errno));
+            return 1;
+        }
+        peer.resume(bits);
+        free(bits);
+    }
 	tracker.init(tf, peer_id);
     ioloop.listen("localhost:6881", peer.handle);
     ioloop.connect("localhost:8000", tracker.process, NULL);
 
     bool started = false;
-    while (true) {
+    while (!sched.done()) {
 		if (!ioloop.process()) {
 			fprintf(stderr, "no connections to process\n");
 			return 1;
 		}
         if (!started && tracker.getstate()->peers_number > 0) {
 			started = true;
-            tracker.peer_entry_t p = choose_peer(peer_id);
-			char addr[1000] = {};
-			sprintf(addr, "%s:%d", p.ip, p.port);
-			printf("choosing peer %s\n", addr);
-            peer.init_t pi = { .foo = 123 };
-			ioloop.connect(addr, peer.handle, &pi);
+            connect_peers(peer_id, self);
 		}
 	}
+    printf("download complete\n");
     return 0;
 }
 
-const bool TEST = true;
-
-tracker.peer_entry_t choose_peer(uint8_t *peer_id) {
-    tracker.peer_entry_t p = {};
+// Connects to the peers from the tracker's response, so that blocks are
+// downloaded from all of them in parallel. With self set, connects only
+// to ourselves, which serves the files from the current directory.
+void connect_peers(uint8_t *peer_id, bool self) {
     tracker.tracker_response_t *_state = tracker.getstate();
     for (size_t i = 0; i < _state->peers_number; i++) {
         tracker.peer_entry_t *pi = &_state->peers[i];
         bool is_us = !memcmp(pi->id, peer_id, 20);
-        // Choose ourselves for testing.
-        if (TEST) {
-            if (is_us) {
-                memcpy(&p, pi, sizeof(tracker.peer_entry_t));
-                break;
-            }
+        if (is_us) {
+            if (!self) continue;
         } else {
-            if (!is_us && !strcmp(pi->ip, "127.0.0.1")) {
-                memcpy(&p, pi, sizeof(tracker.peer_entry_t));
-                break;
-            }
+            if (self) continue;
         }
-        
+        char addr[1000] = {};
+        sprintf(addr, "%s:%d", pi->ip, pi->port);
+        printf("connecting to peer %s\n", addr);
+        peer.init_t init = { .foo = 123 };
+        ioloop.connect(addr, peer.handle, &init);
     }
-    return p;
 }
@@ -7,8 +7,12 @@
 #import tracker.c
 
 pub int run(int argc, char **argv) {
+    size_t nthreads = 1;
+    char *resume = NULL;
     opt.nargs(1, "<torrentfile>");
 	opt.summary("Serves a torrent for others to download.");
+    opt.size("j", "number of hashing threads for the initial check", &nthreads);
+    opt.str("r", "bitfield file from verify -o to use instead of checking the pieces", &resume);
     char **args = opt.parse(argc, argv);
     const char *path = args[0];
 
@@ -18,13 +22,23 @@ pub int run(int argc, char **argv) {
         return 1;
     }
 
-    printf("checking pieces\n");
-    size_t npieces = torrent.npieces(tf);
-    for (size_t i = 0; i < npieces; i++) {
-        if (files.check_piece(".", tf, i)) {
-            printf("%zu: OK\n", i);
-        } else {
-            printf("%zu: mismatch\n", i);
+    uint8_t *bits = NULL;
+    if (resume) {
+        bits = files.load_bitfield(resume, tf);
+        if (!bits) {
+            fprintf(stderr, "failed to load %s: %s\n", resume, strerror(errno));
+            return 1;
+        }
+    } else {
+        printf("checking pieces\n");
+        bits = files.verify(".", tf, nthreads);
+        size_t npieces = torrent.npieces(tf);
+        for (size_t i = 0; i < npieces; i++) {
+            if (files.hasbit(bits, i)) {
+                printf("%zu: OK\n", i);
+            } else {
+                printf("%zu: mismatch\n", i);
+            }
         }
     }
 
@@ -32,6 +46,7 @@ pub int run(int argc, char **argv) {
 	lib.gen_id(peer_id);
 
     peer.init(tf, peer_id);
+    peer.set_seeding_bits(bits);
 	tracker.init(tf, peer_id);
     ioloop.listen("localhost:6881", peer.handle);
     ioloop.connect("localhost:8000", tracker.process, NULL);
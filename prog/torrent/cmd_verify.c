@@ -0,0 +1,46 @@
+#import files.c
+#import formats/torrent
+#import opt
+
+pub int run(int argc, char **argv) {
+    size_t nthreads = 1;
+    char *dir = ".";
+    char *outpath = NULL;
+    opt.nargs(1, "<torrentfile>");
+	opt.summary("Checks the torrent's data against its piece hashes.");
+    opt.size("j", "number of hashing threads", &nthreads);
+    opt.str("d", "directory with the data", &dir);
+    opt.str("o", "file to save the bitfield of good pieces to, for seed -r and download -r", &outpath);
+    char **args = opt.parse(argc, argv);
+    const char *path = args[0];
+
+    torrent.info_t *tf = torrent.from_file(path);
+    if (!tf) {
+        fprintf(stderr, "failed to load %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    uint8_t *bits = files.verify(dir, tf, nthreads);
+    size_t npieces = torrent.npieces(tf);
+    size_t good = 0;
+    for (size_t i = 0; i < npieces; i++) {
+        if (files.hasbit(bits, i)) {
+            good++;
+            putchar('1');
+        } else {
+            putchar('0');
+        }
+    }
+    putchar('\n');
+    printf("%zu of %zu pieces OK\n", good, npieces);
+
+    if (outpath && !files.save_bitfield(outpath, tf, bits)) {
+        fprintf(stderr, "failed to write %s: %s\n", outpath, strerror(errno));
+        return 1;
+    }
+    free(bits);
+    if (good < npieces) {
+        return 1;
+    }
+    return 0;
+}
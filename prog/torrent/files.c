@@ -3,8 +3,15 @@
 #import dbg
 #import formats/torrent
 #import lib.c
+#import os/fs
+#import os/threads
 #import strings
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#type off_t
+
 const char *DBG_TAG = "files";
 
 // All files in a torrent are glued together and then split into equal
@@ -16,50 +23,12 @@ pub typedef {
     uint32_t length; // how many bytes
 } range_t;
 
-// The protocol deals with pieces, but on disk we deal with files.
-// So piece ranges are converted to file ranges.
-// This is a slice in terms of files.
-pub typedef {
-    char path[1000];
-    size_t begin; // offset in the file
-    size_t length; // how many bytes
-} file_slice_t;
-
 pub typedef {
     char path[1000];
     size_t beginpos;
     size_t endpos;
 } file_t;
 
-// Convert a protocol's piece slice to a list of corresponding file slices.
-vec.t *map(torrent.info_t *tf, range_t s) {
-    vec.t *l = vec.new(sizeof(file_slice_t));
-
-    // Convert the slice s to torrent-global coordinates: [a, b).
-    size_t a = s.index * tf->piece_length + s.begin;
-    size_t b = a + s.length;
-
-    vec.t *files = get_file_list(tf);
-    size_t n = vec.len(files);
-    for (size_t i = 0; i < n; i++) {
-        file_t *f = vec.index(files, i);
-        size_t f1 = f->beginpos;
-        size_t f2 = f->endpos;
-        if (f2 <= a || f1 >= b) continue;
-
-        size_t af = lib.maxsz(f1, a);
-        size_t bf = lib.minsz(f2, b);
-
-        file_slice_t *x = vec.alloc(l);
-        strcpy(x->path, f->path);
-        x->begin = af - f1;
-        x->length = bf - af;
-    }
-
-    vec.free(files);
-    return l;
-}
-
 // Returns list of files, each file with its begin and
 // end position in the torrent.
 pub vec.t *get_file_list(torrent.info_t *tf) {
@@ -86,85 +55,233 @@ pub vec.t *get_file_list(torrent.info_t *tf) {
     return l;
 }
 
-// Writes a piece slice to disk in directory prefix.
-pub void writeslice(const char *dirpath, torrent.info_t *tf, range_t bs, uint8_t *data) {
-    dbg.m(DBG_TAG, "writing at %s: piece #%zu, range %zu + %zu", dirpath, bs.index, bs.begin, bs.length);
-    if (sliceop(0, dirpath, tf, bs, (char *)data) < 0) {
-        panic("sliceop failed");
+#define MAXOPEN 32
+
+pub typedef {
+    char *path; // full path
+    size_t beginpos;
+    size_t endpos;
+    int slot; // index in the open files or -1
+    bool allocated; // true if the file was preallocated
+} extent_t;
+
+pub typedef {
+    int fd;
+    size_t extent;
+    uint64_t used;
+} openfile_t;
+
+// Storage for a torrent's data in a directory.
+// The table of file extents is built once, so mapping a block to its
+// files is a binary search, and the files are kept open, up to MAXOPEN
+// of them, closing the least recently used one when the limit is hit.
+// Blocks are read and written with pread and pwrite at their offsets,
+// without seeking and without stdio buffers in between.
+pub typedef {
+    char *dir;
+    torrent.info_t *tf;
+    bool writable;
+
+    // File extents, sorted by position in the torrent.
+    extent_t *extents;
+    size_t nextents;
+
+    // Open files.
+    openfile_t *open; // MAXOPEN slots
+    size_t nopen;
+    uint64_t clock; // use counter for the LRU
+
+    uint8_t *piecebuf; // buffer for check_piece
+} storage_t;
+
+// Opens the storage for torrent tf in directory dir.
+// If writable is true, the files are created as needed and preallocated
+// to their full size when first opened.
+pub storage_t *open(const char *dir, torrent.info_t *tf, bool writable) {
+    storage_t *s = calloc!(1, sizeof(storage_t));
+    s->dir = strings.newstr("%s", dir);
+    s->tf = tf;
+    s->writable = writable;
+
+    vec.t *l = get_file_list(tf);
+    s->nextents = vec.len(l);
+    s->extents = calloc!(s->nextents, sizeof(extent_t));
+    for (size_t i = 0; i < s->nextents; i++) {
+        file_t *f = vec.index(l, i);
+        extent_t *e = &s->extents[i];
+        e->path = strings.newstr("%s/%s", dir, f->path);
+        e->beginpos = f->beginpos;
+        e->endpos = f->endpos;
+        e->slot = -1;
     }
+    vec.free(l);
+    s->open = calloc!(MAXOPEN, sizeof(openfile_t));
+    s->piecebuf = calloc!(tf->piece_length, 1);
+    return s;
 }
 
-// Reads a piece slice from disk in directory dirpath.
-pub void readslice(const char *dirpath, torrent.info_t *tf, range_t bs, uint8_t *buf) {
-    dbg.m(DBG_TAG, "reading at %s: piece #%zu, range %zu + %zu", dirpath, bs.index, bs.begin, bs.length);
-    if (sliceop(1, dirpath, tf, bs, (char *)buf) < 0) {
-        panic("sliceop failed");
+pub void close(storage_t *s) {
+    for (size_t i = 0; i < s->nopen; i++) {
+        OS.close(s->open[i].fd);
+    }
+    for (size_t i = 0; i < s->nextents; i++) {
+        free(s->extents[i].path);
     }
+    free(s->extents);
+    free(s->open);
+    free(s->piecebuf);
+    free(s->dir);
+    free(s);
 }
 
-int sliceop(int op, const char *prefix, torrent.info_t *tf, range_t bs, char *buf) {
-    vec.t *locs = map(tf, bs);
-    size_t n = vec.len(locs);
-    int c = 0;
-    for (size_t i = 0; i < n; i++) {
-        file_slice_t *s = vec.index(locs, i);
-        char *path = strings.newstr("%s/%s", prefix, s->path);
-        int r;
-        if (op == 1) {
-            r = _read(path, s, buf);
-        } else {
-            r = _write(path, s, buf);
+// Writes a piece slice to the storage.
+pub bool write(storage_t *s, range_t bs, uint8_t *data) {
+    dbg.m(DBG_TAG, "writing at %s: piece #%zu, range %zu + %zu", s->dir, bs.index, bs.begin, bs.length);
+    return sliceop(s, 0, bs, data);
+}
+
+// Reads a piece slice from the storage.
+pub bool read(storage_t *s, range_t bs, uint8_t *buf) {
+    dbg.m(DBG_TAG, "reading at %s: piece #%zu, range %zu + %zu", s->dir, bs.index, bs.begin, bs.length);
+    return sliceop(s, 1, bs, buf);
+}
+
+bool sliceop(storage_t *s, int op, range_t bs, uint8_t *buf) {
+    // Convert the slice to torrent-global coordinates: [a, b).
+    size_t a = (size_t) bs.index * s->tf->piece_length + bs.begin;
+    size_t b = a + bs.length;
+
+    for (size_t i = find(s, a); i < s->nextents; i++) {
+        extent_t *e = &s->extents[i];
+        if (e->beginpos >= b) break;
+        size_t af = lib.maxsz(e->beginpos, a);
+        size_t bf = lib.minsz(e->endpos, b);
+        if (af >= bf) continue;
+
+        int fd = getfd(s, i);
+        if (fd < 0) {
+            return false;
+        }
+        uint8_t *p = buf + (af - a);
+        size_t n = bf - af;
+        size_t off = af - e->beginpos;
+        dbg.m(DBG_TAG, "= op %d on file %s, range %zu + %zu", op, e->path, off, n);
+        while (n > 0) {
+            int r;
+            if (op == 1) {
+                r = (int) OS.pread(fd, p, n, (off_t) off);
+            } else {
+                r = (int) OS.pwrite(fd, p, n, (off_t) off);
+            }
+            if (r < 0 && errno == OS.EINTR) continue;
+            if (r <= 0) {
+                // A read past the end means the file is short.
+                return false;
+            }
+            p += r;
+            n -= (size_t) r;
+            off += (size_t) r;
         }
-        free(path);
-        if (r < 0) {
-            c = -1;
-            break;
+    }
+    return true;
+}
+
+// Returns the index of the first extent that ends after position pos.
+size_t find(storage_t *s, size_t pos) {
+    size_t lo = 0;
+    size_t hi = s->nextents;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (s->extents[mid].endpos <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        c += r;
     }
-    vec.free(locs);
-    return c;
+    return lo;
 }
 
-int _write(const char *path, file_slice_t *s, char *buf) {
-    dbg.m(DBG_TAG, "= writing file %s, range %zu + %zu", path, s->begin, s->length);
-    FILE *f = fopen(path, "r+b");
-    if (!f) f = fopen(path, "w+b");
-    if (!f) return -1;
-    if (fseek(f, s->begin, SEEK_SET) < 0) return -1;
-    dbg.m(DBG_TAG, "fseek %zu -> %d", s->begin, ftell(f));
-    size_t r = fwrite(buf, 1, s->length, f);
-    dbg.m(DBG_TAG, "fwrite: expected %zu, got %zu", s->length, r);
-    fclose(f);
-    return (int) r;
+// Returns the open descriptor for extent i, opening the file if needed.
+// Returns -1 on failure.
+int getfd(storage_t *s, size_t i) {
+    extent_t *e = &s->extents[i];
+    s->clock++;
+    if (e->slot >= 0) {
+        s->open[e->slot].used = s->clock;
+        return s->open[e->slot].fd;
+    }
+
+    int fd;
+    if (s->writable) {
+        mkdirs(e->path);
+        fd = OS.open(e->path, OS.O_RDWR | OS.O_CREAT, 0644);
+    } else {
+        fd = OS.open(e->path, OS.O_RDONLY);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (s->writable && !e->allocated) {
+        // Reserve the whole file at once so that it doesn't get
+        // fragmented by blocks arriving out of order. Not all file
+        // systems support it, and it's only an optimization.
+        OS.posix_fallocate(fd, 0, (off_t) (e->endpos - e->beginpos));
+        e->allocated = true;
+    }
+
+    size_t slot = s->nopen;
+    if (s->nopen < MAXOPEN) {
+        s->nopen++;
+    } else {
+        // Evict the least recently used file.
+        slot = 0;
+        for (size_t j = 1; j < s->nopen; j++) {
+            if (s->open[j].used < s->open[slot].used) slot = j;
+        }
+        openfile_t *old = &s->open[slot];
+        OS.close(old->fd);
+        s->extents[old->extent].slot = -1;
+    }
+    s->open[slot].fd = fd;
+    s->open[slot].extent = i;
+    s->open[slot].used = s->clock;
+    e->slot = (int) slot;
+    return fd;
 }
 
-int _read(const char *path, file_slice_t *s, char *buf) {
-    dbg.m(DBG_TAG, "= reading file %s, range %zu + %zu", path, s->begin, s->length);
-    FILE *f = fopen(path, "rb");
-    if (!f) return -1;
-    if (fseek(f, s->begin, SEEK_SET) < 0) return -1;
-    size_t r = fread(buf, 1, s->length, f);
-    dbg.m(DBG_TAG, "fread: expected %lu, got %zu\n", s->length, r);
-    fclose(f);
-    return (int) r;
+// Creates the parent directories of the file at path.
+void mkdirs(const char *path) {
+    char tmp[4096] = {};
+    if (strlen(path) >= sizeof(tmp)) {
+        return;
+    }
+    strcpy(tmp, path);
+    for (char *p = tmp + 1; *p != '\0'; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        OS.mkdir(tmp, 0755);
+        *p = '/';
+    }
 }
 
-pub bool check_piece(const char *prefix, torrent.info_t *tf, size_t piece_index) {
+pub bool check_piece(storage_t *s, size_t piece_index) {
+    torrent.info_t *tf = s->tf;
     uint8_t hash1[20];
     torrent.piecehash(tf, piece_index, hash1);
 
     //
     // read the piece
     //
-    uint8_t *piece = calloc!(tf->piece_length, 1);
+    uint8_t *piece = s->piecebuf;
     size_t piecelen = get_piece_length(tf, piece_index);
     range_t bs = {
         .index = piece_index,
         .begin = 0,
         .length = piecelen
     };
-    readslice(prefix, tf, bs, piece);
+    if (!read(s, bs, piece)) {
+        return false;
+    }
     // ----------------
     
     //
@@ -172,17 +289,135 @@ pub bool check_piece(const char *prefix, torrent.info_t *tf, size_t piece_index)
     //
     uint8_t hash2[20];
     sha1.digest_t digest = {};
-	for (size_t i = 0; i < piecelen; i++) {
-		sha1.add(&digest, piece[i]);
-	}
+	sha1.update(&digest, piece, piecelen);
 	sha1.end(&digest);
 	sha1.as_bytes(&digest, hash2);
     //
 
-    free(piece);
     return memcmp(hash1, hash2, 20) == 0;
 }
 
+// State shared by the hashing workers.
+typedef {
+    const char *dir;
+    torrent.info_t *tf;
+    uint8_t *out;
+
+    threads.mtx_t *lock;
+    size_t next; // next piece to hash
+    bool failed;
+} hashjob_t;
+
+// Computes the SHA-1 hashes of all pieces of torrent tf stored in dir and
+// puts them into out, 20 bytes per piece in piece order. The pieces are
+// read and hashed by nthreads workers, each taking the next piece in turn
+// and reading it whole with its own storage handle.
+// Pieces that can't be read get a zero hash.
+// Returns false if any piece couldn't be read.
+pub bool hash_pieces(const char *dir, torrent.info_t *tf, size_t nthreads, uint8_t *out) {
+    if (nthreads == 0) nthreads = 1;
+    hashjob_t job = {
+        .dir = dir,
+        .tf = tf,
+        .out = out,
+        .lock = threads.mtx_new()
+    };
+    threads.thr_t **tt = calloc!(nthreads, sizeof(threads.thr_t *));
+    for (size_t i = 0; i < nthreads; i++) {
+        tt[i] = threads.start(&hashworker, &job);
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        threads.wait(tt[i], NULL);
+    }
+    free(tt);
+    threads.mtx_free(job.lock);
+    return !job.failed;
+}
+
+void *hashworker(void *arg) {
+    hashjob_t *job = arg;
+    storage_t *s = open(job->dir, job->tf, false);
+    size_t n = torrent.npieces(job->tf);
+    while (true) {
+        threads.lock(job->lock);
+        size_t i = job->next++;
+        threads.unlock(job->lock);
+        if (i >= n) break;
+
+        uint8_t *hash = job->out + i * 20;
+        range_t bs = {
+            .index = i,
+            .begin = 0,
+            .length = get_piece_length(job->tf, i)
+        };
+        if (!read(s, bs, s->piecebuf)) {
+            memset(hash, 0, 20);
+            threads.lock(job->lock);
+            job->failed = true;
+            threads.unlock(job->lock);
+            continue;
+        }
+        sha1.digest_t digest = {};
+        sha1.update(&digest, s->piecebuf, bs.length);
+        sha1.end(&digest);
+        sha1.as_bytes(&digest, hash);
+    }
+    close(s);
+    return NULL;
+}
+
+// Checks all pieces of torrent tf stored in dir with nthreads workers.
+// Returns a bitfield of the good pieces in the protocol's layout, which
+// the caller frees.
+pub uint8_t *verify(const char *dir, torrent.info_t *tf, size_t nthreads) {
+    size_t n = torrent.npieces(tf);
+    uint8_t *hashes = calloc!(n + 1, 20);
+    hash_pieces(dir, tf, nthreads, hashes);
+    uint8_t *bits = calloc!(n / 8 + 1, 1);
+    for (size_t i = 0; i < n; i++) {
+        if (!memcmp(hashes + i * 20, tf->pieces + i * 20, 20)) {
+            bits[i / 8] |= 1 << (7 - i % 8);
+        }
+    }
+    free(hashes);
+    return bits;
+}
+
+// Writes bitfield bits of torrent tf to the file at path.
+pub bool save_bitfield(const char *path, torrent.info_t *tf, uint8_t *bits) {
+    size_t n = torrent.npieces(tf);
+    size_t nbytes = n / 8;
+    if (nbytes * 8 < n) nbytes++;
+    return fs.writefile(path, (char *) bits, nbytes);
+}
+
+// Reads a bitfield of torrent tf saved with save_bitfield.
+// Returns NULL if the file can't be read or is of the wrong size.
+pub uint8_t *load_bitfield(const char *path, torrent.info_t *tf) {
+    size_t n = torrent.npieces(tf);
+    size_t nbytes = n / 8;
+    if (nbytes * 8 < n) nbytes++;
+    size_t size = 0;
+    char *data = fs.readfile(path, &size);
+    if (!data) {
+        return NULL;
+    }
+    if (size != nbytes) {
+        free(data);
+        errno = OS.EINVAL;
+        return NULL;
+    }
+    uint8_t *bits = calloc!(n / 8 + 1, 1);
+    memcpy(bits, data, size);
+    free(data);
+    return bits;
+}
+
+// Returns true if piece i is set in bitfield bits.
+pub bool hasbit(uint8_t *bits, size_t i) {
+    return bits[i / 8] & (1 << (7 - i % 8));
+}
+
 // Returns the length in bytes of the piece with index i.
 pub size_t get_piece_length(torrent.info_t *tf, size_t i) {
     size_t n = torrent.npieces(tf);
@@ -143,6 +143,9 @@ pub void listen(const char *addr, handler_t *handler) {
     client_t *c = addclient(conn, handler);
     if (!conn || !c) panic("listen failed");
     c->is_listener = true;
+    // Non-blocking, so that all pending connections can be accepted
+    // in one go.
+    if (!net.set_nonblock(conn, true)) panic("set_nonblock failed");
 }
 
 // Schedules a connect task with the handler processing the new connection's
@@ -157,6 +160,8 @@ pub void connect(const char *addr, handler_t *handler, void *initdata) {
         removeclient(c);
         return;
     }
+    // Peer messages are small, don't let them wait for acks.
+    net.set_nodelay(conn, true);
     handler(c, CONNECTED, initdata);
 }
 
@@ -277,7 +282,7 @@ int create_selection(fd_set *rset, *wset) {
 }
 
 void dispatch_updates(fd_set *rset, *wset) {
-    char buf[4096];
+    char buf[65536];
     for (int i = 0; i < 100; i++) {
         client_t *c = clients[i];
         if (!c) continue;
@@ -287,13 +292,25 @@ void dispatch_updates(fd_set *rset, *wset) {
 
         if (readable) {
             if (c->is_listener) {
-                // We'll accept the connection and store it as a new client.
-                // The next loop run will start processing the new client.
-                net.net_t *conn2 = net.net_accept(c->conn);
-                client_t *c2 = addclient(conn2, c->handler);
-                callhandler(c2, CONNECTED, NULL);
+                // We'll accept the connections and store them as new clients.
+                // The next loop run will start processing the new clients.
+                net.net_t *accepted[16] = {};
+                size_t n = net.accept_batch(c->conn, accepted, nelem(accepted));
+                for (size_t j = 0; j < n; j++) {
+                    net.net_t *conn2 = accepted[j];
+                    net.set_nonblock(conn2, true);
+                    net.set_nodelay(conn2, true);
+                    client_t *c2 = addclient(conn2, c->handler);
+                    if (!c2) {
+                        // No free slots, turn the connection away.
+                        dbg.m(DBG_TAG, "too many clients, closing %s", conn2->addrstr);
+                        net.close(conn2);
+                        continue;
+                    }
+                    callhandler(c2, CONNECTED, NULL);
+                }
             } else {
-                int datalen = OS.read(c->conn->fd, buf, sizeof(buf));
+                int datalen = net.read(c->conn, buf, sizeof(buf));
                 dbg.m(DBG_TAG, "#%d: read %d, %s", i, datalen, strerror(errno));
                 if (datalen < 0) {
 					// EAGAIN (11) means the non-blocking socket is not ready
@@ -315,14 +332,9 @@ void dispatch_updates(fd_set *rset, *wset) {
             if (buffer.size(c->outgoing) == 0) {
                 panic("selected as writable but outbuffer is empty");
             }
-            // Here we're happily assuming that all bytes from buf will be
-            // written out and panic in case of partial writes.
-            size_t n = buffer.read(c->outgoing, buf, sizeof(buf));
-            int r = OS.write(c->conn->fd, buf, n);
-            if ((size_t) r != n) {
-                panic("partial write");
-            }
-            if (buffer.size(c->outgoing) == 0) {
+            if (!flush(c)) {
+                c->close = true;
+            } else if (buffer.size(c->outgoing) == 0) {
                 callhandler(c, WRITE_FINISHED, NULL);
             }
         }
@@ -335,6 +347,28 @@ void dispatch_updates(fd_set *rset, *wset) {
 	}
 }
 
+// Sends as much of the outgoing data as the socket takes without
+// blocking, straight from the outgoing buffer. Whatever wasn't taken
+// stays in the buffer for the next round.
+// Returns false on a connection error.
+bool flush(client_t *c) {
+    while (true) {
+        size_t n = 0;
+        char *data = buffer.peek(c->outgoing, &n);
+        if (!data) {
+            return true;
+        }
+        int r = net.write(c->conn, data, n);
+        if (r < 0) {
+            return errno == OS.EAGAIN;
+        }
+        buffer.skip(c->outgoing, (size_t) r);
+        if ((size_t) r < n) {
+            return true;
+        }
+    }
+}
+
 void callhandler(client_t *c, int event, void *data) {
     if (event == DATA_IN) {
         buff_t *b = data;
@@ -4,6 +4,7 @@
 #import ioloop.c
 #import peerproto.c
 #import reader
+#import sched.c
 #import writer
 #import enc/hex
 
@@ -13,6 +14,13 @@ uint8_t tmpbuf1[1000000] = {};
 uint8_t tmpbuf2[1000000] = {};
 const char *outdir = "download";
 
+// Where the seeded data is read from and where downloads go.
+files.storage_t *seeding = NULL;
+files.storage_t *downloads = NULL;
+
+// Pieces offered to downloaders, NULL meaning all.
+uint8_t *seeding_bits = NULL;
+
 pub typedef {
     int foo;
 } init_t;
@@ -22,9 +30,32 @@ const char *TAG = "peer";
 pub bool init(torrent.info_t *tf, uint8_t *peer_id) {
 	_tf = tf;
 	_peer_id = peer_id;
+	seeding = files.open(".", tf, false);
 	return true;
 }
 
+// Limits the pieces offered to downloaders to the ones set in bits.
+pub void set_seeding_bits(uint8_t *bits) {
+	seeding_bits = bits;
+}
+
+// Marks the pieces set in bits as already downloaded.
+pub void resume(uint8_t *bits) {
+	size_t n = torrent.npieces(_tf);
+	for (size_t i = 0; i < n; i++) {
+		if (files.hasbit(bits, i)) {
+			sched.verified(i, true);
+		}
+	}
+}
+
+// Sets up the download scheduler with depth outstanding block requests
+// per peer.
+pub void init_download(size_t depth) {
+	downloads = files.open(outdir, _tf, true);
+	sched.init(_tf, depth, cancel);
+}
+
 enum {
 	WAITING_HANDSHAKE,
     READING_MESSAGE_LENGTH,
@@ -37,7 +68,7 @@ typedef {
     size_t stashlen;
 
     bool is_downloader;
-    size_t next_req_piece;
+    sched.peer_t *sp;
 } peer_t;
 
 void shift(peer_t *p, size_t n) {
@@ -81,6 +112,7 @@ pub void handle(void *ctx, int event, void *edata) {
         case ioloop.CONNECTED: {
             peer_t *p = calloc!(1, sizeof(peer_t));
             ioloop.set_stash(ctx, p);
+            addconn(ctx);
 
             init_t *cfg = edata;
             if (cfg) {
@@ -89,23 +121,31 @@ pub void handle(void *ctx, int event, void *edata) {
                 //
                 // send a handshake
                 //
-				uint8_t buf[1000];
-				writer.t *w = writer.static_buffer(buf, sizeof(buf));
+				// The bitfield takes a bit per piece, which is too much for
+				// a small buffer on big torrents.
+				writer.t *w = writer.static_buffer(tmpbuf2, sizeof(tmpbuf2));
                 if (peerproto.write_handshake(w, (uint8_t*)tf->infohash_bytes, peer_id) < 0) {
                     panic("write_handshake failed");
                 }
-                peerproto.write_bitfield(w, tf);
+                if (peerproto.write_bitfield(w, tf, sched.bitfield()) < 0) {
+                    panic("write_bitfield failed");
+                }
                 size_t nw = w->nwritten;
 				writer.free(w);
-				ioloop.write(ctx, (char *)buf, nw);
+				if (!ioloop.write(ctx, (char *)tmpbuf2, nw)) panic("write failed");
 
-				request_pieces(ctx);
+				// The requests start when the peer unchokes us.
+				p->sp = sched.addpeer(ctx);
             } else {
                 printf("%s: new connection, init=NULL\n", NAME);
             }
         }
         case ioloop.EXIT: {
             peer_t *p = ioloop.get_stash(ctx);
+            if (p && p->sp) {
+                sched.removepeer(p->sp);
+            }
+            removeconn(ctx);
             free(p);
         }
         case ioloop.DATA_IN: {
@@ -211,6 +251,9 @@ void write_response(void *ctx, writer.t *w, peer_t *state, req_t *req) {
             if (peerproto.write_handshake(w, (uint8_t *)tf->infohash_bytes, peer_id) < 0) {
                 panic("write handshake failed");
             }
+            if (peerproto.write_bitfield(w, tf, seeding_bits) < 0) {
+                panic("write_bitfield failed");
+            }
         }
         return;
     }
@@ -225,11 +268,44 @@ void write_response(void *ctx, writer.t *w, peer_t *state, req_t *req) {
     peerproto.msg_t *msg = (void *) req->data;
     switch (msg->id) {
         case peerproto.MSG_BITFIELD: {
-            bool *flags = (void*) msg->data;
-            size_t npieces = torrent.npieces(tf);
-            for (size_t i = 0; i < npieces; i++) {
-                printf("peer has %zu: %d\n", i, flags[i]);
+            peerproto.msg_bitfield_t *bf = (void*) msg->data;
+            if (state->sp) {
+                // The requests start when the peer unchokes us.
+                sched.setbitfield(state->sp, bf->bits, bf->size);
+                if (peerproto.write_interested(w) < 0) {
+                    panic("write_interested failed");
+                }
             }
+            free(bf->bits);
+        }
+        case peerproto.MSG_CHOKE: {
+            if (state->sp) {
+                sched.setchoked(state->sp, true);
+            }
+        }
+        case peerproto.MSG_UNCHOKE: {
+            if (state->sp) {
+                sched.setchoked(state->sp, false);
+                request_pieces(ctx);
+            }
+        }
+        case peerproto.MSG_INTERESTED: {
+            // Everyone who asks may download.
+            if (peerproto.write_unchoke(w) < 0) {
+                panic("write_unchoke failed");
+            }
+        }
+        case peerproto.MSG_NOT_INTERESTED: {}
+        case peerproto.MSG_HAVE: {
+            uint32_t *index = (void *) msg->data;
+            if (state->sp) {
+                sched.have(state->sp, *index);
+                request_pieces(ctx);
+            }
+        }
+        case peerproto.MSG_CANCEL: {
+            // Requests are answered as soon as they arrive, so there's
+            // nothing queued to withdraw.
         }
         case peerproto.MSG_REQUEST: {
             peerproto.msg_request_t *req = (void *) msg->data;
@@ -239,7 +315,9 @@ void write_response(void *ctx, writer.t *w, peer_t *state, req_t *req) {
                 .begin = req->begin,
                 .length = req->length
             };
-            files.readslice(".", tf, freq, tmpbuf1);
+            if (!files.read(seeding, freq, tmpbuf1)) {
+                panic("failed to read (%u, %u, %u): %s", freq.index, freq.begin, freq.length, strerror(errno));
+            }
             if (peerproto.write_piece(w, freq, tmpbuf1) < 0) {
                 panic("oops, writer pos is %zu", w->nwritten);
             }
@@ -252,14 +330,34 @@ void write_response(void *ctx, writer.t *w, peer_t *state, req_t *req) {
                 .begin = piece->begin,
                 .length = piece->length
             };
-            files.writeslice(outdir, tf, freq, piece->data);
-            if (files.check_piece(outdir, tf, freq.index)) {
-                printf("piece %u OK\n", freq.index);
-                request_pieces(ctx);
+            if (!state->sp) {
+                panic("got a piece on a seeding connection");
             }
+            if (!sched.wanted(freq)) {
+                // Unrequested, a late endgame duplicate or of the wrong
+                // size. Its piece may already be checked, so don't touch it.
+                dbg.m(TAG, "dropping slice (%u, %u, %u)", freq.index, freq.begin, freq.length);
+                sched.reject(state->sp, freq);
+            } else {
+                if (!files.write(downloads, freq, piece->data)) {
+                    panic("failed to write (%u, %u, %u): %s", freq.index, freq.begin, freq.length, strerror(errno));
+                }
+                if (sched.received(state->sp, freq)) {
+                    bool ok = files.check_piece(downloads, freq.index);
+                    sched.verified(freq.index, ok);
+                    if (ok) {
+                        printf("piece %u OK (%zu/%zu)\n", freq.index, sched.count(), torrent.npieces(tf));
+                        announce(freq.index);
+                    } else {
+                        printf("piece %u failed the check\n", freq.index);
+                    }
+                }
+            }
+            free(piece->data);
+            request_pieces(ctx);
         }
         default: {
-            panic("!");
+            dbg.m(TAG, "ignoring message %u", msg->id);
         }
     }
 }
@@ -270,36 +368,73 @@ void write_response(void *ctx, writer.t *w, peer_t *state, req_t *req) {
 //     fs.writefile(path, (char *)data, n);
 // }
 
+// Fills the peer's request pipeline with the blocks the scheduler picks.
 void request_pieces(void *ctx) {
     peer_t *state = ioloop.get_stash(ctx);
-    torrent.info_t *tf = _tf;
-
-    printf("next piece to request: %zu\n", state->next_req_piece);
-    size_t slice_size = 16 * 1024;
-    size_t i = state->next_req_piece;
-    if (i >= torrent.npieces(tf)) {
-        printf("no more pieces to request\n");
-        return;
-    }
-    size_t piecelen = files.get_piece_length(tf, i);
+    uint8_t buf[4096];
+    writer.t *w = writer.static_buffer(buf, sizeof(buf));
     size_t c = 0;
-    writer.t *w = writer.static_buffer(tmpbuf1, sizeof(tmpbuf1));
-    for (size_t pos = 0; pos < piecelen; pos += slice_size) {
-        if (pos + slice_size > piecelen) {
-            slice_size = piecelen - pos;
-        }
-        files.range_t req = {
-            .index = i,
-            .begin = pos,
-            .length = slice_size
-        };
+    files.range_t req = {};
+    while (sched.next(state->sp, &req)) {
         int r = peerproto.write_request(w, req);
         if (r < 0) {
             panic("write_request failed");
         }
         c += r;
     }
-    state->next_req_piece++;
     writer.free(w);
-    ioloop.write(ctx, (char *)tmpbuf1, c);
+    if (c > 0) {
+        ioloop.write(ctx, (char *)buf, c);
+    }
+}
+
+// Connections to all peers, both ways, for announcing new pieces.
+void *conns[100] = {};
+
+void addconn(void *ctx) {
+    for (int i = 0; i < 100; i++) {
+        if (!conns[i]) {
+            conns[i] = ctx;
+            return;
+        }
+    }
+    panic("too many connections");
+}
+
+void removeconn(void *ctx) {
+    for (int i = 0; i < 100; i++) {
+        if (conns[i] == ctx) conns[i] = NULL;
+    }
+}
+
+// Tells every peer that we now have piece i.
+void announce(uint32_t i) {
+    for (int j = 0; j < 100; j++) {
+        void *ctx = conns[j];
+        if (!ctx) continue;
+        // Messages can only go after our handshake, which the seeding
+        // side sends in response to the peer's one.
+        peer_t *p = ioloop.get_stash(ctx);
+        if (!p->is_downloader && p->state == WAITING_HANDSHAKE) continue;
+        uint8_t buf[10];
+        writer.t *w = writer.static_buffer(buf, sizeof(buf));
+        int c = peerproto.write_have(w, i);
+        writer.free(w);
+        if (c < 0) {
+            panic("write_have failed");
+        }
+        ioloop.write(ctx, (char *)buf, c);
+    }
+}
+
+// Sends a cancel for request req, called by the scheduler in the endgame.
+void cancel(void *ctx, files.range_t req) {
+    uint8_t buf[100];
+    writer.t *w = writer.static_buffer(buf, sizeof(buf));
+    int c = peerproto.write_cancel(w, req);
+    writer.free(w);
+    if (c < 0) {
+        panic("write_cancel failed");
+    }
+    ioloop.write(ctx, (char *)buf, c);
 }
@@ -51,9 +51,15 @@ pub int write_handshake(writer.t *w, uint8_t *infohash, *peer_id) {
 }
 
 pub enum {
+    MSG_CHOKE = 0,
+    MSG_UNCHOKE = 1,
+    MSG_INTERESTED = 2,
+    MSG_NOT_INTERESTED = 3,
+    MSG_HAVE = 4,
     MSG_BITFIELD = 5,
     MSG_REQUEST = 6,
-    MSG_PIECE = 7
+    MSG_PIECE = 7,
+    MSG_CANCEL = 8
 }
 
 pub typedef {
@@ -70,6 +76,11 @@ pub typedef {
     uint8_t *data; // the consumer frees it.
 } msg_piece_t;
 
+pub typedef {
+    size_t size; // bytes in bits
+    uint8_t *bits; // one bit per piece, high bit first; the consumer frees it.
+} msg_bitfield_t;
+
 // Reads a message length, which is a uint32.
 // Messages are preceded with their lengths in bytes, not counting the length
 // itself. So the parsing is: 1. read length. 2. msg = read <length> bytes.
@@ -84,10 +95,12 @@ pub uint32_t read_length(reader.t *r) {
 pub void read_message(reader.t *r, uint32_t msglen, msg_t *m) {
     endian.read1(r, &m->id);
     switch (m->id) {
+        // no payload
+        case MSG_CHOKE, MSG_UNCHOKE, MSG_INTERESTED, MSG_NOT_INTERESTED: {}
         // index: uint32be, piece index
         // begin: uint32be, byte offset within the piece
         // length: uint32be, data length, typically 16 KB
-        case MSG_REQUEST: {
+        case MSG_REQUEST, MSG_CANCEL: {
             msg_request_t *req = (void *)m->data;
             endian.read4be(r, &req->index);
             endian.read4be(r, &req->begin);
@@ -104,22 +117,22 @@ pub void read_message(reader.t *r, uint32_t msglen, msg_t *m) {
             piece->data = calloc!(piece->length, 1);
             reader.read(r, piece->data, piece->length);
         }
+        // index: uint32be, the piece the peer now has
+        case MSG_HAVE: {
+            uint32_t *index = (void *)m->data;
+            endian.read4be(r, index);
+        }
         // msglen-1: bytes
         case MSG_BITFIELD: {
-            bool *flags = (void *)m->data;
-            int n = 0;
-            for (uint32_t i = 0; i < msglen-1; i++) {
-                uint8_t byte;
-                reader.read(r, &byte, 1);
-                for (int j = 0; j < 8; j++) {
-                    bool set = byte & (1<<(7-j));
-                    flags[n++] = set;
-                    printf("piece %d: %d\n", i * 8 + (uint32_t) j, set);
-                }
-            }
+            msg_bitfield_t *bf = (void *)m->data;
+            bf->size = msglen-1;
+            bf->bits = calloc!(bf->size + 1, 1);
+            reader.read(r, bf->bits, bf->size);
         }
+        // Extensions we don't support, like the DHT port, are skipped.
         default: {
-            panic("unknown message: %d", m->id);
+            dbg.m(TAG, "skipping message %u", m->id);
+            reader.read(r, NULL, msglen-1);
         }
     }
 }
@@ -129,11 +142,41 @@ pub int write_keepalive(writer.t *w) {
     return endian.write4be(w, 0);
 }
 
+// Tells the peer that we want to download from it.
+pub int write_interested(writer.t *w) {
+    dbg.m(TAG, "write_interested");
+    return write_state(w, MSG_INTERESTED);
+}
+
+// Tells the peer that it may request pieces from us.
+pub int write_unchoke(writer.t *w) {
+    dbg.m(TAG, "write_unchoke");
+    return write_state(w, MSG_UNCHOKE);
+}
+
+int write_state(writer.t *w, uint8_t id) {
+    int c = 0;
+    c += endian.write4be(w, 1);
+    c += endian.write1(w, id);
+    if (c != 4 + 1) return -1;
+    return c;
+}
+
 pub int write_request(writer.t *w, files.range_t req) {
     dbg.m(TAG, "write_request");
+    return write_range(w, MSG_REQUEST, req);
+}
+
+// Withdraws a request made earlier with write_request.
+pub int write_cancel(writer.t *w, files.range_t req) {
+    dbg.m(TAG, "write_cancel");
+    return write_range(w, MSG_CANCEL, req);
+}
+
+int write_range(writer.t *w, uint8_t id, files.range_t req) {
     int c = 0;
     c += endian.write4be(w, 13); // length
-    c += endian.write1(w, MSG_REQUEST);
+    c += endian.write1(w, id);
     c += endian.write4be(w, req.index);
     c += endian.write4be(w, req.begin);
     c += endian.write4be(w, req.length);
@@ -153,7 +196,10 @@ pub int write_piece(writer.t *w, files.range_t req, uint8_t *data) {
     return c;
 }
 
-pub int write_bitfield(writer.t *w, torrent.info_t *tf) {
+// Writes a bitfield message with the pieces that are set in bits,
+// or with all pieces if bits is NULL.
+// Returns -1 if the message didn't fit into w.
+pub int write_bitfield(writer.t *w, torrent.info_t *tf, uint8_t *bits) {
     dbg.m(TAG, "write_bitfield");
     size_t npieces = torrent.npieces(tf);
     size_t nbytes = npieces / 8;
@@ -168,7 +214,21 @@ pub int write_bitfield(writer.t *w, torrent.info_t *tf) {
         for (size_t i = 0; i < chunksize; i++) {
             byte |= 1<<(7-i);
         }
+        if (bits) {
+            byte &= bits[piece / 8];
+        }
         c += writer.write(w, &byte, 1);
     }
+    if (c != 4 + 1 + (int) nbytes) return -1;
+    return c;
+}
+
+pub int write_have(writer.t *w, uint32_t index) {
+    dbg.m(TAG, "write_have");
+    int c = 0;
+    c += endian.write4be(w, 5);
+    c += endian.write1(w, MSG_HAVE);
+    c += endian.write4be(w, index);
+    if (c != 4 + 5) return -1;
     return c;
 }
@@ -0,0 +1,413 @@
+#import dbg
+#import files.c
+#import formats/torrent
+
+// The download scheduler decides which blocks to request from which peer.
+// Pieces are split into 16 KB blocks, and every peer keeps a pipeline of
+// up to `depth` outstanding block requests, so that the link stays busy
+// while the responses are in flight. New pieces are picked rarest first,
+// counting how many connected peers have each piece, and a piece that has
+// been started is finished before a new one is started. When every
+// missing block has been requested, the scheduler goes into the endgame
+// mode and requests the remaining blocks from other peers too, cancelling
+// the duplicates once a block arrives.
+
+const char *TAG = "sched";
+
+#define BLOCK_SIZE 16384
+#define MAX_DEPTH 64
+
+// Function that sends a cancel for request r to the peer with context ctx.
+pub typedef void cancel_func_t(void *, files.range_t);
+
+// A connected peer as seen by the scheduler.
+pub typedef {
+	void *ctx; // the peer's connection context, passed to the cancel func
+
+	bool *has; // which pieces the peer has
+	bool has_bitfield;
+	bool choked; // the peer doesn't take requests from us
+
+	// Outstanding requests.
+	files.range_t out[MAX_DEPTH];
+	size_t nout;
+
+	// Piece the peer is currently downloading blocks from,
+	// or -1 if none.
+	int cur;
+} peer_t;
+
+typedef {
+	uint8_t nreq; // number of peers that have the block requested
+	bool received;
+} block_t;
+
+typedef {
+	size_t nblocks;
+	size_t nreceived;
+	size_t availability; // number of peers that have the piece
+	block_t *blocks;
+} piece_t;
+
+torrent.info_t *_tf = NULL;
+cancel_func_t *_cancel = NULL;
+size_t _depth = 32;
+
+piece_t *pieces = NULL;
+size_t npieces = 0;
+size_t nverified = 0;
+uint8_t *verified_bits = NULL; // bitfield of verified pieces, MSB first
+
+// Number of blocks that are neither received nor requested.
+// When it drops to zero, the download is in the endgame.
+size_t nfree = 0;
+
+peer_t *peers[100] = {};
+
+// Initializes the scheduler for torrent tf.
+// depth is the number of outstanding requests per peer, and cancel is
+// called when an endgame duplicate request has to be withdrawn.
+pub void init(torrent.info_t *tf, size_t depth, cancel_func_t *cancel) {
+	if (depth == 0 || depth > MAX_DEPTH) {
+		panic("pipeline depth must be in 1..%d, got %zu", MAX_DEPTH, depth);
+	}
+	_tf = tf;
+	_depth = depth;
+	_cancel = cancel;
+	npieces = torrent.npieces(tf);
+	pieces = calloc!(npieces, sizeof(piece_t));
+	verified_bits = calloc!(npieces / 8 + 1, 1);
+	for (size_t i = 0; i < npieces; i++) {
+		piece_t *p = &pieces[i];
+		size_t len = files.get_piece_length(tf, i);
+		p->nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		p->blocks = calloc!(p->nblocks, sizeof(block_t));
+		nfree += p->nblocks;
+	}
+}
+
+// Registers a new peer with connection context ctx.
+pub peer_t *addpeer(void *ctx) {
+	int slot = -1;
+	for (int i = 0; i < 100; i++) {
+		if (!peers[i]) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot == -1) panic("too many peers");
+	peer_t *p = calloc!(1, sizeof(peer_t));
+	p->ctx = ctx;
+	p->has = calloc!(npieces, sizeof(bool));
+	p->cur = -1;
+	// Peers start out choking.
+	p->choked = true;
+	peers[slot] = p;
+	return p;
+}
+
+// Unregisters peer p, returning its outstanding requests to the pool.
+pub void removepeer(peer_t *p) {
+	for (size_t i = 0; i < p->nout; i++) {
+		release(p->out[i]);
+	}
+	for (size_t i = 0; i < npieces; i++) {
+		if (p->has[i]) pieces[i].availability--;
+	}
+	for (int i = 0; i < 100; i++) {
+		if (peers[i] == p) peers[i] = NULL;
+	}
+	free(p->has);
+	free(p);
+}
+
+// Records the peer's bitfield of size bytes, in the protocol's layout.
+// Pieces past the end of a short bitfield are taken as missing.
+pub void setbitfield(peer_t *p, uint8_t *bits, size_t size) {
+	for (size_t i = 0; i < npieces && i / 8 < size; i++) {
+		if (files.hasbit(bits, i)) have(p, i);
+	}
+	p->has_bitfield = true;
+}
+
+// Records that the peer has piece i.
+pub void have(peer_t *p, size_t i) {
+	if (i >= npieces || p->has[i]) return;
+	p->has[i] = true;
+	pieces[i].availability++;
+}
+
+// Records that the peer has choked or unchoked us. A choking peer
+// drops the requests it has, so they go back to the pool.
+pub void setchoked(peer_t *p, bool choked) {
+	p->choked = choked;
+	if (!choked) return;
+	for (size_t i = 0; i < p->nout; i++) {
+		release(p->out[i]);
+	}
+	p->nout = 0;
+}
+
+// Returns true if the peer can take another request.
+pub bool canrequest(peer_t *p) {
+	return p->has_bitfield && !p->choked && p->nout < _depth && !done();
+}
+
+// Picks the next block to request from peer p and puts it into r.
+// The request is recorded as outstanding for the peer.
+// Returns false if there is nothing to request from the peer.
+pub bool next(peer_t *p, files.range_t *r) {
+	if (!canrequest(p)) {
+		return false;
+	}
+	// Keep filling the current piece.
+	if (p->cur < 0 || !freeblock(p, (size_t) p->cur, r)) {
+		p->cur = pick(p);
+		if (p->cur < 0 || !freeblock(p, (size_t) p->cur, r)) {
+			return endgame(p, r);
+		}
+	}
+	take(p, *r);
+	return true;
+}
+
+// Returns the piece to download from peer p next: a started piece if
+// there is one, otherwise the rarest piece among the peer's ones.
+// Returns -1 if the peer has no pieces with free blocks.
+int pick(peer_t *p) {
+	int best = -1;
+	bool beststarted = false;
+	for (size_t i = 0; i < npieces; i++) {
+		piece_t *pc = &pieces[i];
+		if (!p->has[i] || isverified(i) || !hasfree(pc)) {
+			continue;
+		}
+		bool started = pc->nreceived > 0 || pc->nblocks > nfreeblocks(pc);
+		if (best < 0) {
+			best = (int) i;
+			beststarted = started;
+			continue;
+		}
+		if (started != beststarted) {
+			if (started) {
+				best = (int) i;
+				beststarted = true;
+			}
+			continue;
+		}
+		if (pc->availability < pieces[best].availability) {
+			best = (int) i;
+		}
+	}
+	return best;
+}
+
+// In the endgame every missing block has been requested from someone,
+// so blocks are requested again from other peers, whoever is faster wins.
+bool endgame(peer_t *p, files.range_t *r) {
+	if (nfree > 0) {
+		return false;
+	}
+	for (size_t i = 0; i < npieces; i++) {
+		if (!p->has[i] || isverified(i)) continue;
+		piece_t *pc = &pieces[i];
+		for (size_t j = 0; j < pc->nblocks; j++) {
+			if (pc->blocks[j].received) continue;
+			*r = blockrange(i, j);
+			if (outstanding(p, *r) >= 0) continue;
+			dbg.m(TAG, "endgame: requesting (%u, %u) again", r->index, r->begin);
+			take(p, *r);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Records a received block r from peer p.
+// Returns true if the block completed its piece, which is then ready to
+// be verified.
+pub bool received(peer_t *p, files.range_t r) {
+	if (r.index >= npieces || r.begin % BLOCK_SIZE != 0) {
+		return false;
+	}
+	piece_t *pc = &pieces[r.index];
+	size_t j = r.begin / BLOCK_SIZE;
+	if (j >= pc->nblocks) {
+		return false;
+	}
+	block_t *b = &pc->blocks[j];
+	bool taken = b->nreq > 0;
+	int pos = outstanding(p, r);
+	if (pos >= 0) {
+		untake(p, (size_t) pos);
+	}
+	if (b->received) {
+		// A late endgame duplicate.
+		return false;
+	}
+	// Withdraw the duplicate requests.
+	for (int i = 0; i < 100; i++) {
+		peer_t *q = peers[i];
+		if (!q || q == p) continue;
+		int qpos = outstanding(q, r);
+		if (qpos < 0) continue;
+		untake(q, (size_t) qpos);
+		if (_cancel) _cancel(q->ctx, r);
+	}
+	if (!taken) {
+		// An unsolicited block: it was still counted as free.
+		nfree--;
+	}
+	b->nreq = 0;
+	b->received = true;
+	pc->nreceived++;
+	return pc->nreceived == pc->nblocks;
+}
+
+// Returns true if block r is still needed: a whole block, as it would be
+// requested, of a piece that hasn't been verified, and not received yet.
+// Other blocks must not be written, they could overwrite checked data.
+pub bool wanted(files.range_t r) {
+	if (r.index >= npieces || isverified(r.index) || r.begin % BLOCK_SIZE != 0) {
+		return false;
+	}
+	piece_t *pc = &pieces[r.index];
+	size_t j = r.begin / BLOCK_SIZE;
+	if (j >= pc->nblocks || pc->blocks[j].received) {
+		return false;
+	}
+	return r.length == blockrange(r.index, j).length;
+}
+
+// Records that peer p sent block r, but it wasn't wanted. If it was
+// requested from p, the request goes back to the pool.
+pub void reject(peer_t *p, files.range_t r) {
+	int pos = outstanding(p, r);
+	if (pos < 0) return;
+	files.range_t o = p->out[pos];
+	p->out[pos] = p->out[--p->nout];
+	release(o);
+}
+
+// Records the result of checking piece i. A piece that failed the check
+// is downloaded again.
+pub void verified(size_t i, bool ok) {
+	piece_t *pc = &pieces[i];
+	if (ok) {
+		if (!isverified(i)) {
+			verified_bits[i / 8] |= 1 << (7 - i % 8);
+			nverified++;
+		}
+		// A resumed piece wasn't downloaded, so its blocks still count
+		// as free, which would keep the endgame from starting.
+		for (size_t j = 0; j < pc->nblocks; j++) {
+			block_t *b = &pc->blocks[j];
+			if (b->received) continue;
+			if (b->nreq == 0) nfree--;
+			b->received = true;
+		}
+		pc->nreceived = pc->nblocks;
+		return;
+	}
+	for (size_t j = 0; j < pc->nblocks; j++) {
+		pc->blocks[j].received = false;
+	}
+	pc->nreceived = 0;
+	nfree += pc->nblocks;
+}
+
+pub bool isverified(size_t i) {
+	return verified_bits[i / 8] & (1 << (7 - i % 8));
+}
+
+// Returns true when all pieces have been verified.
+pub bool done() {
+	return nverified == npieces;
+}
+
+// Returns the number of verified pieces.
+pub size_t count() {
+	return nverified;
+}
+
+// Returns the bitfield of verified pieces in the protocol's layout:
+// one bit per piece, the first piece in the high bit of the first byte.
+pub uint8_t *bitfield() {
+	return verified_bits;
+}
+
+// Finds a block in piece i that hasn't been requested yet.
+bool freeblock(peer_t *p, size_t i, files.range_t *r) {
+	if (!p->has[i] || isverified(i)) {
+		return false;
+	}
+	piece_t *pc = &pieces[i];
+	for (size_t j = 0; j < pc->nblocks; j++) {
+		block_t *b = &pc->blocks[j];
+		if (!b->received && b->nreq == 0) {
+			*r = blockrange(i, j);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool hasfree(piece_t *pc) {
+	return nfreeblocks(pc) > 0;
+}
+
+size_t nfreeblocks(piece_t *pc) {
+	size_t n = 0;
+	for (size_t j = 0; j < pc->nblocks; j++) {
+		if (!pc->blocks[j].received && pc->blocks[j].nreq == 0) n++;
+	}
+	return n;
+}
+
+files.range_t blockrange(size_t i, j) {
+	size_t len = files.get_piece_length(_tf, i);
+	size_t begin = j * BLOCK_SIZE;
+	size_t n = BLOCK_SIZE;
+	if (begin + n > len) n = len - begin;
+	files.range_t r = {
+		.index = i,
+		.begin = begin,
+		.length = n
+	};
+	return r;
+}
+
+// Adds r to the peer's outstanding requests.
+void take(peer_t *p, files.range_t r) {
+	block_t *b = &pieces[r.index].blocks[r.begin / BLOCK_SIZE];
+	if (b->nreq == 0) nfree--;
+	b->nreq++;
+	p->out[p->nout++] = r;
+}
+
+// Removes the request at position pos from the peer's outstanding ones.
+void untake(peer_t *p, size_t pos) {
+	files.range_t r = p->out[pos];
+	p->out[pos] = p->out[--p->nout];
+	block_t *b = &pieces[r.index].blocks[r.begin / BLOCK_SIZE];
+	if (b->nreq > 0) b->nreq--;
+}
+
+// Returns a request to the pool when its peer is gone.
+void release(files.range_t r) {
+	block_t *b = &pieces[r.index].blocks[r.begin / BLOCK_SIZE];
+	if (b->received || b->nreq == 0) return;
+	b->nreq--;
+	if (b->nreq == 0) nfree++;
+}
+
+// Returns the position of request r in the peer's outstanding requests,
+// or -1 if it's not there.
+int outstanding(peer_t *p, files.range_t r) {
+	for (size_t i = 0; i < p->nout; i++) {
+		if (p->out[i].index == r.index && p->out[i].begin == r.begin) {
+			return (int) i;
+		}
+	}
+	return -1;
+}
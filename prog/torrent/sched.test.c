@@ -0,0 +1,59 @@
+#import files.c
+#import formats/torrent
+#import sched.c
+#import test
+
+int main() {
+	// Four pieces of four blocks.
+	torrent.info_t tf = {};
+	tf.piece_length = 4 * 16384;
+	tf.length = 4 * tf.piece_length;
+	sched.init(&tf, 8, NULL);
+	uint8_t all[1] = {0xF0};
+	sched.peer_t *a = sched.addpeer(NULL);
+	sched.peer_t *b = sched.addpeer(NULL);
+	sched.setbitfield(a, all, 1);
+	sched.setbitfield(b, all, 1);
+
+	// Nothing is requested until the peers unchoke.
+	files.range_t r = {};
+	test.truth("choked", !sched.next(a, &r));
+	sched.setchoked(a, false);
+	sched.setchoked(b, false);
+
+	// The first three pieces were there before.
+	for (size_t i = 0; i < 3; i++) {
+		sched.verified(i, true);
+	}
+
+	// Peer a gets all blocks of the last piece.
+	for (int i = 0; i < 4; i++) {
+		test.truth("request", sched.next(a, &r));
+		test.truth("missing piece", r.index == 3);
+	}
+
+	// Now every missing block is requested, and peer b gets the
+	// endgame duplicates.
+	test.truth("endgame", sched.next(b, &r));
+	test.truth("endgame piece", r.index == 3);
+
+	// Blocks of checked pieces and blocks of the wrong size are dropped.
+	files.range_t old = {.index = 0, .begin = 0, .length = 16384};
+	test.truth("verified", !sched.wanted(old));
+	files.range_t odd = {.index = 3, .begin = 0, .length = 100};
+	test.truth("size", !sched.wanted(odd));
+
+	for (int i = 0; i < 4; i++) {
+		files.range_t x = {.index = 3, .begin = (size_t) i * 16384, .length = 16384};
+		test.truth("wanted", sched.wanted(x));
+		if (i < 3) {
+			test.truth("incomplete", !sched.received(a, x));
+		} else {
+			test.truth("complete", sched.received(a, x));
+		}
+	}
+	test.truth("duplicate", !sched.wanted(r));
+	sched.verified(3, true);
+	test.truth("done", sched.done());
+	return test.fails();
+}
@@ -2,6 +2,7 @@
 #import cmd_seed.c
 #import cmd_info.c
 #import cmd_download.c
+#import cmd_verify.c
 #import opt
 
 int main(int argc, char *argv[]) {
@@ -9,5 +10,6 @@ int main(int argc, char *argv[]) {
 	opt.addcmd("seed", cmd_seed.run);
 	opt.addcmd("info", cmd_info.run);
 	opt.addcmd("download", cmd_download.run);
+	opt.addcmd("verify", cmd_verify.run);
 	return opt.dispatch(argc, argv);
 }
@@ -4,6 +4,7 @@
 #import protocols/cgi
 #import protocols/http
 #import reader
+#import strbuilder
 #import strings
 
 pub void cgi(char *path, http.request_t *req, net.net_t *conn) {
@@ -30,7 +31,9 @@ pub void cgi(char *path, http.request_t *req, net.net_t *conn) {
 		panic("failed to parse cgi head");
 	}
 
-	net.net_printf(conn, "%s 200 OK\n", req->version);
+	// Compose the head and send it together with the body.
+	strbuilder.str *b = strbuilder.new();
+	strbuilder.addf(b, "%s 200 OK\n", req->version);
 	for (size_t i = 0; i < head.nheaders; i++) {
 		char *name = head.headers[i].name;
 		char *value = head.headers[i].value;
@@ -43,11 +46,18 @@ pub void cgi(char *path, http.request_t *req, net.net_t *conn) {
 		if (!strcmp(name, "Content-Length")) {
 			panic("omitting content length");
 		}
-		net.net_printf(conn, "%s: %s\n", name, value);
+		strbuilder.addf(b, "%s: %s\n", name, value);
 	}
-	net.net_printf(conn, "Content-Length: %zu\r\n", output_size - headsize);
-	net.net_printf(conn, "\r\n", 1);
-	net.write(conn, output + headsize, output_size - headsize);
+	strbuilder.addf(b, "Content-Length: %zu\r\n", output_size - headsize);
+	strbuilder.adds(b, "\r\n");
+	net.iov_t iov[2] = {
+		{ .base = strbuilder.str_raw(b), .len = strbuilder.str_len(b) },
+		{ .base = output + headsize, .len = output_size - headsize },
+	};
+	if (!net.writev_all(conn, iov, 2)) {
+		panic("net write failed");
+	}
+	strbuilder.free(b);
 }
 
 proc.proc_t *start(char *path, http.request_t *req) {
@@ -41,6 +41,9 @@ int main(int argc, char *argv[]) {
 	while (true) {
 		net.net_t *conn = net.net_accept(ln);
 		if (!conn) panic("accept failed");
+		// Responses are written whole, so there's nothing to gain
+		// from Nagle's delays.
+		net.set_nodelay(conn, true);
 
 		log_info("%s connected", net.net_addr(conn));
 